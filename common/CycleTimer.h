@@ -21,8 +21,15 @@
 #  include <string.h>
 #  include <sys/time.h>
 #  include <time.h>
+#  if defined(__x86_64__)
+#    include <cpuid.h>
+#  endif
 #endif
 
+#include <atomic>
+#include <new>
+#include <vector>
+
 
   // This uses the cycle counter of the processor.  Different
   // processors in the system will have different values for this.  If
@@ -35,6 +42,13 @@
   // Also note that if you processors' speeds change (i.e. processors
   // scaling) or if you are in a heterogenous environment, you will
   // likely get spurious results.
+
+  // On Linux, x86-64 uses the TSC when the CPU reports it as invariant
+  // (constant rate, running in every power state, synchronised across
+  // cores), which makes the warnings above moot; its rate is calibrated
+  // against CLOCK_MONOTONIC_RAW on first use.  Otherwise it falls back
+  // to CLOCK_MONOTONIC_RAW in ns.  aarch64 reads the generic timer's
+  // virtual count, cntvct_el0, whose rate is in cntfrq_el0.
   class CycleTimer {
   public:
     typedef unsigned long long SysClock;
@@ -50,23 +64,65 @@
       QueryPerformanceCounter(&qwTime);
       return qwTime.QuadPart;
 #elif defined(__x86_64__)
+#if !defined(__APPLE__)
+      if (!useTsc()) return monotonicNanos();
+#endif
       unsigned int a, d;
       asm volatile("rdtsc" : "=a" (a), "=d" (d));
       return static_cast<unsigned long long>(a) |
         (static_cast<unsigned long long>(d) << 32);
+#elif defined(__aarch64__)
+      SysClock val;
+      asm volatile("mrs %0, cntvct_el0" : "=r"(val));
+      return val;
 #elif defined(__ARM_NEON__) && 0 // mrc requires superuser.
       unsigned int val;
       asm volatile("mrc p15, 0, %0, c9, c13, 0" : "=r"(val));
       return val;
-#elif defined(__ARM_ARCH) 
-      // Use clock_gettime with CLOCK_MONOTONIC_RAW for high-resolution timing
-      timespec spec;
-      clock_gettime(CLOCK_MONOTONIC_RAW, &spec);
-      return static_cast<unsigned long long>(spec.tv_sec) * 1e9 + spec.tv_nsec;
 #else
-      timespec spec;
-      clock_gettime(CLOCK_THREAD_CPUTIME_ID, &spec);
-      return CycleTimer::SysClock(static_cast<float>(spec.tv_sec) * 1e9 + static_cast<float>(spec.tv_nsec));
+      return monotonicNanos();
+#endif
+    }
+
+    //////////
+    // Like currentTicks(), but ordered against the surrounding code:
+    // startTicks() is not read before earlier instructions complete, and
+    // no later instruction starts before stopTicks() is read.  Bracket
+    // short regions with these so that out-of-order execution does not
+    // move work into or out of them.
+    static SysClock startTicks() {
+#if defined(__x86_64__) && !defined(_WIN32)
+#if !defined(__APPLE__)
+      if (!useTsc()) return monotonicNanos();
+#endif
+      unsigned int a, d;
+      asm volatile("lfence\n\trdtsc" : "=a" (a), "=d" (d) : : "memory");
+      return static_cast<unsigned long long>(a) |
+        (static_cast<unsigned long long>(d) << 32);
+#elif defined(__aarch64__) && !defined(__APPLE__)
+      SysClock val;
+      asm volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(val) : : "memory");
+      return val;
+#else
+      return currentTicks();
+#endif
+    }
+
+    static SysClock stopTicks() {
+#if defined(__x86_64__) && !defined(_WIN32)
+#if !defined(__APPLE__)
+      if (!useTsc()) return monotonicNanos();
+#endif
+      unsigned int a, d, c;
+      asm volatile("rdtscp\n\tlfence" : "=a" (a), "=d" (d), "=c" (c) : : "memory");
+      return static_cast<unsigned long long>(a) |
+        (static_cast<unsigned long long>(d) << 32);
+#elif defined(__aarch64__) && !defined(__APPLE__)
+      SysClock val;
+      asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val) : : "memory");
+      return val;
+#else
+      return currentTicks();
 #endif
     }
 
@@ -87,19 +143,80 @@
     static const char* tickUnits() {
 #if defined(__APPLE__) && !defined(__x86_64__)
       return "ns";
-#elif defined(__WIN32__) || defined(__x86_64__)
+#elif defined(__WIN32__)
       return "cycles";
+#elif defined(__x86_64__)
+#if !defined(__APPLE__)
+      if (!useTsc()) return "ns"; // clock_gettime
+#endif
+      return "cycles";
+#elif defined(__aarch64__)
+      return "ticks";
 #else
       return "ns"; // clock_gettime
 #endif
     }
 
     //////////
-    // Return the conversion from ticks to seconds.
+    // Return the conversion from ticks to seconds.  The first call may
+    // calibrate the tick rate, which takes about 2 ms; it is safe to
+    // call from several threads at once.
     static double secondsPerTick() {
-      static bool initialized = false;
-      static double secondsPerTick_val;
-      if (initialized) return secondsPerTick_val;
+      static const double secondsPerTick_val = computeSecondsPerTick();
+      return secondsPerTick_val;
+    }
+
+    //////////
+    // Return the conversion from ticks to milliseconds.
+    static double msPerTick() {
+      return secondsPerTick() * 1000.0;
+    }
+
+  private:
+    CycleTimer();
+
+#if !defined(__APPLE__) && !defined(_WIN32)
+    // CLOCK_MONOTONIC_RAW in ns, in integers: a double (let alone a
+    // float) loses whole ns once the uptime reaches a few months.
+    static SysClock monotonicNanos() {
+      timespec spec;
+      clock_gettime(CLOCK_MONOTONIC_RAW, &spec);
+      return static_cast<SysClock>(spec.tv_sec) * 1000000000ull +
+        static_cast<SysClock>(spec.tv_nsec);
+    }
+#endif
+
+#if defined(__x86_64__) && !defined(__APPLE__) && !defined(_WIN32)
+    // Whether the TSC is invariant and rdtscp exists, looked up once.
+    static bool useTsc() {
+      static const bool use = []() {
+        unsigned int a, b, c, d;
+        if (!__get_cpuid(0x80000001, &a, &b, &c, &d) || !(d & (1u << 27))) return false;
+        return __get_cpuid(0x80000007, &a, &b, &c, &d) && (d & (1u << 8)) != 0;
+      }();
+      return use;
+    }
+
+    // One TSC reading bracketing a clock_gettime() call, the tightest of
+    // a few tries, with the TSC taken halfway through the call.
+    static void sampleTsc(SysClock& tsc, SysClock& ns) {
+      SysClock best = ~0ull;
+      tsc = ns = 0;
+      for (int i = 0; i < 5; i++) {
+        SysClock before = stopTicks();
+        SysClock now = monotonicNanos();
+        SysClock after = stopTicks();
+        if (after - before < best) {
+          best = after - before;
+          tsc = before + (after - before) / 2;
+          ns = now;
+        }
+      }
+    }
+#endif
+
+    static double computeSecondsPerTick() {
+      double secondsPerTick_val;
 #if defined(__APPLE__)
   #ifdef __x86_64__
       int args[] = {CTL_HW, HW_CPU_FREQ};
@@ -122,62 +239,154 @@
       LARGE_INTEGER qwTicksPerSec;
       QueryPerformanceFrequency(&qwTicksPerSec);
       secondsPerTick_val = 1.0/static_cast<double>(qwTicksPerSec.QuadPart);
+#elif defined(__aarch64__)
+      SysClock freq;
+      asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+      secondsPerTick_val = 1.0 / static_cast<double>(freq);
+#elif defined(__x86_64__)
+      if (!useTsc()) return 1e-9;
+      // Count TSC ticks across 2 ms of CLOCK_MONOTONIC_RAW; the sampling
+      // error of a few tens of ns is then around 1e-5 of the rate.
+      SysClock tsc0, ns0, tsc1, ns1;
+      sampleTsc(tsc0, ns0);
+      do {
+        sampleTsc(tsc1, ns1);
+      } while (ns1 - ns0 < 2000000);
+      secondsPerTick_val = 1e-9 * static_cast<double>(ns1 - ns0) /
+        static_cast<double>(tsc1 - tsc0);
 #else
-      FILE *fp = fopen("/proc/cpuinfo","r");
-      char input[1024];
-      if (!fp) {
-         fprintf(stderr, "CycleTimer::resetScale failed: couldn't find /proc/cpuinfo.");
-         exit(-1);
-      }
-      // In case we don't find it, e.g. on the N900
-      secondsPerTick_val = 1e-9;
-      while (!feof(fp) && fgets(input, 1024, fp)) {
-        // NOTE(boulos): Because reading cpuinfo depends on dynamic
-        // frequency scaling it's better to read the @ sign first
-        float GHz, MHz;
-        if (strstr(input, "model name")) {
-          char* at_sign = strstr(input, "@");
-          if (at_sign) {
-            char* after_at = at_sign + 1;
-            char* GHz_str = strstr(after_at, "GHz");
-            char* MHz_str = strstr(after_at, "MHz");
-            if (GHz_str) {
-              *GHz_str = '\0';
-              if (1 == sscanf(after_at, "%f", &GHz)) {
-                //printf("GHz = %f\n", GHz);
-                secondsPerTick_val = 1e-9f / GHz;
-                break;
-              }
-            } else if (MHz_str) {
-              *MHz_str = '\0';
-              if (1 == sscanf(after_at, "%f", &MHz)) {
-                //printf("MHz = %f\n", MHz);
-                secondsPerTick_val = 1e-6f / MHz;
-                break;
-              }
-            }
-          }
-        } else if (1 == sscanf(input, "cpu MHz : %f", &MHz)) {
-          //printf("MHz = %f\n", MHz);
-          secondsPerTick_val = 1e-6f / MHz;
-          break;
-        }
-      }
-      fclose(fp);
+      secondsPerTick_val = 1e-9; // clock_gettime
 #endif
-
-      initialized = true;
       return secondsPerTick_val;
     }
+  };
 
-    //////////
-    // Return the conversion from ticks to milliseconds.
-    static double msPerTick() {
-      return secondsPerTick() * 1000.0;
+  //////////
+  // Adds the ticks between its construction and destruction to a
+  // counter, e.g.
+  //
+  //   CycleTimer::SysClock total = 0;
+  //   { ScopedTimer timer(total); work(); }
+  //
+  // Costs two ordered tick reads, a few ns with the TSC or cntvct_el0.
+  class ScopedTimer {
+  public:
+    explicit ScopedTimer(CycleTimer::SysClock& total)
+      : total_(total), start_(CycleTimer::startTicks()) {}
+    ~ScopedTimer() {
+      total_ += CycleTimer::stopTicks() - start_;
     }
 
   private:
-    CycleTimer();
+    CycleTimer::SysClock& total_;
+    CycleTimer::SysClock start_;
+
+    ScopedTimer(const ScopedTimer&);
+    ScopedTimer& operator=(const ScopedTimer&);
+  };
+
+  //////////
+  // Accumulating timers, one slot per thread (e.g. per worker or per
+  // task id).  Each slot sits on its own pair of cache lines and must
+  // only be written by one thread at a time, so an update is a relaxed
+  // load and store that never contends; other threads may read the
+  // totals at any time.
+  class TimerSlots {
+  public:
+    explicit TimerSlots(int num_slots)
+      : storage_(num_slots * kStride + kStride), num_slots_(num_slots) {
+      size_t addr = reinterpret_cast<size_t>(storage_.data());
+      base_ = storage_.data() + (kStride - addr % kStride) % kStride;
+      for (int i = 0; i < num_slots_; i++) {
+        new (base_ + i * kStride) Slot();
+      }
+    }
+
+    int numSlots() const { return num_slots_; }
+
+    // Adds one timed interval of `ticks` to slot `slot`.
+    void add(int slot, CycleTimer::SysClock ticks) {
+      Slot& s = at(slot);
+      s.ticks.store(s.ticks.load(std::memory_order_relaxed) + ticks,
+                    std::memory_order_relaxed);
+      s.count.store(s.count.load(std::memory_order_relaxed) + 1,
+                    std::memory_order_relaxed);
+    }
+
+    CycleTimer::SysClock ticks(int slot) const {
+      return at(slot).ticks.load(std::memory_order_relaxed);
+    }
+    CycleTimer::SysClock count(int slot) const {
+      return at(slot).count.load(std::memory_order_relaxed);
+    }
+    double seconds(int slot) const {
+      return ticks(slot) * CycleTimer::secondsPerTick();
+    }
+
+    CycleTimer::SysClock totalTicks() const {
+      CycleTimer::SysClock total = 0;
+      for (int i = 0; i < num_slots_; i++) total += ticks(i);
+      return total;
+    }
+    CycleTimer::SysClock totalCount() const {
+      CycleTimer::SysClock total = 0;
+      for (int i = 0; i < num_slots_; i++) total += count(i);
+      return total;
+    }
+    double totalSeconds() const {
+      return totalTicks() * CycleTimer::secondsPerTick();
+    }
+
+    // Not safe while slots are being written.
+    void reset() {
+      for (int i = 0; i < num_slots_; i++) {
+        at(i).ticks.store(0, std::memory_order_relaxed);
+        at(i).count.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    // ScopedTimer that adds to one slot.
+    class Scope {
+    public:
+      Scope(TimerSlots& slots, int slot)
+        : slots_(slots), slot_(slot), start_(CycleTimer::startTicks()) {}
+      ~Scope() {
+        slots_.add(slot_, CycleTimer::stopTicks() - start_);
+      }
+
+    private:
+      TimerSlots& slots_;
+      int slot_;
+      CycleTimer::SysClock start_;
+
+      Scope(const Scope&);
+      Scope& operator=(const Scope&);
+    };
+
+  private:
+    struct Slot {
+      std::atomic<CycleTimer::SysClock> ticks;
+      std::atomic<CycleTimer::SysClock> count;
+      Slot() : ticks(0), count(0) {}
+    };
+
+    // Two 64-byte lines, so that adjacent-line prefetch (x86) and
+    // 128-byte lines (Apple silicon) do not share slots either.
+    static const size_t kStride = 128;
+
+    std::vector<char> storage_;
+    char* base_;
+    int num_slots_;
+
+    Slot& at(int slot) {
+      return *reinterpret_cast<Slot*>(base_ + slot * kStride);
+    }
+    const Slot& at(int slot) const {
+      return *reinterpret_cast<const Slot*>(base_ + slot * kStride);
+    }
+
+    TimerSlots(const TimerSlots&);
+    TimerSlots& operator=(const TimerSlots&);
   };
 
 #endif // #ifndef _SYRAH_CYCLE_TIMER_H_
@@ -0,0 +1,115 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+/*
+ * Log-linear (HDR-style) histogram of non-negative integer values, used
+ * for launch latencies in nanoseconds.  Values below 2^SUB_BUCKET_BITS
+ * get a bucket each; above that, every power of two is split into
+ * 2^SUB_BUCKET_BITS equal buckets, so a reported percentile is within
+ * 1/32 (about 3%) of the true value at any magnitude.  Recording is a
+ * few shifts and an increment into a fixed array.  The histogram is not
+ * synchronized; callers record and query under their own lock.
+ */
+
+#include <math.h>
+#include <string.h>
+
+class LatencyHistogram {
+    public:
+        enum {
+            SUB_BUCKET_BITS = 5,
+            SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+            // Enough octaves for any 64-bit value.
+            NUM_BUCKETS = SUB_BUCKETS * (64 - SUB_BUCKET_BITS + 1),
+        };
+
+    private:
+        unsigned long long counts_[NUM_BUCKETS];
+        unsigned long long total_;
+        unsigned long long min_;
+        unsigned long long max_;
+
+        static inline int highestBit(unsigned long long value) {
+            return 63 - __builtin_clzll(value);
+        }
+
+        static inline int bucketOf(unsigned long long value) {
+            if (value < SUB_BUCKETS) {
+                return (int) value;
+            }
+            int shift = highestBit(value) - SUB_BUCKET_BITS;
+            return SUB_BUCKETS * (shift + 1) + (int) ((value >> shift) - SUB_BUCKETS);
+        }
+
+        // Largest value that falls into `bucket`.
+        static inline unsigned long long bucketMax(int bucket) {
+            if (bucket < SUB_BUCKETS) {
+                return bucket;
+            }
+            int shift = bucket / SUB_BUCKETS - 1;
+            unsigned long long sub = SUB_BUCKETS + bucket % SUB_BUCKETS;
+            return ((sub + 1) << shift) - 1;
+        }
+
+    public:
+        LatencyHistogram() {
+            reset();
+        }
+
+        void reset() {
+            memset(counts_, 0, sizeof(counts_));
+            total_ = 0;
+            min_ = ~0ull;
+            max_ = 0;
+        }
+
+        void record(unsigned long long value) {
+            counts_[bucketOf(value)]++;
+            total_++;
+            if (value < min_) {
+                min_ = value;
+            }
+            if (value > max_) {
+                max_ = value;
+            }
+        }
+
+        unsigned long long count() const {
+            return total_;
+        }
+
+        // Smallest recorded value, or 0 if nothing was recorded.
+        unsigned long long min() const {
+            return total_ ? min_ : 0;
+        }
+
+        unsigned long long max() const {
+            return max_;
+        }
+
+        /*
+          Returns the smallest recorded value v such that at least a
+          fraction `quantile` (in [0, 1]) of the values are <= v, rounded
+          up to the end of its bucket. Returns 0 if nothing was recorded.
+         */
+        unsigned long long percentile(double quantile) const {
+            if (total_ == 0) {
+                return 0;
+            }
+            unsigned long long rank = (unsigned long long) ceil(quantile * total_);
+            if (rank < 1) {
+                rank = 1;
+            }
+            unsigned long long seen = 0;
+            for (int i = 0; i < NUM_BUCKETS; i++) {
+                seen += counts_[i];
+                if (seen >= rank) {
+                    unsigned long long value = bucketMax(i);
+                    return value < max_ ? value : max_;
+                }
+            }
+            return max_;
+        }
+};
+
+#endif
@@ -1,35 +1,343 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <algorithm>
+#include <vector>
 
+#include "CycleTimer.h"
+#include "ppm.h"
 
+// Encoded rows are flushed to the file in writes of about this size.
+#define PPM_WRITE_BUFFER_BYTES (1 << 20)
 
-void
-writePPMImage(int* data, int width, int height, const char *filename, int maxIterations)
+std::vector<unsigned char>
+ppmBrightnessTable(int maxIterations)
 {
-    FILE *fp = fopen(filename, "wb");
+    std::vector<unsigned char> table(std::max(maxIterations, 0) + 1);
+    for (size_t i = 0; i < table.size(); ++i) {
 
-    // write ppm header
-    fprintf(fp, "P6\n");
-    fprintf(fp, "%d %d\n", width, height);
-    fprintf(fp, "255\n");
-
-    for (int i = 0; i < width*height; ++i) {
-
-        // Clamp iteration count for this pixel, then scale the value
-        // to 0-1 range.  Raise resulting value to a power (<1) to
-        // increase brightness of low iteration count
+        // Scale the count to 0-1 range.  Raise resulting value to a
+        // power (<1) to increase brightness of low iteration count
         // pixels. a.k.a. Make things look cooler.
 
-        float mapped = pow( std::min(static_cast<float>(maxIterations),
-                                     static_cast<float>(data[i])) / 256.f, .5f);
+        float mapped = pow(static_cast<float>(i) / 256.f, .5f);
 
         // convert back into 0-255 range, 8-bit channels
-        unsigned char result = static_cast<unsigned char>(255.f * mapped);
-        for (int j = 0; j < 3; ++j)
-            fputc(result, fp);
+        table[i] = static_cast<unsigned char>(std::min(255.f * mapped, 255.f));
+    }
+    return table;
+}
+
+static bool
+writeImage(int* data, int width, int height, const char *filename, int maxIterations,
+           bool rgb)
+{
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        printf("Could not open image file %s\n", filename);
+        return false;
+    }
+    // Every write below is a large block, so skip stdio's own buffer.
+    setvbuf(fp, NULL, _IONBF, 0);
+
+    std::vector<unsigned char> table = ppmBrightnessTable(maxIterations);
+    int maxCount = static_cast<int>(table.size()) - 1;
+    size_t channels = rgb ? 3 : 1;
+    size_t rowBytes = static_cast<size_t>(width) * channels;
+    size_t rowsPerWrite = std::max<size_t>(1, PPM_WRITE_BUFFER_BYTES / std::max<size_t>(rowBytes, 1));
+    std::vector<unsigned char> buffer(64 + rowsPerWrite * rowBytes);
+
+    // ppm header, sent with the first rows
+    size_t used = snprintf(reinterpret_cast<char*>(&buffer[0]), 64, "%s\n%d %d\n255\n",
+                           rgb ? "P6" : "P5", width, height);
+
+    bool ok = true;
+    for (int row = 0; row < height && ok; ) {
+        int endRow = std::min<long long>(height, row + static_cast<long long>(rowsPerWrite));
+        unsigned char* out = &buffer[used];
+        const int* in = data + static_cast<size_t>(row) * width;
+        const int* end = data + static_cast<size_t>(endRow) * width;
+        if (rgb) {
+            for (; in < end; ++in, out += 3) {
+                unsigned char result = table[std::min(std::max(*in, 0), maxCount)];
+                out[0] = result;
+                out[1] = result;
+                out[2] = result;
+            }
+        } else {
+            for (; in < end; ++in, ++out) {
+                *out = table[std::min(std::max(*in, 0), maxCount)];
+            }
+        }
+        used = out - &buffer[0];
+        ok = fwrite(&buffer[0], 1, used, fp) == used;
+        used = 0;
+        row = endRow;
+    }
+    if (height <= 0 && ok) {
+        ok = fwrite(&buffer[0], 1, used, fp) == used;
+    }
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok) {
+        printf("Could not write image file %s\n", filename);
+        return false;
     }
-    fclose(fp);
     printf("Wrote image file %s\n", filename);
+    return true;
+}
+
+bool
+writePPMImage(int* data, int width, int height, const char *filename, int maxIterations)
+{
+    return writeImage(data, width, height, filename, maxIterations, true);
+}
+
+bool
+writePGMImage(int* data, int width, int height, const char *filename, int maxIterations)
+{
+    return writeImage(data, width, height, filename, maxIterations, false);
+}
+
+MappedImage::MappedImage()
+  : fd_(-1), map_(NULL), map_bytes_(0), pixels_(NULL), width_(0), height_(0), channels_(0)
+{
+}
+
+MappedImage::~MappedImage()
+{
+    close();
+}
+
+bool
+MappedImage::create(const char* filename, int width, int height, bool rgb)
+{
+    close();
+
+    char header[64];
+    size_t headerBytes = snprintf(header, sizeof(header), "%s\n%d %d\n255\n",
+                                  rgb ? "P6" : "P5", width, height);
+    width_ = width;
+    height_ = height;
+    channels_ = rgb ? 3 : 1;
+    map_bytes_ = headerBytes + static_cast<size_t>(width) * height * channels_;
+
+    fd_ = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+        printf("Could not open image file %s\n", filename);
+        return false;
+    }
+    if (ftruncate(fd_, map_bytes_) != 0) {
+        printf("Could not size image file %s\n", filename);
+        close();
+        return false;
+    }
+    void* map = mmap(NULL, map_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (map == MAP_FAILED) {
+        printf("Could not map image file %s\n", filename);
+        close();
+        return false;
+    }
+    map_ = static_cast<unsigned char*>(map);
+    std::copy(header, header + headerBytes, map_);
+    pixels_ = map_ + headerBytes;
+    return true;
+}
+
+bool
+MappedImage::flushRows(int startRow, int endRow, bool async)
+{
+    if (!map_ || startRow >= endRow) {
+        return map_ != NULL;
+    }
+
+    // msync() takes a page-aligned start, so round down to the page of
+    // the first row; the page may be shared with the rows above.
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t begin = row(startRow) - map_;
+    size_t end = row(endRow) - map_;
+    begin -= begin % page;
+    return msync(map_ + begin, end - begin, async ? MS_ASYNC : MS_SYNC) == 0;
+}
+
+bool
+MappedImage::close()
+{
+    bool ok = true;
+    if (map_) {
+        ok = munmap(map_, map_bytes_) == 0;
+        map_ = NULL;
+        pixels_ = NULL;
+    }
+    if (fd_ >= 0) {
+        ok = (::close(fd_) == 0) && ok;
+        fd_ = -1;
+    }
+    return ok;
+}
+
+StreamingImageWriter::StreamingImageWriter()
+  : fp_(NULL), width_(0), height_(0), channels_(0), band_rows_(0), num_bands_(0),
+    window_(1), next_band_(0), stopping_(false), aborted_(false), ok_(true),
+    first_band_seconds_(0.0)
+{
+}
+
+StreamingImageWriter::~StreamingImageWriter()
+{
+    finish();
+}
+
+bool
+StreamingImageWriter::open(const char* filename, int width, int height, bool rgb,
+                           int maxIterations, int bandRows, int window)
+{
+    finish();
+
+    fp_ = fopen(filename, "wb");
+    if (!fp_) {
+        printf("Could not open image file %s\n", filename);
+        return false;
+    }
+    // Bands are written whole, so skip stdio's own buffer.
+    setvbuf(fp_, NULL, _IONBF, 0);
+
+    width_ = width;
+    height_ = height;
+    channels_ = rgb ? 3 : 1;
+    band_rows_ = std::max(bandRows, 1);
+    num_bands_ = (height + band_rows_ - 1) / band_rows_;
+    table_ = ppmBrightnessTable(maxIterations);
+    window_ = std::max(window, 1);
+    next_band_ = 0;
+    stopping_ = false;
+    aborted_ = false;
+    ok_ = fprintf(fp_, "%s\n%d %d\n255\n", rgb ? "P6" : "P5", width, height) > 0;
+    first_band_seconds_ = 0.0;
+
+    size_t bandBytes = static_cast<size_t>(width) * band_rows_ * channels_;
+    free_.assign(window_, std::vector<unsigned char>(bandBytes));
+    writer_ = std::thread(&StreamingImageWriter::writerLoop, this);
+    return true;
+}
+
+void
+StreamingImageWriter::submitBand(int band, const int* counts)
+{
+    // Every unwritten band holding a buffer lies in the window, so the
+    // band the writer waits for always finds a buffer free once the
+    // writer has returned the ones it is writing.
+    std::vector<unsigned char> buffer;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        space_cv_.wait(lock, [this, band] {
+            return stopping_ || (band < next_band_ + window_ && !free_.empty());
+        });
+        if (stopping_) {
+            return;
+        }
+        buffer.swap(free_.back());
+        free_.pop_back();
+    }
+
+    size_t pixels = static_cast<size_t>(bandEnd(band) - bandStart(band)) * width_;
+    buffer.resize(pixels * channels_);
+    int maxCount = static_cast<int>(table_.size()) - 1;
+    unsigned char* out = &buffer[0];
+    if (channels_ == 3) {
+        for (size_t i = 0; i < pixels; ++i, out += 3) {
+            unsigned char result = table_[std::min(std::max(counts[i], 0), maxCount)];
+            out[0] = result;
+            out[1] = result;
+            out[2] = result;
+        }
+    } else {
+        for (size_t i = 0; i < pixels; ++i) {
+            out[i] = table_[std::min(std::max(counts[i], 0), maxCount)];
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    ready_[band].swap(buffer);
+    if (band == next_band_) {
+        ready_cv_.notify_one();
+    }
+}
+
+void
+StreamingImageWriter::writerLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (next_band_ < num_bands_) {
+        ready_cv_.wait(lock, [this] { return ready_.count(next_band_) > 0 || stopping_; });
+        if (aborted_ || ready_.count(next_band_) == 0) {
+            break;
+        }
+
+        // Write the run of consecutive bands that are ready, unlocked.
+        std::vector<std::vector<unsigned char> > run;
+        std::map<int, std::vector<unsigned char> >::iterator it;
+        while ((it = ready_.find(next_band_)) != ready_.end()) {
+            run.push_back(std::vector<unsigned char>());
+            run.back().swap(it->second);
+            ready_.erase(it);
+            next_band_++;
+        }
+        lock.unlock();
+
+        bool ok = true;
+        for (size_t i = 0; i < run.size(); ++i) {
+            ok = fwrite(&run[i][0], 1, run[i].size(), fp_) == run[i].size() && ok;
+            if (first_band_seconds_ == 0.0) {
+                first_band_seconds_ = CycleTimer::currentSeconds();
+            }
+        }
+
+        lock.lock();
+        ok_ = ok_ && ok;
+        for (size_t i = 0; i < run.size(); ++i) {
+            free_.push_back(std::vector<unsigned char>());
+            free_.back().swap(run[i]);
+        }
+        space_cv_.notify_all();
+    }
+}
+
+void
+StreamingImageWriter::abort()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    aborted_ = true;
+    ready_cv_.notify_one();
+    space_cv_.notify_all();
+}
+
+bool
+StreamingImageWriter::finish()
+{
+    if (!fp_) {
+        return true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        ready_cv_.notify_one();
+        space_cv_.notify_all();
+    }
+    writer_.join();
+    bool complete = next_band_ == num_bands_;
+    bool ok = (fclose(fp_) == 0) && ok_ && complete;
+    fp_ = NULL;
+    ready_.clear();
+    free_.clear();
+    if (!complete) {
+        printf("Image file is incomplete: wrote %d of %d bands\n", next_band_, num_bands_);
+    } else if (!ok) {
+        printf("Could not write image file\n");
+    }
+    return ok;
 }
@@ -0,0 +1,171 @@
+#ifndef _PPM_H
+#define _PPM_H
+
+/*
+ * Writers for images of Mandelbrot iteration counts.
+ *
+ * Each count is clamped to [0, maxIterations] and mapped to an 8-bit
+ * brightness of 255 * sqrt(count / 256), clamped to 255.  The mapping is
+ * tabulated once per image, and rows are encoded into a large buffer that
+ * is written with a few big writes.
+ *
+ * writePPMImage() writes a binary RGB (P6) file with the brightness in
+ * all three channels; writePGMImage() writes the same image as binary
+ * grayscale (P5), a third of the size.  Both return false if the file
+ * could not be written.
+ *
+ * MappedImage instead creates the file at its final size and maps it,
+ * so that parallel workers can write the brightness of their rows
+ * straight into the file, without an image of iteration counts or a
+ * serial encoding pass.
+ *
+ * StreamingImageWriter writes a file as a sequence of row bands from a
+ * background thread, each band as soon as it and every band above it
+ * are done, so that the file is written while later bands are computed.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <algorithm>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+bool writePPMImage(int* data, int width, int height, const char* filename, int maxIterations);
+bool writePGMImage(int* data, int width, int height, const char* filename, int maxIterations);
+
+/*
+  Brightness of every iteration count from 0 to maxIterations.
+ */
+std::vector<unsigned char> ppmBrightnessTable(int maxIterations);
+
+/*
+ * A binary PPM (P6) or PGM (P5) file mapped into memory.  Different
+ * threads may write and flush disjoint rows concurrently; create() and
+ * close() must not race with them.
+ */
+class MappedImage {
+    public:
+        MappedImage();
+        ~MappedImage();
+
+        /*
+          Creates (or truncates) filename with the header of a width x
+          height image and maps its pixels.  Returns false on failure.
+         */
+        bool create(const char* filename, int width, int height, bool rgb);
+
+        // First byte of row `y`, channels() bytes per pixel.
+        unsigned char* row(int y) { return pixels_ + (size_t) y * width_ * channels_; }
+        int channels() const { return channels_; }
+
+        /*
+          Starts writing rows [startRow, endRow) back to the file.  With
+          async, returns without waiting for the I/O (MS_ASYNC), so it
+          overlaps whatever the caller does next.
+         */
+        bool flushRows(int startRow, int endRow, bool async);
+
+        // Unmaps and closes the file. Returns false if any step failed.
+        bool close();
+
+    private:
+        int fd_;
+        unsigned char* map_;
+        size_t map_bytes_;
+        unsigned char* pixels_;
+        int width_;
+        int height_;
+        int channels_;
+
+        MappedImage(const MappedImage&);
+        MappedImage& operator=(const MappedImage&);
+};
+
+/*
+ * Streams a binary PPM (P6) or PGM (P5) image to a file in bands of
+ * bandRows rows.  Workers encode finished bands with submitBand(), in
+ * any order and from any thread; a background thread writes them in
+ * order.  Bands that finish ahead of an unfinished band above them wait
+ * in a reorder window of `window` preallocated buffers, which are reused
+ * once written.  The window is a hard cap: a worker whose band is
+ * `window` or more bands ahead of the oldest unwritten one, or that finds
+ * every buffer in use, waits in submitBand() until the writer catches up.
+ */
+class StreamingImageWriter {
+    public:
+        StreamingImageWriter();
+        ~StreamingImageWriter();
+
+        /*
+          Creates filename, writes its header and starts the writer
+          thread. Returns false if the file could not be opened.
+         */
+        bool open(const char* filename, int width, int height, bool rgb, int maxIterations,
+                  int bandRows, int window);
+
+        int numBands() const { return num_bands_; }
+        int bandStart(int band) const { return band * band_rows_; }
+        int bandEnd(int band) const { return std::min(height_, (band + 1) * band_rows_); }
+
+        /*
+          Encodes the iteration counts of band `band`, one int per pixel
+          of rows [bandStart(band), bandEnd(band)), and queues it, waiting
+          for room in the window first.  Bands must be started roughly in
+          order, as the task systems hand out task ids, so that the band
+          the writer waits for is never stuck behind a waiting worker.
+          Drops the band if the writer has been stopped.
+         */
+        void submitBand(int band, const int* counts);
+
+        /*
+          Stops the writer without waiting for the bands not submitted
+          yet, and releases workers waiting in submitBand(). For a launch
+          that cannot submit every band, such as after an error; finish()
+          then returns false.
+         */
+        void abort();
+
+        /*
+          Writes the bands submitted so far, then closes the file.  Call
+          it once every band has been submitted (or after abort()); bands
+          still missing then are never waited for.  Returns false if any
+          band is missing or any write failed.
+         */
+        bool finish();
+
+        // CycleTimer::currentSeconds() when the first band was written,
+        // valid once finish() has returned.
+        double firstBandSeconds() const { return first_band_seconds_; }
+
+    private:
+        FILE* fp_;
+        int width_;
+        int height_;
+        int channels_;
+        int band_rows_;
+        int num_bands_;
+        std::vector<unsigned char> table_;
+
+        std::mutex mutex_;
+        std::condition_variable ready_cv_;
+        std::condition_variable space_cv_;
+        std::map<int, std::vector<unsigned char> > ready_;
+        std::vector<std::vector<unsigned char> > free_;
+        int window_;
+        int next_band_;
+        bool stopping_;
+        bool aborted_;
+        bool ok_;
+        double first_band_seconds_;
+        std::thread writer_;
+
+        void writerLoop();
+
+        StreamingImageWriter(const StreamingImageWriter&);
+        StreamingImageWriter& operator=(const StreamingImageWriter&);
+};
+
+#endif
@@ -0,0 +1,259 @@
+#ifndef _TASKPRIMS_H
+#define _TASKPRIMS_H
+
+/*
+ * Generic parallel primitives built on top of ITaskSystem::run().  This
+ * header is included at the bottom of itasksys.h and only contains the
+ * definitions of the ITaskSystem member templates, so every task system
+ * implementation gets them for free.
+ */
+
+#include <algorithm>
+#include <new>
+#include <utility>
+#include <vector>
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+/*
+ * Array of `count` values of type T, each starting on its own cache line
+ * so that neighbouring slots written by different workers never share a
+ * line.
+ */
+template <typename T>
+class PaddedSlots {
+    private:
+        std::vector<char> storage_;
+        char* base_;
+        size_t stride_;
+        int count_;
+
+    public:
+        PaddedSlots(int count, const T& init) : count_(count) {
+            stride_ = ((sizeof(T) + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE) * CACHE_LINE_SIZE;
+            storage_.resize(stride_ * count + CACHE_LINE_SIZE);
+            size_t addr = reinterpret_cast<size_t>(storage_.data());
+            base_ = storage_.data() + (CACHE_LINE_SIZE - addr % CACHE_LINE_SIZE) % CACHE_LINE_SIZE;
+            for (int i = 0; i < count_; i++) {
+                new (base_ + i * stride_) T(init);
+            }
+        }
+        ~PaddedSlots() {
+            for (int i = 0; i < count_; i++) {
+                (*this)[i].~T();
+            }
+        }
+
+        T& operator[](int i) {
+            return *reinterpret_cast<T*>(base_ + i * stride_);
+        }
+
+    private:
+        PaddedSlots(const PaddedSlots&);
+        PaddedSlots& operator=(const PaddedSlots&);
+};
+
+/*
+ * Each task folds a contiguous block of the index range into its own
+ * padded accumulator.  Blocks are assigned in index order, so combining
+ * the accumulators left to right preserves the order of the reduction.
+ */
+template <typename T, typename Body>
+class ReduceRunnable: public IRunnable {
+    public:
+        int n_;
+        Body& body_;
+        PaddedSlots<T>& partials_;
+
+        ReduceRunnable(int n, Body& body, PaddedSlots<T>& partials)
+          : n_(n), body_(body), partials_(partials) {}
+        ~ReduceRunnable() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            int elements_per_task = (n_ + num_total_tasks - 1) / num_total_tasks;
+            int start = std::min(elements_per_task * task_id, n_);
+            int end = std::min(start + elements_per_task, n_);
+            if (start < end) {
+                body_(start, end, partials_[task_id]);
+            }
+        }
+};
+
+template <typename T, typename Body, typename Combine>
+T ITaskSystem::parallelReduce(int n, const T& identity, Body body, Combine combine) {
+    if (n <= 0) {
+        return identity;
+    }
+
+    int num_tasks = std::max(1, std::min(num_workers, n));
+    PaddedSlots<T> partials(num_tasks, identity);
+    ReduceRunnable<T, Body> reduce(n, body, partials);
+    run(&reduce, num_tasks);
+
+    // Pairwise tree over the per-worker partials.  Left operands always
+    // cover lower indices, so only associativity is required of combine.
+    for (int stride = 1; stride < num_tasks; stride *= 2) {
+        for (int i = 0; i + stride < num_tasks; i += 2 * stride) {
+            partials[i] = combine(partials[i], partials[i + stride]);
+        }
+    }
+    return partials[0];
+}
+
+/*
+ * Runs one pass of the block-decomposed scan.  Task i owns block i of the
+ * range.  The local pass scans the block in place and records its total;
+ * the fix-up pass applies the scanned total of all preceding blocks.
+ */
+template <typename T, typename Op>
+class ScanRunnable: public IRunnable {
+    public:
+        const T* input_;
+        T* output_;
+        int n_;
+        Op& op_;
+        ScanType type_;
+        PaddedSlots<T>& block_sums_;
+        bool fixup_;
+
+        ScanRunnable(const T* input, T* output, int n, Op& op, ScanType type,
+                     PaddedSlots<T>& block_sums)
+          : input_(input), output_(output), n_(n), op_(op), type_(type),
+            block_sums_(block_sums), fixup_(false) {}
+        ~ScanRunnable() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            int elements_per_task = (n_ + num_total_tasks - 1) / num_total_tasks;
+            int start = std::min(elements_per_task * task_id, n_);
+            int end = std::min(start + elements_per_task, n_);
+            if (start == end) {
+                return;
+            }
+
+            if (fixup_) {
+                // Block 0 has nothing before it.
+                if (task_id == 0) {
+                    return;
+                }
+                T offset = block_sums_[task_id];
+                for (int i = start; i < end; i++) {
+                    output_[i] = op_(offset, output_[i]);
+                }
+                return;
+            }
+
+            if (type_ == INCLUSIVE_SCAN) {
+                T acc = input_[start];
+                output_[start] = acc;
+                for (int i = start + 1; i < end; i++) {
+                    acc = op_(acc, input_[i]);
+                    output_[i] = acc;
+                }
+                block_sums_[task_id] = acc;
+            } else {
+                // Read before writing so input and output may alias.
+                T acc = input_[start];
+                output_[start] = block_sums_[task_id];
+                for (int i = start + 1; i < end; i++) {
+                    T x = input_[i];
+                    output_[i] = acc;
+                    acc = op_(acc, x);
+                }
+                block_sums_[task_id] = acc;
+            }
+        }
+};
+
+template <typename T, typename Op>
+void ITaskSystem::parallelScan(const T* input, T* output, int n, const T& identity,
+                               Op op, ScanType type) {
+    if (n <= 0) {
+        return;
+    }
+
+    int num_tasks = std::max(1, std::min(num_workers, n));
+    PaddedSlots<T> block_sums(num_tasks, identity);
+    ScanRunnable<T, Op> scan(input, output, n, op, type, block_sums);
+    run(&scan, num_tasks);
+    if (num_tasks == 1) {
+        return;
+    }
+
+    // Exclusive scan of the block totals, in place.  Empty trailing
+    // blocks keep `identity` and are skipped by the fix-up pass.
+    T acc = identity;
+    for (int i = 0; i < num_tasks; i++) {
+        T block_total = block_sums[i];
+        block_sums[i] = acc;
+        acc = op(acc, block_total);
+    }
+
+    scan.fixup_ = true;
+    run(&scan, num_tasks);
+}
+
+/*
+ * Adapts a 2D tile launch to a 1D bulk task launch of ntx * nty tasks.
+ * Task ids are mapped to tiles in Morton order: the tile coordinates are
+ * sorted by their bit-interleaved (x, y) code, which also works for grids
+ * that are not square or not a power of two.
+ */
+class TiledRunnable: public IRunnable {
+    public:
+        ITileRunnable* runnable_;
+        int ntx_;
+        int nty_;
+        std::vector<unsigned int> order_;
+
+        TiledRunnable(ITileRunnable* runnable, int ntx, int nty)
+          : runnable_(runnable), ntx_(ntx), nty_(nty) {
+            std::vector<std::pair<unsigned int, unsigned int> > keyed;
+            keyed.reserve(numTiles());
+            for (int ty = 0; ty < nty_; ty++) {
+                for (int tx = 0; tx < ntx_; tx++) {
+                    keyed.push_back(std::make_pair(mortonCode(tx, ty),
+                                                   (unsigned int) (ty * ntx_ + tx)));
+                }
+            }
+            std::sort(keyed.begin(), keyed.end());
+            order_.resize(keyed.size());
+            for (size_t i = 0; i < keyed.size(); i++) {
+                order_[i] = keyed[i].second;
+            }
+        }
+        ~TiledRunnable() {}
+
+        int numTiles() const {
+            return ntx_ * nty_;
+        }
+
+        static inline unsigned int spreadBits(unsigned int v) {
+            v &= 0xffff;
+            v = (v | (v << 8)) & 0x00ff00ff;
+            v = (v | (v << 4)) & 0x0f0f0f0f;
+            v = (v | (v << 2)) & 0x33333333;
+            v = (v | (v << 1)) & 0x55555555;
+            return v;
+        }
+
+        static inline unsigned int mortonCode(int tx, int ty) {
+            return spreadBits(tx) | (spreadBits(ty) << 1);
+        }
+
+        void runTask(int task_id, int num_total_tasks) {
+            unsigned int tile = order_[task_id];
+            runnable_->runTile(tile % ntx_, tile / ntx_, ntx_, nty_);
+        }
+};
+
+inline void ITaskSystem::runTiled(ITileRunnable* runnable, int ntx, int nty) {
+    if (ntx <= 0 || nty <= 0) {
+        return;
+    }
+    TiledRunnable tiled(runnable, ntx, nty);
+    run(&tiled, tiled.numTiles());
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef _TASKSTATS_H
+#define _TASKSTATS_H
+
+/*
+ * Per-worker counters behind ITaskSystem::getStats().  Every worker owns
+ * one cache-line-padded WorkerCounters and is its only writer, so a
+ * counter update is a relaxed load and store to a line no other thread
+ * writes.  getStats() may be called while the workers are running; each
+ * counter in the snapshot is then exact, but the counters are not read
+ * at a single point in time.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "histogram.h"
+
+inline unsigned long long statsNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class WorkerCounters {
+    private:
+        typedef std::atomic<unsigned long long> Counter;
+
+        Counter tasks_executed_;
+        Counter launches_touched_;
+        Counter busy_ns_;
+        Counter idle_ns_;
+        Counter num_sleeps_;
+        Counter num_wakes_;
+        Counter steal_attempts_;
+        Counter steal_successes_;
+        Counter mutex_wait_ns_;
+
+        static inline void add(Counter& counter, unsigned long long value) {
+            counter.store(counter.load(std::memory_order_relaxed) + value,
+                          std::memory_order_relaxed);
+        }
+
+        static inline unsigned long long get(const Counter& counter) {
+            return counter.load(std::memory_order_relaxed);
+        }
+
+    public:
+        WorkerCounters()
+          : tasks_executed_(0), launches_touched_(0), busy_ns_(0), idle_ns_(0),
+            num_sleeps_(0), num_wakes_(0), steal_attempts_(0), steal_successes_(0),
+            mutex_wait_ns_(0) {}
+
+        // Only used to initialise PaddedSlots, before any worker runs.
+        WorkerCounters(const WorkerCounters& other)
+          : tasks_executed_(get(other.tasks_executed_)),
+            launches_touched_(get(other.launches_touched_)),
+            busy_ns_(get(other.busy_ns_)), idle_ns_(get(other.idle_ns_)),
+            num_sleeps_(get(other.num_sleeps_)), num_wakes_(get(other.num_wakes_)),
+            steal_attempts_(get(other.steal_attempts_)),
+            steal_successes_(get(other.steal_successes_)),
+            mutex_wait_ns_(get(other.mutex_wait_ns_)) {}
+
+        void countTasks(int num_tasks, unsigned long long busy_ns) {
+            add(tasks_executed_, num_tasks);
+            add(busy_ns_, busy_ns);
+        }
+        void countLaunch() {
+            add(launches_touched_, 1);
+        }
+        void countIdle(unsigned long long idle_ns) {
+            add(idle_ns_, idle_ns);
+        }
+        void countSleep() {
+            add(num_sleeps_, 1);
+        }
+        void countWake() {
+            add(num_wakes_, 1);
+        }
+        void countSteal(bool success) {
+            add(steal_attempts_, 1);
+            if (success) {
+                add(steal_successes_, 1);
+            }
+        }
+        void countMutexWait(unsigned long long wait_ns) {
+            add(mutex_wait_ns_, wait_ns);
+        }
+
+        WorkerStats snapshot() const {
+            WorkerStats stats;
+            stats.tasks_executed = get(tasks_executed_);
+            stats.launches_touched = get(launches_touched_);
+            stats.busy_ns = get(busy_ns_);
+            stats.idle_ns = get(idle_ns_);
+            stats.num_sleeps = get(num_sleeps_);
+            stats.num_wakes = get(num_wakes_);
+            stats.steal_attempts = get(steal_attempts_);
+            stats.steal_successes = get(steal_successes_);
+            stats.mutex_wait_ns = get(mutex_wait_ns_);
+            return stats;
+        }
+
+    private:
+        WorkerCounters& operator=(const WorkerCounters&);
+};
+
+/*
+ * One WorkerCounters per worker.  Task systems that run every task on
+ * the calling thread use a board with a single slot.
+ */
+class StatsBoard {
+    private:
+        PaddedSlots<WorkerCounters> slots_;
+        int count_;
+
+    public:
+        StatsBoard(int count) : slots_(count, WorkerCounters()), count_(count) {}
+
+        WorkerCounters& operator[](int worker) {
+            return slots_[worker];
+        }
+
+        std::vector<WorkerStats> snapshot() {
+            std::vector<WorkerStats> stats(count_);
+            for (int i = 0; i < count_; i++) {
+                stats[i] = slots_[i].snapshot();
+            }
+            return stats;
+        }
+};
+
+/*
+ * Launch latency histograms, one per LaunchPhase, fed with the four
+ * CycleTimer stamps of every finished launch.  Like LatencyHistogram it
+ * is not synchronized.
+ */
+class LaunchLatencies {
+    private:
+        LatencyHistogram phases_[NUM_LAUNCH_PHASES];
+        double ns_per_tick_;
+
+        void recordInterval(LaunchPhase phase, unsigned long long from, unsigned long long to) {
+            // Ticks of different cores may be slightly out of step.
+            phases_[phase].record(to > from ? (unsigned long long) ((to - from) * ns_per_tick_) : 0);
+        }
+
+    public:
+        LaunchLatencies(double seconds_per_tick) : ns_per_tick_(seconds_per_tick * 1e9) {}
+
+        void record(unsigned long long submit_ticks, unsigned long long ready_ticks,
+                    unsigned long long first_task_ticks, unsigned long long done_ticks) {
+            recordInterval(LAUNCH_DEPS_WAIT, submit_ticks, ready_ticks);
+            recordInterval(LAUNCH_SCHED_WAIT, ready_ticks, first_task_ticks);
+            recordInterval(LAUNCH_EXECUTION, first_task_ticks, done_ticks);
+            recordInterval(LAUNCH_TOTAL, submit_ticks, done_ticks);
+        }
+
+        LatencySummary summary(LaunchPhase phase) const {
+            const LatencyHistogram& histogram = phases_[phase];
+            LatencySummary summary;
+            summary.count = histogram.count();
+            summary.min_us = histogram.min() * 1e-3;
+            summary.p50_us = histogram.percentile(0.5) * 1e-3;
+            summary.p99_us = histogram.percentile(0.99) * 1e-3;
+            summary.p999_us = histogram.percentile(0.999) * 1e-3;
+            summary.max_us = histogram.max() * 1e-3;
+            return summary;
+        }
+};
+
+/*
+ * Acquires `lock`, charging the time spent blocked to `counters`.  The
+ * uncontended case costs a try_lock and no clock reads.
+ */
+inline void lockCounted(std::unique_lock<std::mutex>& lock, WorkerCounters& counters) {
+    if (lock.try_lock()) {
+        return;
+    }
+    unsigned long long start = statsNowNs();
+    lock.lock();
+    counters.countMutexWait(statsNowNs() - start);
+}
+
+#endif
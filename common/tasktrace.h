@@ -0,0 +1,255 @@
+#ifndef _TASKTRACE_H
+#define _TASKTRACE_H
+
+/*
+ * Timeline recording for the thread pools, compiled in with
+ * `make TRACE=1` (-DTASKSYS_TRACE).  Without it this header declares
+ * nothing and the pools contain no tracing code at all.
+ *
+ * Each worker appends the tasks it runs to its own ring buffer.  A ring
+ * has a single writer and is only read by write(), which must be called
+ * while no tasks are running, so recording takes no locks.  Runs of
+ * consecutive task ids of the same launch are merged into one event, and
+ * once a ring is full its oldest events are overwritten.  The sizes and
+ * dependencies of launches are kept in a ring of the same kind, so a
+ * long run keeps the most recent TRACE_LAUNCH_CAPACITY launches; events
+ * and dependencies of older launches are written without them.
+ *
+ * write() produces Chrome trace JSON, which chrome://tracing and
+ * ui.perfetto.dev both load: one track per worker, one slice per task
+ * range, and a flow arrow from the last task of every launch to the first
+ * task of each launch that depends on it.
+ */
+#ifdef TASKSYS_TRACE
+
+#include <algorithm>
+#include <atomic>
+#include <stdio.h>
+#include <vector>
+
+#include "taskstats.h"
+
+#define TRACE_RING_CAPACITY (1 << 15)
+#define TRACE_LAUNCH_CAPACITY (1 << 16)
+
+struct TraceEvent {
+    unsigned long long begin_ns;
+    unsigned long long end_ns;
+    int launch;
+    int task_begin;
+    int task_end;
+    bool spawned;
+};
+
+class TraceRing {
+    private:
+        TraceEvent* events_;
+        std::atomic<unsigned long long> head_;
+        char pad_[CACHE_LINE_SIZE];
+
+    public:
+        TraceRing() : events_(new TraceEvent[TRACE_RING_CAPACITY]), head_(0) {}
+        ~TraceRing() {
+            delete [] events_;
+        }
+
+        void record(int launch, int task_id, bool spawned,
+                    unsigned long long begin_ns, unsigned long long end_ns) {
+            unsigned long long head = head_.load(std::memory_order_relaxed);
+            if (head > 0) {
+                TraceEvent& last = events_[(head - 1) % TRACE_RING_CAPACITY];
+                if (last.launch == launch && last.spawned == spawned &&
+                    last.task_end == task_id) {
+                    last.task_end = task_id + 1;
+                    last.end_ns = end_ns;
+                    return;
+                }
+            }
+            TraceEvent& event = events_[head % TRACE_RING_CAPACITY];
+            event.begin_ns = begin_ns;
+            event.end_ns = end_ns;
+            event.launch = launch;
+            event.task_begin = task_id;
+            event.task_end = task_id + 1;
+            event.spawned = spawned;
+            head_.store(head + 1, std::memory_order_release);
+        }
+
+        // Appends the retained events, oldest first.
+        void collect(std::vector<TraceEvent>& out) {
+            unsigned long long head = head_.load(std::memory_order_acquire);
+            unsigned long long first = head > TRACE_RING_CAPACITY ? head - TRACE_RING_CAPACITY : 0;
+            for (unsigned long long i = first; i < head; i++) {
+                out.push_back(events_[i % TRACE_RING_CAPACITY]);
+            }
+        }
+
+    private:
+        TraceRing(const TraceRing&);
+        TraceRing& operator=(const TraceRing&);
+};
+
+/*
+ * Trace of one task system.  Launches are numbered across the whole
+ * lifetime of the task system; task systems whose TaskIDs restart after
+ * every sync() call endBatch() to move on to a fresh range of numbers.
+ */
+class TraceRecorder {
+    private:
+        struct TracedLaunch {
+            int num_total_tasks;
+            std::vector<int> deps;
+        };
+
+        int num_workers_;
+        TraceRing* rings_;
+        // Launch n is kept in launches_[n % TRACE_LAUNCH_CAPACITY] until
+        // launch n + TRACE_LAUNCH_CAPACITY replaces it.
+        std::vector<TracedLaunch> launches_;
+        int num_launches_;
+        int batch_base_;
+        unsigned long long start_ns_;
+
+        // Number of the oldest launch still kept.
+        int firstKeptLaunch() const {
+            return num_launches_ - (int) launches_.size();
+        }
+
+        bool isKept(int launch) const {
+            return launch >= firstKeptLaunch() && launch < num_launches_;
+        }
+
+        const TracedLaunch& keptLaunch(int launch) const {
+            return launches_[launch % TRACE_LAUNCH_CAPACITY];
+        }
+
+    public:
+        TraceRecorder(int num_workers)
+          : num_workers_(num_workers), rings_(new TraceRing[num_workers]), num_launches_(0),
+            batch_base_(0), start_ns_(statsNowNs()) {}
+        ~TraceRecorder() {
+            delete [] rings_;
+        }
+
+        /*
+          Registers the next launch of the current batch, whose deps are
+          TaskIDs of the same batch, and returns its trace-wide number.
+         */
+        int addLaunch(int num_total_tasks, const std::vector<int>& deps) {
+            TracedLaunch launch;
+            launch.num_total_tasks = num_total_tasks;
+            for (size_t i = 0; i < deps.size(); i++) {
+                launch.deps.push_back(batch_base_ + deps[i]);
+            }
+            int number = num_launches_++;
+            if (launches_.size() < TRACE_LAUNCH_CAPACITY) {
+                launches_.push_back(launch);
+            } else {
+                launches_[number % TRACE_LAUNCH_CAPACITY] = launch;
+            }
+            return number;
+        }
+
+        // Trace-wide number of TaskID `launch` of the current batch.
+        int launchNumber(int launch) const {
+            return batch_base_ + launch;
+        }
+
+        void endBatch() {
+            batch_base_ = num_launches_;
+        }
+
+        void recordTask(int worker, int launch, int task_id, bool spawned,
+                        unsigned long long begin_ns, unsigned long long end_ns) {
+            rings_[worker].record(launch, task_id, spawned, begin_ns, end_ns);
+        }
+
+        bool write(const char* filename) {
+            FILE* f = fopen(filename, "w");
+            if (!f) {
+                return false;
+            }
+
+            // Where each kept launch starts and ends, to anchor the flow
+            // arrows. Launch n is at index n - first.
+            int first = firstKeptLaunch();
+            int num_launches = (int) launches_.size();
+            std::vector<int> first_worker(num_launches, -1);
+            std::vector<int> last_worker(num_launches, -1);
+            std::vector<unsigned long long> first_ns(num_launches, 0);
+            std::vector<unsigned long long> last_ns(num_launches, 0);
+            std::vector<unsigned long long> last_begin_ns(num_launches, 0);
+
+            fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+            fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+                       "\"args\":{\"name\":\"task system\"}}");
+            for (int w = 0; w < num_workers_; w++) {
+                fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                           "\"args\":{\"name\":\"worker %d\"}}", w, w);
+
+                std::vector<TraceEvent> events;
+                rings_[w].collect(events);
+                for (size_t i = 0; i < events.size(); i++) {
+                    const TraceEvent& e = events[i];
+                    bool kept = isKept(e.launch);
+                    int total = kept ? keptLaunch(e.launch).num_total_tasks : 0;
+                    fprintf(f, ",\n{\"name\":\"launch %d%s\",\"cat\":\"task\",\"ph\":\"X\","
+                               "\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                               "\"args\":{\"launch\":%d,\"tasks\":\"[%d, %d)\","
+                               "\"num_total_tasks\":%d}}",
+                            e.launch, e.spawned ? " (spawned)" : "", w,
+                            (e.begin_ns - start_ns_) * 1e-3, (e.end_ns - e.begin_ns) * 1e-3,
+                            e.launch, e.task_begin, e.task_end, total);
+                    if (!kept) {
+                        continue;
+                    }
+                    int l = e.launch - first;
+                    if (first_worker[l] == -1 || e.begin_ns < first_ns[l]) {
+                        first_worker[l] = w;
+                        first_ns[l] = e.begin_ns;
+                    }
+                    if (last_worker[l] == -1 || e.end_ns > last_ns[l]) {
+                        last_worker[l] = w;
+                        last_ns[l] = e.end_ns;
+                        last_begin_ns[l] = e.begin_ns;
+                    }
+                }
+            }
+
+            // A flow starts inside the slice that finished the dependency
+            // and binds to the slice that begins the dependent launch.
+            int flow_id = 0;
+            for (int l = 0; l < num_launches; l++) {
+                if (first_worker[l] == -1) {
+                    continue;
+                }
+                const std::vector<int>& deps = keptLaunch(first + l).deps;
+                for (size_t i = 0; i < deps.size(); i++) {
+                    if (!isKept(deps[i])) {
+                        continue;
+                    }
+                    int dep = deps[i] - first;
+                    if (last_worker[dep] == -1) {
+                        continue;
+                    }
+                    unsigned long long from_ns = std::max(last_ns[dep] - 1, last_begin_ns[dep]);
+                    fprintf(f, ",\n{\"name\":\"dependency\",\"cat\":\"dep\",\"ph\":\"s\","
+                               "\"id\":%d,\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+                            flow_id, last_worker[dep], (from_ns - start_ns_) * 1e-3);
+                    fprintf(f, ",\n{\"name\":\"dependency\",\"cat\":\"dep\",\"ph\":\"f\","
+                               "\"bp\":\"e\",\"id\":%d,\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+                            flow_id, first_worker[l], (first_ns[l] - start_ns_) * 1e-3);
+                    flow_id++;
+                }
+            }
+            fprintf(f, "\n]}\n");
+            return fclose(f) == 0;
+        }
+
+    private:
+        TraceRecorder(const TraceRecorder&);
+        TraceRecorder& operator=(const TraceRecorder&);
+};
+
+#endif
+#endif
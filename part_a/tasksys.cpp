@@ -5,9 +5,21 @@
 
 IRunnable::~IRunnable() {}
 
-ITaskSystem::ITaskSystem(int num_threads) {}
+ITileRunnable::~ITileRunnable() {}
+
+ITaskSystem::ITaskSystem(int num_threads): num_workers(num_threads) {}
 ITaskSystem::~ITaskSystem() {}
 
+bool ITaskSystem::writeTrace(const char* filename) {
+    return false;
+}
+
+void ITaskSystem::setGraphReport(FILE* out) {}
+
+bool ITaskSystem::getLaunchLatency(LaunchPhase phase, LatencySummary& summary) {
+    return false;
+}
+
 /*
  * ================================================================
  * Serial task system implementation
@@ -18,15 +30,20 @@ const char* TaskSystemSerial::name() {
     return "Serial";
 }
 
-TaskSystemSerial::TaskSystemSerial(int num_threads): ITaskSystem(num_threads) {
+TaskSystemSerial::TaskSystemSerial(int num_threads): ITaskSystem(num_threads), stats(1) {
 }
 
 TaskSystemSerial::~TaskSystemSerial() {}
 
 void TaskSystemSerial::run(IRunnable* runnable, int num_total_tasks) {
+    unsigned long long start = statsNowNs();
     for (int i = 0; i < num_total_tasks; i++) {
         runnable->runTask(i, num_total_tasks);
     }
+    if (num_total_tasks > 0) {
+        stats[0].countTasks(num_total_tasks, statsNowNs() - start);
+        stats[0].countLaunch();
+    }
 }
 
 TaskID TaskSystemSerial::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
@@ -40,6 +57,18 @@ void TaskSystemSerial::sync() {
     return;
 }
 
+void TaskSystemSerial::spawn(IRunnable* runnable, int num_total_tasks) {
+    // Spawned tasks run inline on the calling thread, so they are
+    // complete before the spawning task returns.
+    for (int i = 0; i < num_total_tasks; i++) {
+        runnable->runTask(i, num_total_tasks);
+    }
+}
+
+std::vector<WorkerStats> TaskSystemSerial::getStats() {
+    return stats.snapshot();
+}
+
 /*
  * ================================================================
  * Parallel Task System Implementation
@@ -50,7 +79,7 @@ const char* TaskSystemParallelSpawn::name() {
     return "Parallel + Always Spawn";
 }
 
-TaskSystemParallelSpawn::TaskSystemParallelSpawn(int num_threads): ITaskSystem(num_threads) {
+TaskSystemParallelSpawn::TaskSystemParallelSpawn(int num_threads): ITaskSystem(num_threads), stats(num_threads) {
     this->num_threads = num_threads;
     worker_threads = new std::thread[num_threads];
 }
@@ -62,14 +91,16 @@ TaskSystemParallelSpawn::~TaskSystemParallelSpawn() {
 void TaskSystemParallelSpawn::run(IRunnable* runnable, int num_total_tasks) {
     task_counter = 0;
     for (int i = 0; i < num_threads; i++) {
-        worker_threads[i] = std::thread(&TaskSystemParallelSpawn::runInBulk, this, runnable, num_total_tasks);
+        worker_threads[i] = std::thread(&TaskSystemParallelSpawn::runInBulk, this, runnable, num_total_tasks, i);
     }
     for (int i = 0; i < num_threads; i++) {
         worker_threads[i].join();
     }
 }
 
-void TaskSystemParallelSpawn::runInBulk(IRunnable* runnable, int num_total_tasks) {
+void TaskSystemParallelSpawn::runInBulk(IRunnable* runnable, int num_total_tasks, int thread_id) {
+    unsigned long long start = statsNowNs();
+    int completed = 0;
     while (true) {
         int task_id = task_counter.fetch_add(1);
 
@@ -79,6 +110,11 @@ void TaskSystemParallelSpawn::runInBulk(IRunnable* runnable, int num_total_tasks
         }
 
         runnable->runTask(task_id, num_total_tasks);
+        completed++;
+    }
+    if (completed > 0) {
+        stats[thread_id].countTasks(completed, statsNowNs() - start);
+        stats[thread_id].countLaunch();
     }
 }
 
@@ -93,6 +129,18 @@ void TaskSystemParallelSpawn::sync() {
     return;
 }
 
+void TaskSystemParallelSpawn::spawn(IRunnable* runnable, int num_total_tasks) {
+    // Spawned tasks run inline on the calling thread, so they are
+    // complete before the spawning task returns.
+    for (int i = 0; i < num_total_tasks; i++) {
+        runnable->runTask(i, num_total_tasks);
+    }
+}
+
+std::vector<WorkerStats> TaskSystemParallelSpawn::getStats() {
+    return stats.snapshot();
+}
+
 /*
  * ================================================================
  * Parallel Thread Pool Spinning Task System Implementation
@@ -103,16 +151,17 @@ const char* TaskSystemParallelThreadPoolSpinning::name() {
     return "Parallel + Thread Pool + Spin";
 }
 
-TaskSystemParallelThreadPoolSpinning::TaskSystemParallelThreadPoolSpinning(int num_threads): ITaskSystem(num_threads) {
+TaskSystemParallelThreadPoolSpinning::TaskSystemParallelThreadPoolSpinning(int num_threads): ITaskSystem(num_threads), stats(num_threads) {
     this->num_threads = num_threads;
     thread_pool = new std::thread[num_threads];
     num_total_tasks = 0;
+    launch_generation = 0;
     {
         std::unique_lock<std::mutex> lock(mtx);
         terminate = false;
     }
     for (int i = 0; i < num_threads; i++) {
-        thread_pool[i] = std::thread(&TaskSystemParallelThreadPoolSpinning::runInBulk, this);
+        thread_pool[i] = std::thread(&TaskSystemParallelThreadPoolSpinning::runInBulk, this, i);
     }
 }
 
@@ -135,6 +184,7 @@ void TaskSystemParallelThreadPoolSpinning::run(IRunnable* runnable, int num_tota
     task_counter.store(0);
     std::unique_lock<std::mutex> lock(mtx);
     this->num_total_tasks = num_total_tasks;
+    launch_generation++;
     lock.unlock();
     while (true) {
         if (task_completed.load() == num_total_tasks) {
@@ -144,20 +194,36 @@ void TaskSystemParallelThreadPoolSpinning::run(IRunnable* runnable, int num_tota
     this->num_total_tasks = 0;
 }
 
-void TaskSystemParallelThreadPoolSpinning::runInBulk() {
+void TaskSystemParallelThreadPoolSpinning::runInBulk(int thread_id) {
+    WorkerCounters& counters = stats[thread_id];
+    int last_generation = 0;
+    unsigned long long idle_since = statsNowNs();
     while (true) {
-        std::unique_lock<std::mutex> lock(mtx);
+        std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+        lockCounted(lock, counters);
         if (num_total_tasks == 0 || task_counter.load() >= num_total_tasks) {
             lock.unlock();
             if (terminate) {
+                counters.countIdle(statsNowNs() - idle_since);
                 return;
             }
             continue;
         }
         int task_id = task_counter.fetch_add(1);
         if (task_id < num_total_tasks) {
+            int generation = launch_generation;
             lock.unlock();
+            unsigned long long start = statsNowNs();
+            counters.countIdle(start - idle_since);
+            if (generation != last_generation) {
+                counters.countLaunch();
+                last_generation = generation;
+            }
             runnable->runTask(task_id, num_total_tasks);
+            // Count the task before publishing its completion, so that
+            // getStats() after run() returns includes it.
+            idle_since = statsNowNs();
+            counters.countTasks(1, idle_since - start);
             task_completed.fetch_add(1);
         }
     }
@@ -174,6 +240,18 @@ void TaskSystemParallelThreadPoolSpinning::sync() {
     return;
 }
 
+void TaskSystemParallelThreadPoolSpinning::spawn(IRunnable* runnable, int num_total_tasks) {
+    // Spawned tasks run inline on the calling thread, so they are
+    // complete before the spawning task returns.
+    for (int i = 0; i < num_total_tasks; i++) {
+        runnable->runTask(i, num_total_tasks);
+    }
+}
+
+std::vector<WorkerStats> TaskSystemParallelThreadPoolSpinning::getStats() {
+    return stats.snapshot();
+}
+
 /*
  * ================================================================
  * Parallel Thread Pool Sleeping Task System Implementation
@@ -184,15 +262,23 @@ const char* TaskSystemParallelThreadPoolSleeping::name() {
     return "Parallel + Thread Pool + Sleep";
 }
 
-TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(int num_threads): ITaskSystem(num_threads) {
+TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(int num_threads)
+  : ITaskSystem(num_threads), stats(num_threads), launch_latency(CycleTimer::secondsPerTick()) {
     std::unique_lock<std::mutex> lock(mtx);
     this->num_threads = num_threads;
     thread_pool = new std::thread[num_threads];
     num_total_tasks = 0;
+    launch_generation = 0;
     task_counter.store(0);
+    num_idle.store(0);
+    num_signaled.store(0);
     terminate = false;
+#ifdef TASKSYS_TRACE
+    trace = new TraceRecorder(num_threads);
+    trace_launch = -1;
+#endif
     for (int i = 0; i < num_threads; i++) {
-        thread_pool[i] = std::thread(&TaskSystemParallelThreadPoolSleeping::runInBulk, this);
+        thread_pool[i] = std::thread(&TaskSystemParallelThreadPoolSleeping::runInBulk, this, i);
     }
 }
 
@@ -207,39 +293,151 @@ TaskSystemParallelThreadPoolSleeping::~TaskSystemParallelThreadPoolSleeping() {
         }
     }
     delete [] thread_pool;
+#ifdef TASKSYS_TRACE
+    delete trace;
+#endif
 }
 
 void TaskSystemParallelThreadPoolSleeping::run(IRunnable* runnable, int num_total_tasks) {
+    unsigned long long submit_ticks = CycleTimer::currentTicks();
     {
         std::unique_lock<std::mutex> lock(mtx);
         this->runnable = runnable;    
-        task_completed.store(0);
-        task_counter.store(0);
         this->num_total_tasks = num_total_tasks;
+        launch_generation++;
+#ifdef TASKSYS_TRACE
+        trace_launch = trace->addLaunch(num_total_tasks, std::vector<int>());
+#endif
+        task_completed.store(0);
+        first_task_ticks.store(0);
+        done_ticks.store(0);
+        task_counter.store((unsigned long long) launch_generation << 32);
+        wakeIdleWorkers(num_total_tasks);
     }
-    
-    cv.notify_all();
 
+    // The worker that completes the last task publishes task_completed
+    // before it takes mtx to stamp done_ticks, so wait for the stamp too.
+    // Recording without it would log a bogus sample, and the late store
+    // could overwrite the next launch's reset.
     std::unique_lock<std::mutex> lock(mtx);
-    while (task_completed.load() < num_total_tasks) {
+    while (task_completed.load() < num_total_tasks ||
+           (num_total_tasks > 0 && done_ticks.load() == 0)) {
         cv2.wait(lock);
     }
+    if (num_total_tasks > 0) {
+        // A launch of run() has no dependencies, so it is ready as soon as
+        // it is submitted.
+        launch_latency.record(submit_ticks, submit_ticks, first_task_ticks.load(), done_ticks.load());
+    }
+}
+
+// Must be called with mtx held. Wakes at most max_wakeups of the workers
+// that are waiting on cv and have not been notified yet, rather than
+// waking every worker to fight over mtx.
+void TaskSystemParallelThreadPoolSleeping::wakeIdleWorkers(int max_wakeups) {
+    int num_wakeups = std::min(num_idle.load() - num_signaled.load(), max_wakeups);
+    for (int i = 0; i < num_wakeups; i++) {
+        num_signaled++;
+        cv.notify_one();
+    }
+}
+
+// Claims the next task id of launch `generation`, which has `total`
+// tasks, or returns -1 if it has none left or a later launch has
+// started. A plain fetch_add could hand a worker that is still in the
+// previous launch an id of the next one, under that launch's new size.
+int TaskSystemParallelThreadPoolSleeping::claimTask(unsigned int generation, int total) {
+    unsigned long long word = task_counter.load();
+    while ((unsigned int) (word >> 32) == generation && (int) (word & 0xffffffffu) < total) {
+        if (task_counter.compare_exchange_weak(word, word + 1)) {
+            return (int) (word & 0xffffffffu);
+        }
+    }
+    return -1;
 }
 
-void TaskSystemParallelThreadPoolSleeping::runInBulk() {
+void TaskSystemParallelThreadPoolSleeping::runInBulk(int thread_id) {
+    WorkerCounters& counters = stats[thread_id];
     while (true) {
+        // This launch's parameters, read under mtx along with the counter
+        // that showed it has tasks left.
+        unsigned int generation;
+        int total;
+        IRunnable* runnable;
         {
-            std::unique_lock<std::mutex> lock(mtx);
-            cv.wait(lock, [this] { return task_counter.load() < num_total_tasks || terminate; });
+            std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+            lockCounted(lock, counters);
+            num_idle++;
+            bool waited = false;
+            unsigned long long sleep_start = 0;
+            while ((int) (task_counter.load() & 0xffffffffu) >= num_total_tasks && !terminate) {
+                if (!waited) {
+                    sleep_start = statsNowNs();
+                    counters.countSleep();
+                }
+                cv.wait(lock);
+                // Each notify_one() wakes exactly one waiter, so consume one
+                // signal per return from wait, even if this worker finds
+                // the tasks already taken and waits again. A spurious
+                // wakeup may consume a signal meant for another worker;
+                // that only leads to an extra notify later, never to a
+                // signal that no waiter will consume.
+                if (num_signaled.load() > 0) {
+                    num_signaled--;
+                }
+                counters.countWake();
+                waited = true;
+            }
+            num_idle--;
+            if (waited) {
+                counters.countIdle(statsNowNs() - sleep_start);
+            }
             if (terminate) return;
+            generation = launch_generation;
+            total = num_total_tasks;
+            runnable = this->runnable;
         }
-        int task_id = task_counter.fetch_add(1);
-        if (task_id < num_total_tasks) {
-            runnable->runTask(task_id, num_total_tasks);
-            if (task_completed.fetch_add(1) == num_total_tasks - 1) {
-                std::unique_lock<std::mutex> lock(mtx);
-                cv2.notify_one();
+
+        // Count completions locally and publish them once this worker runs
+        // out of tasks, instead of writing task_completed after every task.
+        // run() cannot return, and so the next launch cannot reset the
+        // counters, before every worker has published its count.
+        unsigned long long start = statsNowNs();
+        int completed = 0;
+        while (true) {
+            int task_id = claimTask(generation, total);
+            if (task_id < 0) {
+                break;
             }
+            if (task_id == 0) {
+                first_task_ticks.store(CycleTimer::currentTicks());
+            }
+            // Chain wakeup: the first claim after waking up passes the
+            // baton to another idle worker if unclaimed tasks remain.
+            if (completed == 0 && total - (task_id + 1) > num_signaled.load() &&
+                num_idle.load() > num_signaled.load()) {
+                std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+                lockCounted(lock, counters);
+                wakeIdleWorkers(1);
+            }
+#ifdef TASKSYS_TRACE
+            unsigned long long task_start = statsNowNs();
+            runnable->runTask(task_id, total);
+            trace->recordTask(thread_id, trace_launch, task_id, false, task_start, statsNowNs());
+#else
+            runnable->runTask(task_id, total);
+#endif
+            completed++;
+        }
+        if (completed > 0) {
+            counters.countTasks(completed, statsNowNs() - start);
+            counters.countLaunch();
+        }
+        if (completed > 0 && task_completed.fetch_add(completed) + completed == total) {
+            std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+            lockCounted(lock, counters);
+            done_ticks.store(CycleTimer::currentTicks());
+            cv2.notify_one();
         }
     }
 }
@@ -263,3 +461,27 @@ void TaskSystemParallelThreadPoolSleeping::sync() {
 
     return;
 }
+
+void TaskSystemParallelThreadPoolSleeping::spawn(IRunnable* runnable, int num_total_tasks) {
+    // Spawned tasks run inline on the calling thread, so they are
+    // complete before the spawning task returns.
+    for (int i = 0; i < num_total_tasks; i++) {
+        runnable->runTask(i, num_total_tasks);
+    }
+}
+
+std::vector<WorkerStats> TaskSystemParallelThreadPoolSleeping::getStats() {
+    return stats.snapshot();
+}
+
+bool TaskSystemParallelThreadPoolSleeping::getLaunchLatency(LaunchPhase phase, LatencySummary& summary) {
+    std::unique_lock<std::mutex> lock(mtx);
+    summary = launch_latency.summary(phase);
+    return true;
+}
+
+#ifdef TASKSYS_TRACE
+bool TaskSystemParallelThreadPoolSleeping::writeTrace(const char* filename) {
+    return trace->write(filename);
+}
+#endif
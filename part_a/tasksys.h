@@ -2,6 +2,8 @@
 #define _TASKSYS_H
 
 #include "itasksys.h"
+#include "taskstats.h"
+#include "tasktrace.h"
 #include <atomic>
 #include <thread>
 #include <mutex>
@@ -13,6 +15,9 @@
  * itasksys.h for documentation of the ITaskSystem interface.
  */
 class TaskSystemSerial: public ITaskSystem {
+    private:
+        StatsBoard stats;
+
     public:
         TaskSystemSerial(int num_threads);
         ~TaskSystemSerial();
@@ -21,6 +26,8 @@ class TaskSystemSerial: public ITaskSystem {
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
         void sync();
+        void spawn(IRunnable* runnable, int num_total_tasks);
+        std::vector<WorkerStats> getStats();
 };
 
 /*
@@ -34,7 +41,8 @@ class TaskSystemParallelSpawn: public ITaskSystem {
         int num_threads;
         std::thread *worker_threads;
         std::atomic<int> task_counter;
-        void runInBulk(IRunnable* runnable, int num_total_tasks);
+        StatsBoard stats;
+        void runInBulk(IRunnable* runnable, int num_total_tasks, int thread_id);
     public:
         TaskSystemParallelSpawn(int num_threads);
         ~TaskSystemParallelSpawn();
@@ -43,6 +51,8 @@ class TaskSystemParallelSpawn: public ITaskSystem {
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
         void sync();
+        void spawn(IRunnable* runnable, int num_total_tasks);
+        std::vector<WorkerStats> getStats();
 };
 
 /*
@@ -60,7 +70,9 @@ class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
         bool terminate;
         IRunnable *runnable;
         int num_total_tasks;
-        void runInBulk();
+        int launch_generation;
+        StatsBoard stats;
+        void runInBulk(int thread_id);
         std::mutex mtx; 
     public:
         TaskSystemParallelThreadPoolSpinning(int num_threads);
@@ -70,6 +82,8 @@ class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
         void sync();
+        void spawn(IRunnable* runnable, int num_total_tasks);
+        std::vector<WorkerStats> getStats();
 };
 
 /*
@@ -80,17 +94,46 @@ class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
  */
 class TaskSystemParallelThreadPoolSleeping: public ITaskSystem {
     private:
+        // Hot shared state is split by access pattern, with a full cache
+        // line of padding between groups: launch parameters that workers
+        // only read, the task counter every claim writes, the completion
+        // counter written once per worker per launch, and the lock and
+        // condition variables used for sleeping.
         int num_threads;
         std::thread *thread_pool;
-        std::atomic<int> task_counter;
-        std::atomic<int> task_completed; 
         bool terminate;
         IRunnable *runnable;
         int num_total_tasks;
-        void runInBulk();
+        unsigned int launch_generation;
+        char pad0[CACHE_LINE_SIZE];
+        // The launch generation in the high 32 bits and the next task id
+        // in the low 32 bits, so that a claim cannot take an id of a
+        // launch other than the one the worker read the parameters of.
+        std::atomic<unsigned long long> task_counter;
+        char pad1[CACHE_LINE_SIZE];
+        std::atomic<int> task_completed; 
+        char pad2[CACHE_LINE_SIZE];
         std::mutex mtx;
         std::condition_variable cv;
         std::condition_variable cv2;
+        // Workers waiting on cv, and how many of them have already been
+        // notified. Only written under mtx.
+        std::atomic<int> num_idle;
+        std::atomic<int> num_signaled;
+        StatsBoard stats;
+        // Lifecycle stamps of the current launch, in CycleTimer ticks.
+        // first_task_ticks is stamped by whichever worker claims task 0,
+        // done_ticks by the one that completes the last task.
+        std::atomic<unsigned long long> first_task_ticks;
+        std::atomic<unsigned long long> done_ticks;
+        LaunchLatencies launch_latency;
+#ifdef TASKSYS_TRACE
+        TraceRecorder* trace;
+        int trace_launch;
+#endif
+        void wakeIdleWorkers(int max_wakeups);
+        int claimTask(unsigned int generation, int total);
+        void runInBulk(int thread_id);
 
     public:
         TaskSystemParallelThreadPoolSleeping(int num_threads);
@@ -100,6 +143,12 @@ class TaskSystemParallelThreadPoolSleeping: public ITaskSystem {
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
         void sync();
+        void spawn(IRunnable* runnable, int num_total_tasks);
+        std::vector<WorkerStats> getStats();
+        bool getLaunchLatency(LaunchPhase phase, LatencySummary& summary);
+#ifdef TASKSYS_TRACE
+        bool writeTrace(const char* filename);
+#endif
 };
 
 #endif
@@ -1,9 +1,15 @@
 #ifndef _ITASKSYS_H
 #define _ITASKSYS_H
+#include <stdio.h>
 #include <vector>
 
 typedef int TaskID;
 
+enum ScanType {
+    INCLUSIVE_SCAN,
+    EXCLUSIVE_SCAN,
+};
+
 class IRunnable {
     public:
         virtual ~IRunnable();
@@ -20,7 +26,68 @@ class IRunnable {
         virtual void runTask(int task_id, int num_total_tasks) = 0;
 };
 
+class ITileRunnable {
+    public:
+        virtual ~ITileRunnable();
+
+        /*
+          Executes one tile of a 2D bulk task launch.
+
+           - tx, ty: the coordinates of the current tile. These values
+             will be between 0 and ntx-1 and 0 and nty-1 respectively.
+
+           - ntx, nty: the number of tiles in each dimension of the
+             launch.
+         */
+        virtual void runTile(int tx, int ty, int ntx, int nty) = 0;
+};
+
+/*
+ * Runtime counters of one worker of a task system, as returned by
+ * ITaskSystem::getStats(). Counters accumulate over the lifetime of the
+ * task system. Times are in nanoseconds. Tasks that spawn() runs
+ * inline are counted as part of the task that spawned them.
+ */
+struct WorkerStats {
+    unsigned long long tasks_executed;
+    unsigned long long launches_touched;  // launches it ran at least one task of
+    unsigned long long busy_ns;           // running tasks
+    unsigned long long idle_ns;           // spinning or asleep, waiting for work
+    unsigned long long num_sleeps;
+    unsigned long long num_wakes;
+    unsigned long long steal_attempts;    // probes of other workers' queues
+    unsigned long long steal_successes;
+    unsigned long long mutex_wait_ns;     // blocked acquiring the pool's lock
+};
+
+/*
+ * Phases of the lifecycle of a bulk task launch, as timed by
+ * ITaskSystem::getLaunchLatency().
+ */
+enum LaunchPhase {
+    LAUNCH_DEPS_WAIT,   // submitted until its last dependency finished
+    LAUNCH_SCHED_WAIT,  // dependencies satisfied until its first task started
+    LAUNCH_EXECUTION,   // first task started until its last task finished
+    LAUNCH_TOTAL,       // submitted until its last task finished
+    NUM_LAUNCH_PHASES,
+};
+
+/*
+ * Latency distribution of one launch phase. Times are in microseconds.
+ */
+struct LatencySummary {
+    unsigned long long count;
+    double min_us;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+    double max_us;
+};
+
 class ITaskSystem {
+    protected:
+        int num_workers;
+
     public:
         /*
           Instantiates a task system.
@@ -66,5 +133,103 @@ class ITaskSystem {
           runXXX calls are done.
          */
         virtual void sync() = 0;
+
+        /*
+          Spawns num_total_tasks additional tasks of `runnable` from
+          inside a running task. The spawned tasks become part of the
+          bulk task launch of the task that spawned them: that launch
+          (and thus run() or sync()) only completes once every task
+          it spawned, directly or transitively, has completed.
+
+          Calls made outside of a running task execute the tasks
+          inline on the calling thread.
+         */
+        virtual void spawn(IRunnable* runnable, int num_total_tasks) = 0;
+
+        /*
+          Returns a snapshot of the per-worker counters, one entry per
+          worker thread. Task systems that run every task on the
+          calling thread report a single worker. Cheap enough to call
+          at any time, including while tasks are running.
+         */
+        virtual std::vector<WorkerStats> getStats() = 0;
+
+        /*
+          Writes the task execution timeline recorded so far to
+          `filename` as Chrome trace JSON, for chrome://tracing or
+          ui.perfetto.dev. Call it while no launch is running, e.g.
+          after sync(). Only the thread pools record a timeline, and
+          only when built with `make TRACE=1`; otherwise this returns
+          false without writing anything.
+         */
+        virtual bool writeTrace(const char* filename);
+
+        /*
+          Makes every following sync() print a report on the launch
+          graph it just executed to `out`: total work, span, available
+          parallelism, achieved speedup and the launches on the
+          critical path. Pass NULL to turn the report off. Task systems
+          that do not schedule by dependencies ignore this.
+         */
+        virtual void setGraphReport(FILE* out);
+
+        /*
+          Summarizes how long the launches completed so far spent in
+          `phase`. Every launch is stamped with CycleTimer ticks when it
+          is submitted, when its dependencies are satisfied, when its
+          first task starts and when its last task finishes; the
+          intervals are kept in log-linear histograms, so percentiles
+          are within about 3% of the exact value. Returns false if the
+          task system does not track launch latencies.
+         */
+        virtual bool getLaunchLatency(LaunchPhase phase, LatencySummary& summary);
+
+        /*
+          Reduces the index range [0, n) using the task system's
+          workers, synchronously with the calling thread.
+
+           - body(begin, end, acc): folds the elements [begin, end),
+             in increasing index order, into the accumulator acc.
+
+           - combine(left, right): returns the combination of two
+             accumulators, where left covers lower indices than
+             right. It must be associative, but need not be
+             commutative.
+
+          Each worker accumulates into its own cache-line-padded copy
+          of `identity`, and the partial results are then combined in
+          a binary tree in index order.
+        */
+        template <typename T, typename Body, typename Combine>
+        T parallelReduce(int n, const T& identity, Body body, Combine combine);
+
+        /*
+          Computes the prefix scan of input[0, n) under the associative
+          operator op, writing it to output, synchronously with the
+          calling thread. With INCLUSIVE_SCAN output[i] covers
+          input[0..i]; with EXCLUSIVE_SCAN it covers input[0..i-1] and
+          output[0] is `identity`. input and output may alias.
+
+          The range is split into one block per worker and scanned in
+          three passes: a bulk launch scanning each block locally, a
+          serial scan of the block totals, and a bulk launch applying
+          each block's offset.
+        */
+        template <typename T, typename Op>
+        void parallelScan(const T* input, T* output, int n, const T& identity,
+                          Op op, ScanType type);
+
+        /*
+          Executes a bulk launch over the ntx x nty tile grid,
+          synchronously with the calling thread. Tiles are handed out
+          to workers in Morton (Z-curve) order, so tiles claimed close
+          together in time are also close together in 2D.
+
+          Use TiledRunnable directly to make a tiled launch with
+          runAsyncWithDeps().
+        */
+        void runTiled(ITileRunnable* runnable, int ntx, int nty);
 };
+
+#include "taskprims.h"
 #endif
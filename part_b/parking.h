@@ -0,0 +1,160 @@
+#ifndef _PARKING_H
+#define _PARKING_H
+
+#include <atomic>
+#include <climits>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+/*
+ * WaitWord: a 32-bit word that threads can block on until it changes.
+ * On Linux this is a thin wrapper around futex(2), so neither waiting nor
+ * waking takes a lock. Other platforms fall back to a mutex and condition
+ * variable per word.
+ */
+class WaitWord {
+    public:
+        std::atomic<int> value;
+
+        WaitWord() : value(0) {}
+
+        /*
+          Blocks while the word holds `expected`. May return spuriously,
+          so callers re-check the word in a loop.
+         */
+        void wait(int expected) {
+#if defined(__linux__)
+            syscall(SYS_futex, reinterpret_cast<int*>(&value), FUTEX_WAIT_PRIVATE,
+                    expected, NULL, NULL, 0);
+#else
+            std::unique_lock<std::mutex> lock(mtx);
+            while (value.load() == expected) {
+                cv.wait(lock);
+            }
+#endif
+        }
+
+        /*
+          Wakes up to `count` threads blocked in wait(). The caller must
+          change the word before waking.
+         */
+        void wake(int count) {
+#if defined(__linux__)
+            syscall(SYS_futex, reinterpret_cast<int*>(&value), FUTEX_WAKE_PRIVATE,
+                    count, NULL, NULL, 0);
+#else
+            { std::unique_lock<std::mutex> lock(mtx); }
+            if (count == 1) {
+                cv.notify_one();
+            } else {
+                cv.notify_all();
+            }
+#endif
+        }
+
+    private:
+#if !defined(__linux__)
+        std::mutex mtx;
+        std::condition_variable cv;
+#endif
+        WaitWord(const WaitWord&);
+        WaitWord& operator=(const WaitWord&);
+};
+
+/*
+ * ParkingLot: one wait word per worker, so that a waker can pick exactly
+ * which sleeping workers to wake.
+ *
+ * A worker that runs out of work calls prepareToPark(), checks once more
+ * for work, and then either cancelPark()s or park()s. Work must be
+ * published before calling unpark(); together with the seq_cst updates of
+ * num_parked this guarantees that either the parking worker sees the new
+ * work or the waker sees the parked worker.
+ */
+class ParkingLot {
+    private:
+        enum {
+            RUNNING = 0,
+            PARKED = 1,
+            NOTIFIED = 2,
+        };
+
+        struct Spot {
+            WaitWord word;
+            char pad[CACHE_LINE_SIZE];
+        };
+
+        Spot* spots;
+        int num_spots;
+        std::atomic<int> num_parked;
+
+    public:
+        ParkingLot(int num_workers) : num_spots(num_workers), num_parked(0) {
+            spots = new Spot[num_workers];
+        }
+        ~ParkingLot() {
+            delete [] spots;
+        }
+
+        int numParked() {
+            return num_parked.load();
+        }
+
+        void prepareToPark(int worker) {
+            spots[worker].word.value.store(PARKED);
+            num_parked.fetch_add(1);
+        }
+
+        void cancelPark(int worker) {
+            int expected = PARKED;
+            if (spots[worker].word.value.compare_exchange_strong(expected, RUNNING)) {
+                num_parked.fetch_sub(1);
+            } else {
+                // A waker already claimed this worker and did the accounting.
+                spots[worker].word.value.store(RUNNING);
+            }
+        }
+
+        void park(int worker) {
+            WaitWord& word = spots[worker].word;
+            while (word.value.load() == PARKED) {
+                word.wait(PARKED);
+            }
+            word.value.store(RUNNING);
+        }
+
+        /*
+          Wakes up to `count` parked workers and returns how many were
+          woken.
+         */
+        int unpark(int count) {
+            int woken = 0;
+            for (int i = 0; i < num_spots && woken < count; i++) {
+                if (num_parked.load() == 0) {
+                    break;
+                }
+                WaitWord& word = spots[i].word;
+                int expected = PARKED;
+                if (word.value.load() == PARKED &&
+                    word.value.compare_exchange_strong(expected, NOTIFIED)) {
+                    num_parked.fetch_sub(1);
+                    word.wake(1);
+                    woken++;
+                }
+            }
+            return woken;
+        }
+
+    private:
+        ParkingLot(const ParkingLot&);
+        ParkingLot& operator=(const ParkingLot&);
+};
+
+#endif
@@ -1,12 +1,25 @@
 #include "tasksys.h"
 #include "cstdio"
+#include "CycleTimer.h"
 
 
 IRunnable::~IRunnable() {}
 
-ITaskSystem::ITaskSystem(int num_threads) {}
+ITileRunnable::~ITileRunnable() {}
+
+ITaskSystem::ITaskSystem(int num_threads): num_workers(num_threads) {}
 ITaskSystem::~ITaskSystem() {}
 
+bool ITaskSystem::writeTrace(const char* filename) {
+    return false;
+}
+
+void ITaskSystem::setGraphReport(FILE* out) {}
+
+bool ITaskSystem::getLaunchLatency(LaunchPhase phase, LatencySummary& summary) {
+    return false;
+}
+
 /*
  * ================================================================
  * Serial task system implementation
@@ -17,22 +30,32 @@ const char* TaskSystemSerial::name() {
     return "Serial";
 }
 
-TaskSystemSerial::TaskSystemSerial(int num_threads): ITaskSystem(num_threads) {
+TaskSystemSerial::TaskSystemSerial(int num_threads): ITaskSystem(num_threads), stats(1) {
 }
 
 TaskSystemSerial::~TaskSystemSerial() {}
 
 void TaskSystemSerial::run(IRunnable* runnable, int num_total_tasks) {
+    unsigned long long start = statsNowNs();
     for (int i = 0; i < num_total_tasks; i++) {
         runnable->runTask(i, num_total_tasks);
     }
+    if (num_total_tasks > 0) {
+        stats[0].countTasks(num_total_tasks, statsNowNs() - start);
+        stats[0].countLaunch();
+    }
 }
 
 TaskID TaskSystemSerial::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                           const std::vector<TaskID>& deps) {
+    unsigned long long start = statsNowNs();
     for (int i = 0; i < num_total_tasks; i++) {
         runnable->runTask(i, num_total_tasks);
     }
+    if (num_total_tasks > 0) {
+        stats[0].countTasks(num_total_tasks, statsNowNs() - start);
+        stats[0].countLaunch();
+    }
 
     return 0;
 }
@@ -41,6 +64,18 @@ void TaskSystemSerial::sync() {
     return;
 }
 
+void TaskSystemSerial::spawn(IRunnable* runnable, int num_total_tasks) {
+    // Spawned tasks run inline on the calling thread, so they are
+    // complete before the spawning task returns.
+    for (int i = 0; i < num_total_tasks; i++) {
+        runnable->runTask(i, num_total_tasks);
+    }
+}
+
+std::vector<WorkerStats> TaskSystemSerial::getStats() {
+    return stats.snapshot();
+}
+
 /*
  * ================================================================
  * Parallel Task System Implementation
@@ -51,7 +86,7 @@ const char* TaskSystemParallelSpawn::name() {
     return "Parallel + Always Spawn";
 }
 
-TaskSystemParallelSpawn::TaskSystemParallelSpawn(int num_threads): ITaskSystem(num_threads) {
+TaskSystemParallelSpawn::TaskSystemParallelSpawn(int num_threads): ITaskSystem(num_threads), stats(1) {
     // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
 }
 
@@ -59,17 +94,27 @@ TaskSystemParallelSpawn::~TaskSystemParallelSpawn() {}
 
 void TaskSystemParallelSpawn::run(IRunnable* runnable, int num_total_tasks) {
     // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    unsigned long long start = statsNowNs();
     for (int i = 0; i < num_total_tasks; i++) {
         runnable->runTask(i, num_total_tasks);
     }
+    if (num_total_tasks > 0) {
+        stats[0].countTasks(num_total_tasks, statsNowNs() - start);
+        stats[0].countLaunch();
+    }
 }
 
 TaskID TaskSystemParallelSpawn::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                                  const std::vector<TaskID>& deps) {
     // NOTE: CS149 students are not expected to implement TaskSystemParallelSpawn in Part B.
+    unsigned long long start = statsNowNs();
     for (int i = 0; i < num_total_tasks; i++) {
         runnable->runTask(i, num_total_tasks);
     }
+    if (num_total_tasks > 0) {
+        stats[0].countTasks(num_total_tasks, statsNowNs() - start);
+        stats[0].countLaunch();
+    }
 
     return 0;
 }
@@ -79,6 +124,18 @@ void TaskSystemParallelSpawn::sync() {
     return;
 }
 
+void TaskSystemParallelSpawn::spawn(IRunnable* runnable, int num_total_tasks) {
+    // Spawned tasks run inline on the calling thread, so they are
+    // complete before the spawning task returns.
+    for (int i = 0; i < num_total_tasks; i++) {
+        runnable->runTask(i, num_total_tasks);
+    }
+}
+
+std::vector<WorkerStats> TaskSystemParallelSpawn::getStats() {
+    return stats.snapshot();
+}
+
 /*
  * ================================================================
  * Parallel Thread Pool Spinning Task System Implementation
@@ -89,7 +146,7 @@ const char* TaskSystemParallelThreadPoolSpinning::name() {
     return "Parallel + Thread Pool + Spin";
 }
 
-TaskSystemParallelThreadPoolSpinning::TaskSystemParallelThreadPoolSpinning(int num_threads): ITaskSystem(num_threads) {
+TaskSystemParallelThreadPoolSpinning::TaskSystemParallelThreadPoolSpinning(int num_threads): ITaskSystem(num_threads), stats(1) {
     // NOTE: CS149 students are not expected to implement TaskSystemParallelThreadPoolSpinning in Part B.
 }
 
@@ -97,17 +154,27 @@ TaskSystemParallelThreadPoolSpinning::~TaskSystemParallelThreadPoolSpinning() {}
 
 void TaskSystemParallelThreadPoolSpinning::run(IRunnable* runnable, int num_total_tasks) {
     // NOTE: CS149 students are not expected to implement TaskSystemParallelThreadPoolSpinning in Part B.
+    unsigned long long start = statsNowNs();
     for (int i = 0; i < num_total_tasks; i++) {
         runnable->runTask(i, num_total_tasks);
     }
+    if (num_total_tasks > 0) {
+        stats[0].countTasks(num_total_tasks, statsNowNs() - start);
+        stats[0].countLaunch();
+    }
 }
 
 TaskID TaskSystemParallelThreadPoolSpinning::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                                               const std::vector<TaskID>& deps) {
     // NOTE: CS149 students are not expected to implement TaskSystemParallelThreadPoolSpinning in Part B.
+    unsigned long long start = statsNowNs();
     for (int i = 0; i < num_total_tasks; i++) {
         runnable->runTask(i, num_total_tasks);
     }
+    if (num_total_tasks > 0) {
+        stats[0].countTasks(num_total_tasks, statsNowNs() - start);
+        stats[0].countLaunch();
+    }
 
     return 0;
 }
@@ -117,6 +184,18 @@ void TaskSystemParallelThreadPoolSpinning::sync() {
     return;
 }
 
+void TaskSystemParallelThreadPoolSpinning::spawn(IRunnable* runnable, int num_total_tasks) {
+    // Spawned tasks run inline on the calling thread, so they are
+    // complete before the spawning task returns.
+    for (int i = 0; i < num_total_tasks; i++) {
+        runnable->runTask(i, num_total_tasks);
+    }
+}
+
+std::vector<WorkerStats> TaskSystemParallelThreadPoolSpinning::getStats() {
+    return stats.snapshot();
+}
+
 /*
  * ================================================================
  * Parallel Thread Pool Sleeping Task System Implementation
@@ -127,12 +206,26 @@ const char* TaskSystemParallelThreadPoolSleeping::name() {
     return "Parallel + Thread Pool + Sleep";
 }
 
-TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(int num_threads): ITaskSystem(num_threads) {
+// The pool and worker index of the current thread, and the launch whose
+// task it is running, so that spawn() can find the right queue.
+static thread_local TaskSystemParallelThreadPoolSleeping* current_system = nullptr;
+static thread_local int current_worker = -1;
+static thread_local Launch* current_launch = nullptr;
+
+TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(int num_threads)
+  : ITaskSystem(num_threads), stats(num_threads), launch_latency(CycleTimer::secondsPerTick()) {
     num_launches = 0;
     num_total_launches = 0;
     terminate = false;
+    num_spawned_queued.store(0);
+    graph_report = NULL;
     std::unique_lock<std::mutex> lock(mtx);
     this->num_threads = num_threads;
+    parking = new ParkingLot(num_threads);
+    worker_queues = new WorkerQueue[num_threads];
+#ifdef TASKSYS_TRACE
+    trace = new TraceRecorder(num_threads);
+#endif
     thread_pool = new std::thread[num_threads];
     for (int i = 0; i < num_threads; i++) {
         thread_pool[i] = std::thread(&TaskSystemParallelThreadPoolSleeping::runInBulk, this, i);
@@ -142,24 +235,44 @@ TaskSystemParallelThreadPoolSleeping::TaskSystemParallelThreadPoolSleeping(int n
 TaskSystemParallelThreadPoolSleeping::~TaskSystemParallelThreadPoolSleeping() {
     std::unique_lock<std::mutex> lock(mtx);
     terminate = true;
-    cv.notify_all();
     lock.unlock();
+    parking->unpark(num_threads);
     for (int i = 0; i < num_threads; i++) {
         thread_pool[i].join();
     }
+    delete [] worker_queues;
+    delete parking;
+#ifdef TASKSYS_TRACE
+    delete trace;
+#endif
 }
 
+// Depth-first search from launch_id, pushing every launch after all the
+// launches that depend on it. Iterative, as a chain of launches would
+// otherwise recurse once per launch.
 void TaskSystemParallelThreadPoolSleeping::topologicalSort(TaskID launch_id) {
     if (visited[launch_id]) {
         return;
     }
 
+    // Each entry is a launch and the index of its next child to visit.
+    std::vector<std::pair<TaskID, size_t>> path;
     visited[launch_id] = true;
-    for (TaskID child : children[launch_id]) {
-        topologicalSort(child);
+    path.push_back(std::make_pair(launch_id, 0));
+    while (!path.empty()) {
+        TaskID current = path.back().first;
+        size_t& next = path.back().second;
+        if (next < children[current].size()) {
+            TaskID child = children[current][next++];
+            if (!visited[child]) {
+                visited[child] = true;
+                path.push_back(std::make_pair(child, 0));
+            }
+        } else {
+            sorted_launches.push(current);
+            path.pop_back();
+        }
     }
-
-    sorted_launches.push(launch_id);
 }
 
 void TaskSystemParallelThreadPoolSleeping::run(IRunnable* runnable, int num_total_tasks) {
@@ -169,8 +282,14 @@ void TaskSystemParallelThreadPoolSleeping::run(IRunnable* runnable, int num_tota
 
 TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                                     const std::vector<TaskID>& deps) {
+    unsigned long long submit_ticks = CycleTimer::currentTicks();
     std::unique_lock<std::mutex> lock(mtx);
-    launches.push_back(new Launch{runnable, num_total_tasks, deps});
+    launches.push_back(new Launch{num_launches, runnable, num_total_tasks, deps});
+    launches.back()->submit_ticks = submit_ticks;
+    launches.back()->ready_ticks = submit_ticks;
+#ifdef TASKSYS_TRACE
+    trace->addLaunch(num_total_tasks, deps);
+#endif
 
     visited.push_back(false);
     children.push_back(std::vector<TaskID>());
@@ -181,6 +300,7 @@ TaskID TaskSystemParallelThreadPoolSleeping::runAsyncWithDeps(IRunnable* runnabl
 }
 
 void TaskSystemParallelThreadPoolSleeping::sync() {
+    unsigned long long sync_start = statsNowNs();
     std::unique_lock<std::mutex> lock(mtx);
     for (TaskID i = 0; i < num_launches; i++) {
         topologicalSort(i);
@@ -188,12 +308,19 @@ void TaskSystemParallelThreadPoolSleeping::sync() {
     working_launch = -1;
     launch_completed = 0;
     num_total_launches = num_launches;
+    sync_done.value.store(num_launches == 0 ? 1 : 0);
     lock.unlock();
-    cv.notify_all();
+    // One worker is enough to promote the first ready launch; it then
+    // unparks as many more as that launch has tasks for.
+    parking->unpark(1);
+
+    while (sync_done.value.load() == 0) {
+        sync_done.wait(0);
+    }
 
     lock.lock();
-    while (launch_completed < num_launches) {
-        cv2.wait(lock);
+    if (graph_report && num_launches > 0) {
+        reportGraph(graph_report, statsNowNs() - sync_start);
     }
     num_total_launches = 0;
     for (Launch *launch : launches) {
@@ -203,58 +330,290 @@ void TaskSystemParallelThreadPoolSleeping::sync() {
     visited.clear();
     children.clear();
     num_launches = 0;
+#ifdef TASKSYS_TRACE
+    trace->endBatch();
+#endif
 
     return;
 }
 
+void TaskSystemParallelThreadPoolSleeping::spawn(IRunnable* runnable, int num_total_tasks) {
+    if (current_system != this || current_launch == nullptr) {
+        for (int i = 0; i < num_total_tasks; i++) {
+            runnable->runTask(i, num_total_tasks);
+        }
+        return;
+    }
+
+    // Count the new tasks against the launch before the spawning task can
+    // complete, so the launch cannot be marked done while they are queued.
+    Launch* launch = current_launch;
+    launch->num_spawned.fetch_add(num_total_tasks);
+    WorkerQueue& queue = worker_queues[current_worker];
+    {
+        std::unique_lock<std::mutex> lock(queue.mtx);
+        for (int i = 0; i < num_total_tasks; i++) {
+            queue.tasks.push_back(SpawnedTask{runnable, i, num_total_tasks, launch});
+        }
+    }
+    num_spawned_queued.fetch_add(num_total_tasks);
+    parking->unpark(num_total_tasks);
+}
+
+std::vector<WorkerStats> TaskSystemParallelThreadPoolSleeping::getStats() {
+    return stats.snapshot();
+}
+
+#ifdef TASKSYS_TRACE
+bool TaskSystemParallelThreadPoolSleeping::writeTrace(const char* filename) {
+    return trace->write(filename);
+}
+#endif
+
+bool TaskSystemParallelThreadPoolSleeping::popSpawned(int thread_id, SpawnedTask& task) {
+    if (num_spawned_queued.load() == 0) {
+        return false;
+    }
+
+    // Newest task from our own queue first, then the oldest task of the others.
+    for (int i = 0; i < num_threads; i++) {
+        int victim = (thread_id + i) % num_threads;
+        WorkerQueue& queue = worker_queues[victim];
+        std::unique_lock<std::mutex> lock(queue.mtx);
+        if (victim != thread_id) {
+            stats[thread_id].countSteal(!queue.tasks.empty());
+        }
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        if (victim == thread_id) {
+            task = queue.tasks.back();
+            queue.tasks.pop_back();
+        } else {
+            task = queue.tasks.front();
+            queue.tasks.pop_front();
+        }
+        num_spawned_queued.fetch_sub(1);
+        return true;
+    }
+    return false;
+}
+
+void TaskSystemParallelThreadPoolSleeping::setGraphReport(FILE* out) {
+    std::unique_lock<std::mutex> lock(mtx);
+    graph_report = out;
+}
+
+bool TaskSystemParallelThreadPoolSleeping::getLaunchLatency(LaunchPhase phase, LatencySummary& summary) {
+    std::unique_lock<std::mutex> lock(mtx);
+    summary = launch_latency.summary(phase);
+    return true;
+}
+
+// Must be called with mtx held, once every launch of the sync is done.
+// TaskIDs are handed out in submission order and deps can only name
+// earlier launches, so increasing TaskID order is a topological order.
+void TaskSystemParallelThreadPoolSleeping::reportGraph(FILE* out, unsigned long long elapsed_ns) {
+    // Longest path ending at each launch, weighting each launch by its
+    // measured duration, and by its longest task for the ideal span.
+    std::vector<unsigned long long> finish(num_launches);
+    std::vector<unsigned long long> ideal_finish(num_launches);
+    std::vector<TaskID> critical_dep(num_launches, -1);
+    unsigned long long work = 0;
+    TaskID last = 0;
+    for (TaskID i = 0; i < num_launches; i++) {
+        const LaunchTiming& timing = launches[i]->timing;
+        unsigned long long duration = timing.last_end_ns > timing.first_start_ns ?
+                                      timing.last_end_ns - timing.first_start_ns : 0;
+        unsigned long long start = 0;
+        unsigned long long ideal_start = 0;
+        for (TaskID dep : launches[i]->deps) {
+            if (finish[dep] > start) {
+                start = finish[dep];
+                critical_dep[i] = dep;
+            }
+            ideal_start = std::max(ideal_start, ideal_finish[dep]);
+        }
+        finish[i] = start + duration;
+        ideal_finish[i] = ideal_start + timing.max_task_ns;
+        work += timing.work_ns;
+        if (finish[i] > finish[last]) {
+            last = i;
+        }
+    }
+    unsigned long long ideal_span = *std::max_element(ideal_finish.begin(), ideal_finish.end());
+
+    std::vector<TaskID> critical_path;
+    for (TaskID i = last; i != -1; i = critical_dep[i]) {
+        critical_path.push_back(i);
+    }
+    std::reverse(critical_path.begin(), critical_path.end());
+
+    fprintf(out, "  graph: %d launches, work %.3f ms, elapsed %.3f ms, speedup %.2f\n",
+            num_launches, work * 1e-6, elapsed_ns * 1e-6,
+            elapsed_ns ? (double) work / elapsed_ns : 0.0);
+    fprintf(out, "  span (measured launch durations): %.3f ms, parallelism %.2f\n",
+            finish[last] * 1e-6, finish[last] ? (double) work / finish[last] : 0.0);
+    fprintf(out, "  span (longest task per launch):   %.3f ms, parallelism %.2f\n",
+            ideal_span * 1e-6, ideal_span ? (double) work / ideal_span : 0.0);
+    fprintf(out, "  critical path (%d launches):", (int) critical_path.size());
+    const size_t max_listed = 64;
+    for (size_t i = 0; i < critical_path.size() && i < max_listed; i++) {
+        fprintf(out, " %d", critical_path[i]);
+    }
+    if (critical_path.size() > max_listed) {
+        fprintf(out, " ... (%d more)", (int) (critical_path.size() - max_listed));
+    }
+    fprintf(out, "\n");
+}
+
+// Must be called with mtx held.
+void TaskSystemParallelThreadPoolSleeping::completeTasks(Launch* launch, int count,
+                                                         const LaunchTiming& timing) {
+    launch->timing.merge(timing);
+    launch->task_completed += count;
+    if (launch->task_completed == launch->num_total_tasks + launch->num_spawned.load()) {
+        launch->done = true;
+        launch->done_ticks = CycleTimer::currentTicks();
+        launch_latency.record(launch->submit_ticks, launch->ready_ticks,
+                              launch->first_task_ticks, launch->done_ticks);
+        // Its dependents become ready when the last of their deps is
+        // done, not when a worker gets around to noticing.
+        for (TaskID child : children[launch->id]) {
+            Launch* dependent = launches[child];
+            dependent->num_pending_deps--;
+            dependent->ready_ticks = std::max(dependent->ready_ticks, launch->done_ticks);
+        }
+        launch_completed++;
+        if (launch_completed == num_launches) {
+            sync_done.value.store(1);
+            sync_done.wake(1);
+        }
+    }
+}
+
 void TaskSystemParallelThreadPoolSleeping::runInBulk(int thread_id) {
+    current_system = this;
+    current_worker = thread_id;
+
+    // Tasks of the working launch completed by this worker but not yet
+    // added to its task_completed. They are published when the worker
+    // stops claiming tasks from that launch, before it can go to sleep.
+    Launch* tally_launch = nullptr;
+    int tally = 0;
+    LaunchTiming tally_timing;
+
+    // The launch this worker last ran a task of. Reset when parking, as
+    // a later sync() may reuse the address of a deleted launch.
+    WorkerCounters& counters = stats[thread_id];
+    Launch* stats_launch = nullptr;
+
     while (true) {
-        std::unique_lock<std::mutex> lock(mtx);
-        while (!terminate && (num_total_launches == 0 || (sorted_launches.empty() && working_launch == -1) || launch_completed == num_total_launches)) {
-            cv.wait(lock);
+        SpawnedTask spawned;
+        if (popSpawned(thread_id, spawned)) {
+            if (spawned.launch != stats_launch) {
+                counters.countLaunch();
+                stats_launch = spawned.launch;
+            }
+            unsigned long long start = statsNowNs();
+            current_launch = spawned.launch;
+            spawned.runnable->runTask(spawned.task_id, spawned.num_total_tasks);
+            current_launch = nullptr;
+            unsigned long long end = statsNowNs();
+            counters.countTasks(1, end - start);
+#ifdef TASKSYS_TRACE
+            trace->recordTask(thread_id, trace->launchNumber(spawned.launch->id),
+                              spawned.task_id, true, start, end);
+#endif
+            std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+            lockCounted(lock, counters);
+            if (tally > 0) {
+                completeTasks(tally_launch, tally, tally_timing);
+                tally = 0;
+                tally_timing = LaunchTiming();
+            }
+            LaunchTiming timing;
+            timing.addTask(start, end);
+            completeTasks(spawned.launch, 1, timing);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mtx, std::defer_lock);
+        lockCounted(lock, counters);
+        if (tally > 0 && (working_launch == -1 || launches[working_launch] != tally_launch ||
+                          tally_launch->task_counter >= tally_launch->num_total_tasks)) {
+            completeTasks(tally_launch, tally, tally_timing);
+            tally = 0;
+            tally_timing = LaunchTiming();
         }
         if (terminate) {
             return;
         }
 
-        if (working_launch != -1) {
+        bool syncing = num_total_launches != 0 && launch_completed != num_total_launches;
+        if (syncing && working_launch != -1) {
             int local_working_launch = working_launch;
             Launch *launch = launches[local_working_launch];
             int task_counter = launch->task_counter;
             launch->task_counter++;
+            if (task_counter == 0) {
+                launch->first_task_ticks = CycleTimer::currentTicks();
+            }
             int num_total_tasks = launch->num_total_tasks;
             IRunnable *runnable = launch->runnable;
             if (task_counter < num_total_tasks) {
                 lock.unlock();
-                runnable->runTask(task_counter, num_total_tasks);
-                lock.lock();
-                launch->task_completed++;
-                if (launch->task_completed == num_total_tasks) {
-                    launch_completed++;
-                    if (launch_completed == num_launches) {
-                        cv2.notify_one();
-                    }
+                if (launch != stats_launch) {
+                    counters.countLaunch();
+                    stats_launch = launch;
                 }
+                unsigned long long start = statsNowNs();
+                current_launch = launch;
+                runnable->runTask(task_counter, num_total_tasks);
+                current_launch = nullptr;
+                unsigned long long end = statsNowNs();
+                counters.countTasks(1, end - start);
+#ifdef TASKSYS_TRACE
+                trace->recordTask(thread_id, trace->launchNumber(launch->id),
+                                  task_counter, false, start, end);
+#endif
+                tally_launch = launch;
+                tally++;
+                tally_timing.addTask(start, end);
             } else {
                 working_launch = -1;
             }
+            continue;
+        }
 
-        } else {
+        if (syncing && !sorted_launches.empty()) {
             int new_launch_id = sorted_launches.top();
-            bool ready = true;
-            for (TaskID dep : launches[new_launch_id]->deps) { // reverse search can be faster
-                if (launches[dep]->task_completed != launches[dep]->num_total_tasks) {
-                    ready = false;
-                    break;
-                }
-            }
-            if (ready) {
+            if (launches[new_launch_id]->num_pending_deps == 0) {
                 working_launch = new_launch_id;
                 sorted_launches.pop();
-                cv3.notify_all();
-            } else {
-                cv3.wait(lock);
+                int num_total_tasks = launches[new_launch_id]->num_total_tasks;
+                lock.unlock();
+                // This worker takes one of the tasks itself.
+                parking->unpark(num_total_tasks - 1);
+                continue;
             }
         }
+
+        // Nothing to do until a launch becomes ready or a task is spawned.
+        // Scheduler state only changes under mtx, which is still held, but
+        // spawned tasks are published without it, so check for them again
+        // after announcing that this worker is about to park.
+        parking->prepareToPark(thread_id);
+        if (num_spawned_queued.load() > 0) {
+            parking->cancelPark(thread_id);
+            continue;
+        }
+        lock.unlock();
+        stats_launch = nullptr;
+        unsigned long long sleep_start = statsNowNs();
+        counters.countSleep();
+        parking->park(thread_id);
+        counters.countWake();
+        counters.countIdle(statsNowNs() - sleep_start);
     }
-}
\ No newline at end of file
+}
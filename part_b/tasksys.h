@@ -2,23 +2,99 @@
 #define _TASKSYS_H
 
 #include "itasksys.h"
+#include "taskstats.h"
+#include "tasktrace.h"
+#include "parking.h"
 #include <thread>
 #include <mutex>
-#include <condition_variable>
 #include <atomic>
 #include <stack>
+#include <deque>
+#include <climits>
+#include <algorithm>
 
+/*
+ * Measured execution of the tasks of a launch, or of the part of them
+ * run by one worker: when the first task started and the last one
+ * ended, and the summed and longest task time.
+ */
+struct LaunchTiming {
+    unsigned long long first_start_ns;
+    unsigned long long last_end_ns;
+    unsigned long long work_ns;
+    unsigned long long max_task_ns;
+
+    LaunchTiming() : first_start_ns(ULLONG_MAX), last_end_ns(0), work_ns(0), max_task_ns(0) {}
+
+    void addTask(unsigned long long start_ns, unsigned long long end_ns) {
+        first_start_ns = std::min(first_start_ns, start_ns);
+        last_end_ns = std::max(last_end_ns, end_ns);
+        work_ns += end_ns - start_ns;
+        max_task_ns = std::max(max_task_ns, end_ns - start_ns);
+    }
+
+    void merge(const LaunchTiming& other) {
+        first_start_ns = std::min(first_start_ns, other.first_start_ns);
+        last_end_ns = std::max(last_end_ns, other.last_end_ns);
+        work_ns += other.work_ns;
+        max_task_ns = std::max(max_task_ns, other.max_task_ns);
+    }
+};
+
+/*
+ * Fields are grouped by access pattern with a cache line of padding
+ * between groups, so that claiming tasks, publishing completions and
+ * spawning do not invalidate the line holding the read-only launch
+ * parameters.
+ */
 class Launch {
 public:
+    TaskID id;
     IRunnable* runnable;
     int num_total_tasks;
     std::vector<TaskID> deps;
+    char pad0[CACHE_LINE_SIZE];
     int task_counter;
+    char pad1[CACHE_LINE_SIZE];
     int task_completed;
-    std::mutex mtx;
+    bool done;
+    // Entries of deps that are not done yet.
+    int num_pending_deps;
+    LaunchTiming timing;
+    // Lifecycle stamps in CycleTimer ticks, see ITaskSystem::getLaunchLatency().
+    unsigned long long submit_ticks;
+    unsigned long long ready_ticks;
+    unsigned long long first_task_ticks;
+    unsigned long long done_ticks;
+    char pad2[CACHE_LINE_SIZE];
+    std::atomic<int> num_spawned;
+    char pad3[CACHE_LINE_SIZE];
+
+    Launch(TaskID i, IRunnable* r, int n, const std::vector<TaskID>& d)
+        : id(i), runnable(r), num_total_tasks(n), deps(d), task_counter(0), task_completed(0),
+          done(false), num_pending_deps((int) d.size()), submit_ticks(0), ready_ticks(0), first_task_ticks(0), done_ticks(0),
+          num_spawned(0) {}
+};
+
+/*
+ * A task added to a launch by ITaskSystem::spawn() from inside one of
+ * its running tasks.
+ */
+struct SpawnedTask {
+    IRunnable* runnable;
+    int task_id;
+    int num_total_tasks;
+    Launch* launch;
+};
 
-    Launch(IRunnable* r, int n, const std::vector<TaskID>& d)
-        : runnable(r), num_total_tasks(n), deps(d), task_counter(0), task_completed(0) {}
+/*
+ * Per-worker queue of spawned tasks. The owning worker pushes and pops
+ * at the back, idle workers steal from the front.
+ */
+class WorkerQueue {
+public:
+    std::mutex mtx;
+    std::deque<SpawnedTask> tasks;
 };
 
 
@@ -28,6 +104,9 @@ public:
  * itasksys.h for documentation of the ITaskSystem interface.
  */
 class TaskSystemSerial: public ITaskSystem {
+    private:
+        StatsBoard stats;
+
     public:
         TaskSystemSerial(int num_threads);
         ~TaskSystemSerial();
@@ -36,6 +115,8 @@ class TaskSystemSerial: public ITaskSystem {
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
         void sync();
+        void spawn(IRunnable* runnable, int num_total_tasks);
+        std::vector<WorkerStats> getStats();
 };
 
 /*
@@ -45,6 +126,9 @@ class TaskSystemSerial: public ITaskSystem {
  * of the ITaskSystem interface.
  */
 class TaskSystemParallelSpawn: public ITaskSystem {
+    private:
+        StatsBoard stats;
+
     public:
         TaskSystemParallelSpawn(int num_threads);
         ~TaskSystemParallelSpawn();
@@ -53,6 +137,8 @@ class TaskSystemParallelSpawn: public ITaskSystem {
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
         void sync();
+        void spawn(IRunnable* runnable, int num_total_tasks);
+        std::vector<WorkerStats> getStats();
 };
 
 /*
@@ -62,6 +148,9 @@ class TaskSystemParallelSpawn: public ITaskSystem {
  * documentation of the ITaskSystem interface.
  */
 class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
+    private:
+        StatsBoard stats;
+
     public:
         TaskSystemParallelThreadPoolSpinning(int num_threads);
         ~TaskSystemParallelThreadPoolSpinning();
@@ -70,6 +159,8 @@ class TaskSystemParallelThreadPoolSpinning: public ITaskSystem {
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
         void sync();
+        void spawn(IRunnable* runnable, int num_total_tasks);
+        std::vector<WorkerStats> getStats();
 };
 
 /*
@@ -93,9 +184,19 @@ class TaskSystemParallelThreadPoolSleeping: public ITaskSystem {
         std::thread *thread_pool;
         TaskID working_launch;
         std::mutex mtx;
-        std::condition_variable cv;
-        std::condition_variable cv2;
-        std::condition_variable cv3;
+        ParkingLot* parking;
+        WaitWord sync_done;
+        WorkerQueue* worker_queues;
+        std::atomic<int> num_spawned_queued;
+        StatsBoard stats;
+#ifdef TASKSYS_TRACE
+        TraceRecorder* trace;
+#endif
+        bool popSpawned(int thread_id, SpawnedTask& task);
+        FILE* graph_report;
+        LaunchLatencies launch_latency;
+        void reportGraph(FILE* out, unsigned long long elapsed_ns);
+        void completeTasks(Launch* launch, int count, const LaunchTiming& timing);
         void runInBulk(int thread_id);
 
     public:
@@ -106,6 +207,13 @@ class TaskSystemParallelThreadPoolSleeping: public ITaskSystem {
         TaskID runAsyncWithDeps(IRunnable* runnable, int num_total_tasks,
                                 const std::vector<TaskID>& deps);
         void sync();
+        void spawn(IRunnable* runnable, int num_total_tasks);
+        std::vector<WorkerStats> getStats();
+        void setGraphReport(FILE* out);
+        bool getLaunchLatency(LaunchPhase phase, LatencySummary& summary);
+#ifdef TASKSYS_TRACE
+        bool writeTrace(const char* filename);
+#endif
 };
 
 #endif
@@ -0,0 +1,448 @@
+/*
+ * Scheduler microbenchmarks.  Unlike the tests in tests.h, the task
+ * bodies here do nothing but spin for a fixed time, so the numbers are
+ * dominated by the cost of launching, handing out and completing tasks.
+ *
+ * Three measurements are taken for every task system:
+ *
+ *  - throughput: a sweep over tasks per launch, task body cost, thread
+ *    count and launch pattern (sync run() calls, a chain of async
+ *    launches each depending on the previous one, or a wide fan-out of
+ *    async launches all depending on one root), reporting ns per task
+ *    and the overhead per task beyond the ideal parallel time.
+ *  - roundtrip: latency of run() with a single empty task on a busy
+ *    (recently used) pool.
+ *  - wake: time from calling run() to the first task starting, after the
+ *    pool has been left idle long enough for its workers to sleep.
+ *
+ * Results go to stdout as CSV (default) or JSON.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <assert.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tasksys.h"
+
+#define DEFAULT_NUM_THREADS "8"
+#define DEFAULT_NUM_TASKS "1,64,4096,262144,1048576"
+#define DEFAULT_BODY_NS "0,1000,100000"
+#define DEFAULT_PATTERNS "sync,chain,fanout"
+#define DEFAULT_BUDGET_MS 200
+#define DEFAULT_REPETITIONS 3
+
+// Launches per throughput measurement aim for this many tasks in total.
+#define TARGET_TASKS_PER_RUN 1000000
+#define MAX_LAUNCHES_PER_RUN 1000
+#define NUM_ROUNDTRIP_SAMPLES 1000
+#define NUM_WAKE_SAMPLES 50
+#define WAKE_IDLE_MS 2
+
+enum TaskSystemType {
+    SERIAL,
+    PARALLEL_SPAWN,
+    PARALLEL_THREAD_POOL_SPINNING,
+    PARALLEL_THREAD_POOL_SLEEPING,
+    N_TASKSYS_IMPLS, // This must be in the last position.
+};
+
+ITaskSystem *selectTaskSystemRefImpl(int num_threads, TaskSystemType type) {
+    assert(type < N_TASKSYS_IMPLS);
+
+    if (type == SERIAL) {
+        return new TaskSystemSerial(num_threads);
+    } else if (type == PARALLEL_SPAWN) {
+        return new TaskSystemParallelSpawn(num_threads);
+    } else if (type == PARALLEL_THREAD_POOL_SPINNING) {
+        return new TaskSystemParallelThreadPoolSpinning(num_threads);
+    } else if (type == PARALLEL_THREAD_POOL_SLEEPING) {
+        return new TaskSystemParallelThreadPoolSleeping(num_threads);
+    } else {
+        return NULL;
+    }
+}
+
+enum LaunchPattern {
+    PATTERN_SYNC,
+    PATTERN_CHAIN,
+    PATTERN_FANOUT,
+};
+
+static const char* pattern_names[] = { "sync", "chain", "fanout" };
+
+/*
+ * Spins for body_ns and marks its task as run.  Writes go to a separate
+ * element per task id, so the bodies never contend with each other.
+ */
+class SpinTask: public IRunnable {
+    public:
+        unsigned long long body_ns_;
+        char* ran_;
+        SpinTask(unsigned long long body_ns, char* ran) : body_ns_(body_ns), ran_(ran) {}
+        ~SpinTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            if (body_ns_ > 0) {
+                unsigned long long end = statsNowNs() + body_ns_;
+                while (statsNowNs() < end) {
+                }
+            }
+            ran_[task_id] = 1;
+        }
+};
+
+/*
+ * Records when its single task started, for the wake latency.
+ */
+class ProbeTask: public IRunnable {
+    public:
+        unsigned long long started_ns_;
+        ProbeTask() : started_ns_(0) {}
+        ~ProbeTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            started_ns_ = statsNowNs();
+        }
+};
+
+struct Result {
+    std::string kind;
+    std::string impl;
+    int num_threads;
+    std::string pattern;
+    int num_tasks;
+    int num_launches;
+    unsigned long long body_ns;
+    double elapsed_ms;
+    double ns_per_task;
+    double overhead_ns_per_task;
+    double p50_ns;
+    double p99_ns;
+    bool valid;
+};
+
+static std::vector<int> parseList(const char* list) {
+    std::vector<int> values;
+    std::string s(list);
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t end = s.find(',', start);
+        if (end == std::string::npos) {
+            end = s.size();
+        }
+        if (end > start) {
+            values.push_back(atoi(s.substr(start, end - start).c_str()));
+        }
+        start = end + 1;
+    }
+    return values;
+}
+
+static double percentileOf(std::vector<double> samples, double quantile) {
+    if (samples.empty()) {
+        return 0.0;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t index = (size_t) (quantile * (samples.size() - 1) + 0.5);
+    return samples[index];
+}
+
+/*
+ * Runs num_launches launches of num_tasks tasks in the given pattern and
+ * returns the elapsed time in ns, or 0 if some task did not run (for
+ * example, async launches on a task system that does not implement them).
+ */
+static unsigned long long runPattern(ITaskSystem* t, LaunchPattern pattern, int num_tasks,
+                                     int num_launches, unsigned long long body_ns,
+                                     std::vector<char>& ran) {
+    std::fill(ran.begin(), ran.end(), 0);
+    SpinTask task(body_ns, ran.data());
+    ProbeTask root;
+
+    unsigned long long start = statsNowNs();
+    if (pattern == PATTERN_SYNC) {
+        for (int i = 0; i < num_launches; i++) {
+            t->run(&task, num_tasks);
+        }
+    } else if (pattern == PATTERN_CHAIN) {
+        std::vector<TaskID> deps;
+        for (int i = 0; i < num_launches; i++) {
+            TaskID id = t->runAsyncWithDeps(&task, num_tasks, deps);
+            deps.assign(1, id);
+        }
+        t->sync();
+    } else {
+        std::vector<TaskID> deps;
+        deps.push_back(t->runAsyncWithDeps(&root, 1, std::vector<TaskID>()));
+        for (int i = 0; i < num_launches; i++) {
+            t->runAsyncWithDeps(&task, num_tasks, deps);
+        }
+        t->sync();
+    }
+    unsigned long long elapsed = statsNowNs() - start;
+
+    for (int i = 0; i < num_tasks; i++) {
+        if (!ran[i]) {
+            return 0;
+        }
+    }
+    return elapsed;
+}
+
+static void printCsvHeader() {
+    printf("kind,impl,threads,pattern,tasks,launches,body_ns,elapsed_ms,ns_per_task,"
+           "overhead_ns_per_task,p50_ns,p99_ns,valid\n");
+}
+
+static void printCsv(const Result& r) {
+    printf("%s,%s,%d,%s,%d,%d,%llu,%.4f,%.2f,%.2f,%.1f,%.1f,%d\n", r.kind.c_str(),
+           r.impl.c_str(), r.num_threads, r.pattern.c_str(), r.num_tasks, r.num_launches,
+           r.body_ns, r.elapsed_ms, r.ns_per_task, r.overhead_ns_per_task, r.p50_ns, r.p99_ns,
+           r.valid ? 1 : 0);
+    fflush(stdout);
+}
+
+static void printJson(const Result& r, bool first) {
+    printf("%s\n  {\"kind\":\"%s\",\"impl\":\"%s\",\"threads\":%d,\"pattern\":\"%s\","
+           "\"tasks\":%d,\"launches\":%d,\"body_ns\":%llu,\"elapsed_ms\":%.4f,"
+           "\"ns_per_task\":%.2f,\"overhead_ns_per_task\":%.2f,\"p50_ns\":%.1f,"
+           "\"p99_ns\":%.1f,\"valid\":%s}",
+           first ? "" : ",", r.kind.c_str(), r.impl.c_str(), r.num_threads, r.pattern.c_str(),
+           r.num_tasks, r.num_launches, r.body_ns, r.elapsed_ms, r.ns_per_task,
+           r.overhead_ns_per_task, r.p50_ns, r.p99_ns, r.valid ? "true" : "false");
+}
+
+void usage(const char* progname) {
+    printf("Usage: %s [options]\n", progname);
+    printf("Program Options:\n");
+    printf("  -n  --num_threads <LIST>      Thread counts to sweep (default=%s)\n", DEFAULT_NUM_THREADS);
+    printf("  -t  --num_tasks <LIST>        Tasks per launch to sweep (default=%s)\n", DEFAULT_NUM_TASKS);
+    printf("  -w  --body_ns <LIST>          Task body cost in ns to sweep (default=%s)\n", DEFAULT_BODY_NS);
+    printf("  -p  --patterns <LIST>         Launch patterns, of sync,chain,fanout (default=%s)\n", DEFAULT_PATTERNS);
+    printf("  -m  --impls <LIST>            Task system types to run, 0-%d (default=all)\n", N_TASKSYS_IMPLS - 1);
+    printf("  -b  --budget_ms <INT>         Max serial task body time per measurement (default=%d)\n", DEFAULT_BUDGET_MS);
+    printf("  -r  --repetitions <INT>       Repetitions per measurement, the fastest is kept (default=%d)\n", DEFAULT_REPETITIONS);
+    printf("  -j  --json                    Print JSON instead of CSV\n");
+    printf("  -?  --help                    This message\n");
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<int> thread_counts = parseList(DEFAULT_NUM_THREADS);
+    std::vector<int> task_counts = parseList(DEFAULT_NUM_TASKS);
+    std::vector<int> body_costs = parseList(DEFAULT_BODY_NS);
+    std::vector<int> impls;
+    for (int i = 0; i < N_TASKSYS_IMPLS; i++) {
+        impls.push_back(i);
+    }
+    std::string patterns = DEFAULT_PATTERNS;
+    int budget_ms = DEFAULT_BUDGET_MS;
+    int repetitions = DEFAULT_REPETITIONS;
+    bool json = false;
+
+    int opt;
+    static struct option long_options[] = {
+        {"num_threads", 1, 0, 'n'},
+        {"num_tasks",   1, 0, 't'},
+        {"body_ns",     1, 0, 'w'},
+        {"patterns",    1, 0, 'p'},
+        {"impls",       1, 0, 'm'},
+        {"budget_ms",   1, 0, 'b'},
+        {"repetitions", 1, 0, 'r'},
+        {"json",        0, 0, 'j'},
+        {"help",        0, 0, '?'},
+        {0, 0, 0, 0},
+    };
+
+    while ((opt = getopt_long(argc, argv, "n:t:w:p:m:b:r:j?", long_options, NULL)) != EOF) {
+        switch (opt) {
+        case 'n':
+            thread_counts = parseList(optarg);
+            break;
+        case 't':
+            task_counts = parseList(optarg);
+            break;
+        case 'w':
+            body_costs = parseList(optarg);
+            break;
+        case 'p':
+            patterns = optarg;
+            break;
+        case 'm':
+            impls = parseList(optarg);
+            break;
+        case 'b':
+            budget_ms = atoi(optarg);
+            break;
+        case 'r':
+            repetitions = std::max(1, atoi(optarg));
+            break;
+        case 'j':
+            json = true;
+            break;
+        case '?':
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<LaunchPattern> selected_patterns;
+    for (int p = PATTERN_SYNC; p <= PATTERN_FANOUT; p++) {
+        if (("," + patterns + ",").find(std::string(",") + pattern_names[p] + ",") != std::string::npos) {
+            selected_patterns.push_back((LaunchPattern) p);
+        }
+    }
+
+    unsigned int hw_threads = std::max(1u, std::thread::hardware_concurrency());
+    unsigned long long budget_ns = (unsigned long long) budget_ms * 1000000ull;
+    bool first = true;
+    if (json) {
+        printf("[");
+    } else {
+        printCsvHeader();
+    }
+
+    for (size_t ti = 0; ti < thread_counts.size(); ti++) {
+        int num_threads = thread_counts[ti];
+        for (size_t ii = 0; ii < impls.size(); ii++) {
+            if (impls[ii] < 0 || impls[ii] >= N_TASKSYS_IMPLS) {
+                continue;
+            }
+            ITaskSystem* t = selectTaskSystemRefImpl(num_threads, (TaskSystemType) impls[ii]);
+            std::vector<Result> results;
+
+            for (size_t pi = 0; pi < selected_patterns.size(); pi++) {
+                for (size_t ni = 0; ni < task_counts.size(); ni++) {
+                    for (size_t bi = 0; bi < body_costs.size(); bi++) {
+                        int num_tasks = task_counts[ni];
+                        unsigned long long body_ns = body_costs[bi];
+                        if (num_tasks <= 0) {
+                            continue;
+                        }
+
+                        int num_launches = std::max(1, std::min(MAX_LAUNCHES_PER_RUN,
+                                                                TARGET_TASKS_PER_RUN / num_tasks));
+                        if (body_ns > 0) {
+                            unsigned long long fits = budget_ns / (body_ns * num_tasks);
+                            num_launches = (int) std::min<unsigned long long>(num_launches, fits);
+                        }
+                        if (num_launches == 0) {
+                            continue;
+                        }
+
+                        std::vector<char> ran(num_tasks);
+                        unsigned long long best = 0;
+                        bool valid = true;
+                        for (int rep = 0; rep < repetitions && valid; rep++) {
+                            unsigned long long elapsed = runPattern(t, selected_patterns[pi], num_tasks,
+                                                                    num_launches, body_ns, ran);
+                            valid = elapsed > 0;
+                            best = (rep == 0 || elapsed < best) ? elapsed : best;
+                        }
+
+                        double total_tasks = (double) num_tasks * num_launches;
+                        double parallelism = std::min<double>(std::min<double>(num_threads, hw_threads),
+                                                              num_tasks);
+                        double ideal_ns = total_tasks * body_ns / parallelism;
+                        Result r;
+                        r.kind = "throughput";
+                        r.impl = t->name();
+                        r.num_threads = num_threads;
+                        r.pattern = pattern_names[selected_patterns[pi]];
+                        r.num_tasks = num_tasks;
+                        r.num_launches = num_launches;
+                        r.body_ns = body_ns;
+                        r.elapsed_ms = best * 1e-6;
+                        r.ns_per_task = best / total_tasks;
+                        r.overhead_ns_per_task = std::max(0.0, (best - ideal_ns) / total_tasks);
+                        r.p50_ns = 0;
+                        r.p99_ns = 0;
+                        r.valid = valid;
+                        results.push_back(r);
+                    }
+                }
+            }
+
+            // Roundtrip: back-to-back single-task launches.
+            {
+                std::vector<char> ran(1);
+                SpinTask empty(0, ran.data());
+                std::vector<double> samples;
+                for (int i = 0; i < NUM_ROUNDTRIP_SAMPLES; i++) {
+                    unsigned long long start = statsNowNs();
+                    t->run(&empty, 1);
+                    samples.push_back((double) (statsNowNs() - start));
+                }
+                Result r;
+                r.kind = "roundtrip";
+                r.impl = t->name();
+                r.num_threads = num_threads;
+                r.pattern = "sync";
+                r.num_tasks = 1;
+                r.num_launches = NUM_ROUNDTRIP_SAMPLES;
+                r.body_ns = 0;
+                r.elapsed_ms = 0;
+                r.ns_per_task = 0;
+                r.overhead_ns_per_task = 0;
+                r.p50_ns = percentileOf(samples, 0.5);
+                r.p99_ns = percentileOf(samples, 0.99);
+                r.valid = ran[0] == 1;
+                results.push_back(r);
+            }
+
+            // Wake: leave the pool idle first so that its workers go to sleep.
+            {
+                ProbeTask probe;
+                std::vector<double> samples;
+                for (int i = 0; i < NUM_WAKE_SAMPLES; i++) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(WAKE_IDLE_MS));
+                    probe.started_ns_ = 0;
+                    unsigned long long start = statsNowNs();
+                    t->run(&probe, 1);
+                    if (probe.started_ns_ >= start) {
+                        samples.push_back((double) (probe.started_ns_ - start));
+                    }
+                }
+                Result r;
+                r.kind = "wake";
+                r.impl = t->name();
+                r.num_threads = num_threads;
+                r.pattern = "sync";
+                r.num_tasks = 1;
+                r.num_launches = NUM_WAKE_SAMPLES;
+                r.body_ns = 0;
+                r.elapsed_ms = 0;
+                r.ns_per_task = 0;
+                r.overhead_ns_per_task = 0;
+                r.p50_ns = percentileOf(samples, 0.5);
+                r.p99_ns = percentileOf(samples, 0.99);
+                r.valid = samples.size() == NUM_WAKE_SAMPLES;
+                results.push_back(r);
+            }
+
+            delete t;
+
+            for (size_t i = 0; i < results.size(); i++) {
+                if (json) {
+                    printJson(results[i], first);
+                } else {
+                    printCsv(results[i]);
+                }
+                first = false;
+            }
+        }
+    }
+
+    if (json) {
+        printf("\n]\n");
+    }
+    return 0;
+}
@@ -0,0 +1,503 @@
+/*
+ * Large dependency graph benchmarks for runAsyncWithDeps() and sync().
+ * The graphs are generated from a seeded splitmix64 generator, so a
+ * shape, size and seed always give the same graph, and have between
+ * 10^5 and 10^6 launches, where per-launch and per-edge costs of the
+ * scheduler dominate.  Shapes:
+ *
+ *  - layered: layers of `width` launches, each depending on `fan_in`
+ *    random launches of the layer before.
+ *  - powerlaw: each launch depends on uniformly chosen earlier launches,
+ *    with a Pareto-distributed number of them, so most launches have one
+ *    or two deps and a few have hundreds.
+ *  - chain: `width` independent chains, launch i depending on i - width.
+ *  - fan: a root, `width` launches depending on it, and a join depending
+ *    on all of them, which is the root of the next stage.
+ *
+ * Every configuration runs in a forked child, so the peak RSS reported
+ * is that of a single graph.  For each it reports the time spent in
+ * runAsyncWithDeps() (submit), from the first submission until sync()
+ * returns (makespan), and the makespan beyond the lower bound given by
+ * the task bodies (sched).  Results go to stdout as CSV or JSON.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <math.h>
+#include <assert.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tasksys.h"
+
+#define DEFAULT_NUM_THREADS "8"
+#define DEFAULT_NUM_LAUNCHES "100000,1000000"
+#define DEFAULT_SHAPES "layered,powerlaw,chain,fan"
+#define DEFAULT_IMPLS "0,3"
+#define DEFAULT_NUM_TASKS 1
+#define DEFAULT_BODY_NS 0
+#define DEFAULT_FAN_IN 4
+#define DEFAULT_SEED 1
+
+// Default width of each shape, when -W is not given.
+#define LAYERED_WIDTH 1024
+#define CHAIN_WIDTH 1
+#define FAN_WIDTH 1024
+
+// Fan-in of the power-law shape: P(k) ~ k^-(POWERLAW_ALPHA + 1).
+#define POWERLAW_ALPHA 1.5
+#define POWERLAW_MAX_FAN_IN 1024
+
+enum TaskSystemType {
+    SERIAL,
+    PARALLEL_SPAWN,
+    PARALLEL_THREAD_POOL_SPINNING,
+    PARALLEL_THREAD_POOL_SLEEPING,
+    N_TASKSYS_IMPLS, // This must be in the last position.
+};
+
+ITaskSystem *selectTaskSystemRefImpl(int num_threads, TaskSystemType type) {
+    assert(type < N_TASKSYS_IMPLS);
+
+    if (type == SERIAL) {
+        return new TaskSystemSerial(num_threads);
+    } else if (type == PARALLEL_SPAWN) {
+        return new TaskSystemParallelSpawn(num_threads);
+    } else if (type == PARALLEL_THREAD_POOL_SPINNING) {
+        return new TaskSystemParallelThreadPoolSpinning(num_threads);
+    } else if (type == PARALLEL_THREAD_POOL_SLEEPING) {
+        return new TaskSystemParallelThreadPoolSleeping(num_threads);
+    } else {
+        return NULL;
+    }
+}
+
+enum GraphShape {
+    SHAPE_LAYERED,
+    SHAPE_POWERLAW,
+    SHAPE_CHAIN,
+    SHAPE_FAN,
+};
+
+static const char* shape_names[] = { "layered", "powerlaw", "chain", "fan" };
+
+/*
+ * splitmix64: one add and a few multiply-xorshifts per number, and good
+ * enough statistically for picking edges.
+ */
+class SplitMix64 {
+    private:
+        unsigned long long state_;
+
+    public:
+        SplitMix64(unsigned long long seed) : state_(seed) {}
+
+        unsigned long long next() {
+            unsigned long long z = (state_ += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            return z ^ (z >> 31);
+        }
+
+        // Uniform in [0, bound).
+        int below(int bound) {
+            return (int) (next() % (unsigned long long) bound);
+        }
+
+        // Uniform in (0, 1].
+        double unit() {
+            return ((next() >> 11) + 1) * (1.0 / 9007199254740992.0);
+        }
+};
+
+/*
+ * A generated DAG in compressed form: the deps of launch i are
+ * edges[offsets[i]] to edges[offsets[i + 1] - 1], all smaller than i.
+ */
+struct Graph {
+    int num_launches;
+    std::vector<long long> offsets;
+    std::vector<int> edges;
+};
+
+static void generate(GraphShape shape, int num_launches, int width, int fan_in,
+                     unsigned long long seed, Graph& graph) {
+    SplitMix64 rng(seed);
+    graph.num_launches = num_launches;
+    graph.offsets.assign(1, 0);
+    graph.edges.clear();
+
+    for (int i = 0; i < num_launches; i++) {
+        if (shape == SHAPE_LAYERED) {
+            int layer_start = i - i % width;
+            if (layer_start > 0) {
+                for (int k = 0; k < fan_in; k++) {
+                    graph.edges.push_back(layer_start - width + rng.below(width));
+                }
+            }
+        } else if (shape == SHAPE_POWERLAW) {
+            if (i > 0) {
+                double k = floor(pow(rng.unit(), -1.0 / POWERLAW_ALPHA));
+                int count = (int) std::min<double>(std::min(i, POWERLAW_MAX_FAN_IN), k);
+                for (int j = 0; j < count; j++) {
+                    graph.edges.push_back(rng.below(i));
+                }
+            }
+        } else if (shape == SHAPE_CHAIN) {
+            if (i >= width) {
+                graph.edges.push_back(i - width);
+            }
+        } else {
+            // Stages of width + 1 launches: the fan-out launches, then the
+            // join. The first launch is the root of the first stage.
+            if (i > 0) {
+                int stage_root = (i - 1) / (width + 1) * (width + 1);
+                int position = (i - 1) % (width + 1);
+                if (position < width) {
+                    graph.edges.push_back(stage_root);
+                } else {
+                    for (int j = stage_root + 1; j < i; j++) {
+                        graph.edges.push_back(j);
+                    }
+                }
+            }
+        }
+        graph.offsets.push_back((long long) graph.edges.size());
+    }
+}
+
+/*
+ * The tasks of launch i: each checks that every dep of i has completed
+ * all of its tasks, spins for body_ns, and counts itself as completed.
+ */
+class DagTask: public IRunnable {
+    public:
+        int launch_;
+        const Graph* graph_;
+        std::atomic<int>* completed_;
+        std::atomic<bool>* order_ok_;
+        unsigned long long body_ns_;
+
+        DagTask() : launch_(0), graph_(NULL), completed_(NULL), order_ok_(NULL), body_ns_(0) {}
+        ~DagTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            for (long long e = graph_->offsets[launch_]; e < graph_->offsets[launch_ + 1]; e++) {
+                if (completed_[graph_->edges[e]].load(std::memory_order_acquire) != num_total_tasks) {
+                    order_ok_->store(false);
+                }
+            }
+            if (body_ns_ > 0) {
+                unsigned long long end = statsNowNs() + body_ns_;
+                while (statsNowNs() < end) {
+                }
+            }
+            completed_[launch_].fetch_add(1, std::memory_order_release);
+        }
+};
+
+struct Result {
+    std::string impl;
+    int num_threads;
+    std::string shape;
+    int num_launches;
+    long long num_edges;
+    int num_tasks;
+    unsigned long long body_ns;
+    double submit_ms;
+    double makespan_ms;
+    double ideal_ms;
+    double sched_ms;
+    double peak_rss_mb;
+    bool valid;
+};
+
+static std::vector<int> parseList(const char* list) {
+    std::vector<int> values;
+    std::string s(list);
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t end = s.find(',', start);
+        if (end == std::string::npos) {
+            end = s.size();
+        }
+        if (end > start) {
+            values.push_back(atoi(s.substr(start, end - start).c_str()));
+        }
+        start = end + 1;
+    }
+    return values;
+}
+
+static double peakRssMb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+}
+
+/*
+ * Lower bound on the makespan from the task bodies alone: the larger of
+ * the total work spread over all threads and the longest dependency
+ * chain, where a launch takes at least one round of its tasks.
+ */
+static double idealMs(const Graph& graph, int num_tasks, unsigned long long body_ns,
+                      int parallelism) {
+    if (body_ns == 0) {
+        return 0.0;
+    }
+    double launch_ns = (double) body_ns * ((num_tasks + parallelism - 1) / parallelism);
+    std::vector<double> finish(graph.num_launches);
+    double span = 0.0;
+    for (int i = 0; i < graph.num_launches; i++) {
+        double start = 0.0;
+        for (long long e = graph.offsets[i]; e < graph.offsets[i + 1]; e++) {
+            start = std::max(start, finish[graph.edges[e]]);
+        }
+        finish[i] = start + launch_ns;
+        span = std::max(span, finish[i]);
+    }
+    double work = (double) graph.num_launches * num_tasks * body_ns / parallelism;
+    return std::max(work, span) * 1e-6;
+}
+
+static Result runGraph(TaskSystemType type, int num_threads, GraphShape shape, int num_launches,
+                       int width, int fan_in, int num_tasks, unsigned long long body_ns,
+                       unsigned long long seed) {
+    Graph graph;
+    generate(shape, num_launches, width, fan_in, seed, graph);
+
+    std::atomic<int>* completed = new std::atomic<int>[num_launches];
+    for (int i = 0; i < num_launches; i++) {
+        completed[i].store(0);
+    }
+    std::atomic<bool> order_ok(true);
+    std::vector<DagTask> tasks(num_launches);
+    for (int i = 0; i < num_launches; i++) {
+        tasks[i].launch_ = i;
+        tasks[i].graph_ = &graph;
+        tasks[i].completed_ = completed;
+        tasks[i].order_ok_ = &order_ok;
+        tasks[i].body_ns_ = body_ns;
+    }
+    std::vector<TaskID> ids(num_launches);
+    std::vector<TaskID> deps;
+
+    ITaskSystem* t = selectTaskSystemRefImpl(num_threads, type);
+    unsigned long long start = statsNowNs();
+    for (int i = 0; i < num_launches; i++) {
+        deps.clear();
+        for (long long e = graph.offsets[i]; e < graph.offsets[i + 1]; e++) {
+            deps.push_back(ids[graph.edges[e]]);
+        }
+        ids[i] = t->runAsyncWithDeps(&tasks[i], num_tasks, deps);
+    }
+    unsigned long long submitted = statsNowNs();
+    t->sync();
+    unsigned long long end = statsNowNs();
+
+    bool all_ran = true;
+    for (int i = 0; i < num_launches; i++) {
+        all_ran = all_ran && completed[i].load() == num_tasks;
+    }
+
+    unsigned int hw_threads = std::max(1u, std::thread::hardware_concurrency());
+    int parallelism = type == SERIAL ? 1 : (int) std::min<unsigned int>(num_threads, hw_threads);
+    Result r;
+    r.impl = t->name();
+    r.num_threads = num_threads;
+    r.shape = shape_names[shape];
+    r.num_launches = num_launches;
+    r.num_edges = (long long) graph.edges.size();
+    r.num_tasks = num_tasks;
+    r.body_ns = body_ns;
+    r.submit_ms = (submitted - start) * 1e-6;
+    r.makespan_ms = (end - start) * 1e-6;
+    r.ideal_ms = idealMs(graph, num_tasks, body_ns, parallelism);
+    r.sched_ms = std::max(0.0, r.makespan_ms - r.ideal_ms);
+    r.peak_rss_mb = peakRssMb();
+    r.valid = all_ran && order_ok.load();
+
+    delete t;
+    delete [] completed;
+    return r;
+}
+
+static void printCsvHeader() {
+    printf("impl,threads,shape,launches,edges,tasks,body_ns,submit_ms,makespan_ms,ideal_ms,"
+           "sched_ms,peak_rss_mb,valid\n");
+}
+
+static void printCsv(const Result& r) {
+    printf("%s,%d,%s,%d,%lld,%d,%llu,%.3f,%.3f,%.3f,%.3f,%.1f,%d\n", r.impl.c_str(),
+           r.num_threads, r.shape.c_str(), r.num_launches, r.num_edges, r.num_tasks, r.body_ns,
+           r.submit_ms, r.makespan_ms, r.ideal_ms, r.sched_ms, r.peak_rss_mb, r.valid ? 1 : 0);
+}
+
+static void printJson(const Result& r, bool first) {
+    printf("%s\n  {\"impl\":\"%s\",\"threads\":%d,\"shape\":\"%s\",\"launches\":%d,"
+           "\"edges\":%lld,\"tasks\":%d,\"body_ns\":%llu,\"submit_ms\":%.3f,"
+           "\"makespan_ms\":%.3f,\"ideal_ms\":%.3f,\"sched_ms\":%.3f,\"peak_rss_mb\":%.1f,"
+           "\"valid\":%s}",
+           first ? "" : ",", r.impl.c_str(), r.num_threads, r.shape.c_str(), r.num_launches,
+           r.num_edges, r.num_tasks, r.body_ns, r.submit_ms, r.makespan_ms, r.ideal_ms,
+           r.sched_ms, r.peak_rss_mb, r.valid ? "true" : "false");
+}
+
+void usage(const char* progname) {
+    printf("Usage: %s [options]\n", progname);
+    printf("Program Options:\n");
+    printf("  -n  --num_threads <LIST>      Thread counts to sweep (default=%s)\n", DEFAULT_NUM_THREADS);
+    printf("  -l  --num_launches <LIST>     Launches per graph to sweep (default=%s)\n", DEFAULT_NUM_LAUNCHES);
+    printf("  -s  --shapes <LIST>           Graph shapes, of layered,powerlaw,chain,fan (default=%s)\n", DEFAULT_SHAPES);
+    printf("  -m  --impls <LIST>            Task system types to run, 0-%d (default=%s)\n", N_TASKSYS_IMPLS - 1, DEFAULT_IMPLS);
+    printf("  -t  --num_tasks <INT>         Tasks per launch (default=%d)\n", DEFAULT_NUM_TASKS);
+    printf("  -w  --body_ns <INT>           Task body cost in ns (default=%d)\n", DEFAULT_BODY_NS);
+    printf("  -W  --width <INT>             Layer width, number of chains or fan width\n"
+           "                                (default=%d, %d, %d)\n", LAYERED_WIDTH, CHAIN_WIDTH, FAN_WIDTH);
+    printf("  -d  --fan_in <INT>            Deps per launch of the layered shape (default=%d)\n", DEFAULT_FAN_IN);
+    printf("  -S  --seed <INT>              Seed of the graph generator (default=%d)\n", DEFAULT_SEED);
+    printf("  -j  --json                    Print JSON instead of CSV\n");
+    printf("  -?  --help                    This message\n");
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<int> thread_counts = parseList(DEFAULT_NUM_THREADS);
+    std::vector<int> launch_counts = parseList(DEFAULT_NUM_LAUNCHES);
+    std::vector<int> impls = parseList(DEFAULT_IMPLS);
+    std::string shapes = DEFAULT_SHAPES;
+    int num_tasks = DEFAULT_NUM_TASKS;
+    unsigned long long body_ns = DEFAULT_BODY_NS;
+    int width = 0;
+    int fan_in = DEFAULT_FAN_IN;
+    unsigned long long seed = DEFAULT_SEED;
+    bool json = false;
+
+    int opt;
+    static struct option long_options[] = {
+        {"num_threads",  1, 0, 'n'},
+        {"num_launches", 1, 0, 'l'},
+        {"shapes",       1, 0, 's'},
+        {"impls",        1, 0, 'm'},
+        {"num_tasks",    1, 0, 't'},
+        {"body_ns",      1, 0, 'w'},
+        {"width",        1, 0, 'W'},
+        {"fan_in",       1, 0, 'd'},
+        {"seed",         1, 0, 'S'},
+        {"json",         0, 0, 'j'},
+        {"help",         0, 0, '?'},
+        {0, 0, 0, 0},
+    };
+
+    while ((opt = getopt_long(argc, argv, "n:l:s:m:t:w:W:d:S:j?", long_options, NULL)) != EOF) {
+        switch (opt) {
+        case 'n':
+            thread_counts = parseList(optarg);
+            break;
+        case 'l':
+            launch_counts = parseList(optarg);
+            break;
+        case 's':
+            shapes = optarg;
+            break;
+        case 'm':
+            impls = parseList(optarg);
+            break;
+        case 't':
+            num_tasks = std::max(1, atoi(optarg));
+            break;
+        case 'w':
+            body_ns = strtoull(optarg, NULL, 10);
+            break;
+        case 'W':
+            width = std::max(1, atoi(optarg));
+            break;
+        case 'd':
+            fan_in = std::max(1, atoi(optarg));
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'j':
+            json = true;
+            break;
+        case '?':
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::vector<GraphShape> selected_shapes;
+    for (int s = SHAPE_LAYERED; s <= SHAPE_FAN; s++) {
+        if (("," + shapes + ",").find(std::string(",") + shape_names[s] + ",") != std::string::npos) {
+            selected_shapes.push_back((GraphShape) s);
+        }
+    }
+    const int default_widths[] = { LAYERED_WIDTH, 0, CHAIN_WIDTH, FAN_WIDTH };
+
+    bool first = true;
+    if (json) {
+        printf("[");
+    } else {
+        printCsvHeader();
+    }
+    fflush(stdout);
+
+    for (size_t ti = 0; ti < thread_counts.size(); ti++) {
+        for (size_t ii = 0; ii < impls.size(); ii++) {
+            if (impls[ii] < 0 || impls[ii] >= N_TASKSYS_IMPLS) {
+                continue;
+            }
+            for (size_t si = 0; si < selected_shapes.size(); si++) {
+                for (size_t li = 0; li < launch_counts.size(); li++) {
+                    GraphShape shape = selected_shapes[si];
+                    int shape_width = width > 0 ? width : default_widths[shape];
+                    if (launch_counts[li] <= 0) {
+                        continue;
+                    }
+
+                    // The child prints its result, then exits without
+                    // running the parent's destructors or atexit handlers.
+                    pid_t pid = fork();
+                    if (pid == 0) {
+                        Result r = runGraph((TaskSystemType) impls[ii], thread_counts[ti], shape,
+                                            launch_counts[li], shape_width, fan_in, num_tasks,
+                                            body_ns, seed);
+                        if (json) {
+                            printJson(r, first);
+                        } else {
+                            printCsv(r);
+                        }
+                        fflush(stdout);
+                        _exit(r.valid ? 0 : 2);
+                    }
+                    int status = 0;
+                    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+                        fprintf(stderr, "Error: %s graph of %d launches on impl %d did not finish\n",
+                                shape_names[shape], launch_counts[li], impls[ii]);
+                        continue;
+                    }
+                    first = false;
+                }
+            }
+        }
+    }
+
+    if (json) {
+        printf("\n]\n");
+    }
+    return 0;
+}
@@ -3,6 +3,10 @@
 #include <getopt.h>
 #include <string>
 #include <assert.h>
+#include <math.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <vector>
 
 #include "tasksys.h"
 #include "tests.h"
@@ -10,12 +14,28 @@
 #define DEFAULT_NUM_THREADS 8
 #define DEFAULT_NUM_TIMING_ITERATIONS 3
 
+enum TaskSystemType {
+    SERIAL,
+    PARALLEL_SPAWN,
+    PARALLEL_THREAD_POOL_SPINNING,
+    PARALLEL_THREAD_POOL_SLEEPING,
+    N_TASKSYS_IMPLS, // This must be in the last position.
+};
+
 
 void usage(const char* progname, std::string *testnames, int num_tests) {
     printf("Usage: %s [options] testname\n", progname);
     printf("Program Options:\n");
     printf("  -n  --num_threads  <INT>      Number of threads: <INT> (default=%d)\n", DEFAULT_NUM_THREADS);
     printf("  -i  --num_timing_iterations <INT> Number of timing iterations: <INT> (default=%d)\n", DEFAULT_NUM_TIMING_ITERATIONS);
+    printf("  -w  --warmup <INT>            Untimed warmup iterations before timing (default=0)\n");
+    printf("  -m  --impls <LIST>            Comma-separated task system types to run, 0-%d (default=all)\n", N_TASKSYS_IMPLS - 1);
+    printf("  -r  --reuse                   Reuse one task system across all iterations of an implementation\n");
+    printf("  -d  --distribution            Print min/median/mean/p95/stddev of wall and CPU time\n");
+    printf("  -j  --json <FILE>             Write all timing samples and their distribution as JSON\n");
+    printf("  -s  --stats                   Print per-worker runtime statistics of the last iteration\n");
+    printf("  -g  --graph_report            Print the launch graph report of every sync() of the last iteration\n");
+    printf("  -t  --trace <FILE>            Write a Chrome trace of the last iteration (build with TRACE=1)\n");
     printf("  -?  --help                    This message\n");
     printf("Valid testnames are:");
     for(int i = 0; i < num_tests; i++) {
@@ -23,14 +43,91 @@ void usage(const char* progname, std::string *testnames, int num_tests) {
     }
 }
 
-enum TaskSystemType {
-    SERIAL,
-    PARALLEL_SPAWN,
-    PARALLEL_THREAD_POOL_SPINNING,
-    PARALLEL_THREAD_POOL_SLEEPING,
-    N_TASKSYS_IMPLS, // This must be in the last position.
+void printStats(ITaskSystem* t) {
+    std::vector<WorkerStats> stats = t->getStats();
+    printf("  %-6s %10s %8s %10s %10s %8s %8s %15s %10s\n", "worker", "tasks", "launches",
+           "busy ms", "idle ms", "sleeps", "wakes", "steals/tries", "mutex ms");
+    for (size_t i = 0; i < stats.size(); i++) {
+        const WorkerStats& w = stats[i];
+        printf("  %-6d %10llu %8llu %10.3f %10.3f %8llu %8llu %7llu/%-7llu %10.3f\n", (int) i,
+               w.tasks_executed, w.launches_touched, w.busy_ns * 1e-6, w.idle_ns * 1e-6,
+               w.num_sleeps, w.num_wakes, w.steal_successes, w.steal_attempts,
+               w.mutex_wait_ns * 1e-6);
+    }
+
+    const char* phase_names[NUM_LAUNCH_PHASES] = {
+        "deps wait", "sched wait", "execution", "total",
+    };
+    LatencySummary latency;
+    if (!t->getLaunchLatency(LAUNCH_TOTAL, latency) || latency.count == 0) {
+        return;
+    }
+    printf("  %-10s %10s %12s %12s %12s %12s %12s\n", "launch", "count", "min us", "p50 us",
+           "p99 us", "p999 us", "max us");
+    for (int phase = 0; phase < NUM_LAUNCH_PHASES; phase++) {
+        t->getLaunchLatency((LaunchPhase) phase, latency);
+        printf("  %-10s %10llu %12.2f %12.2f %12.2f %12.2f %12.2f\n", phase_names[phase],
+               latency.count, latency.min_us, latency.p50_us, latency.p99_us, latency.p999_us,
+               latency.max_us);
+    }
+}
+
+/*
+ * Summary of the timing samples of one implementation, in ms.
+ */
+struct Distribution {
+    double min;
+    double median;
+    double mean;
+    double p95;
+    double stddev;
 };
 
+Distribution summarize(std::vector<double> samples) {
+    Distribution d = {0.0, 0.0, 0.0, 0.0, 0.0};
+    if (samples.empty()) {
+        return d;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t n = samples.size();
+    d.min = samples[0];
+    d.median = n % 2 ? samples[n / 2] : 0.5 * (samples[n / 2 - 1] + samples[n / 2]);
+    // Nearest-rank percentile.
+    d.p95 = samples[(size_t) ceil(0.95 * n) - 1];
+    for (size_t i = 0; i < n; i++) {
+        d.mean += samples[i];
+    }
+    d.mean /= n;
+    for (size_t i = 0; i < n; i++) {
+        d.stddev += (samples[i] - d.mean) * (samples[i] - d.mean);
+    }
+    d.stddev = n > 1 ? sqrt(d.stddev / (n - 1)) : 0.0;
+    return d;
+}
+
+void printDistribution(const char* label, const Distribution& d) {
+    printf("  %-8s min %10.3f  median %10.3f  mean %10.3f  p95 %10.3f  stddev %8.3f ms\n",
+           label, d.min, d.median, d.mean, d.p95, d.stddev);
+}
+
+void writeJsonDistribution(FILE* f, const char* key, const std::vector<double>& samples) {
+    Distribution d = summarize(samples);
+    fprintf(f, "\"%s\":{\"min\":%.6f,\"median\":%.6f,\"mean\":%.6f,\"p95\":%.6f,"
+               "\"stddev\":%.6f,\"samples\":[", key, d.min, d.median, d.mean, d.p95, d.stddev);
+    for (size_t i = 0; i < samples.size(); i++) {
+        fprintf(f, "%s%.6f", i ? "," : "", samples[i]);
+    }
+    fprintf(f, "]}");
+}
+
+// User plus system CPU time of the whole process, in ms.
+double cpuTimeMs() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3 +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e-3;
+}
+
 ITaskSystem *selectTaskSystemRefImpl(int num_threads, TaskSystemType type) {
     assert(type < N_TASKSYS_IMPLS);
 
@@ -49,9 +146,19 @@ ITaskSystem *selectTaskSystemRefImpl(int num_threads, TaskSystemType type) {
 
 int main(int argc, char** argv)
 {
-    const int n_tests = 31;
+    const int n_tests = 48;
     int num_threads = DEFAULT_NUM_THREADS;
     int num_timing_iterations = DEFAULT_NUM_TIMING_ITERATIONS;
+    int num_warmup_iterations = 0;
+    bool selected_impls[N_TASKSYS_IMPLS];
+    std::fill(selected_impls, selected_impls + N_TASKSYS_IMPLS, true);
+    bool reuse = false;
+    bool print_distribution = false;
+    const char* json_file = NULL;
+    bool print_stats = false;
+    bool graph_report = false;
+    const char* trace_file = NULL;
+    bool trace_written = false;
 
     TestResults (*test[n_tests])(ITaskSystem*) = {
         simpleTestSync,
@@ -85,6 +192,23 @@ int main(int argc, char** argv)
         strictGraphDepsSmall,
         strictGraphDepsMedium,
         strictGraphDepsLarge,
+        mathOperationsInTightForLoopParallelReduceTest,
+        parallelScanTest,
+        recursiveFibonacciSpawnTest,
+        recursiveFibonacciSpawnAsyncTest,
+        workerStatsTest,
+        mandelbrotInterleavedSimdTest,
+        mandelbrotChunkedEarlyOutTest,
+        mandelbrotZoomCacheTest,
+        mandelbrotWriteImageTest,
+        mandelbrotMappedImageTest,
+        mandelbrotStreamImageTest,
+        mathOperationsInTightForLoopVectorTest,
+        reduceBandwidthTest,
+        cycleTimerTest,
+        launchLatencyTest,
+        mandelbrotTiledTest,
+        mandelbrotTiledAsyncTest,
     };
 
     std::string test_names[n_tests] = {
@@ -119,6 +243,23 @@ int main(int argc, char** argv)
         "strict_graph_deps_small_async",
         "strict_graph_deps_med_async",
         "strict_graph_deps_large_async",
+        "math_operations_in_tight_for_loop_parallel_reduce",
+        "parallel_scan",
+        "recursive_fibonacci_spawn",
+        "recursive_fibonacci_spawn_async",
+        "worker_stats",
+        "mandelbrot_interleaved_simd",
+        "mandelbrot_chunked_early_out",
+        "mandelbrot_zoom_cache",
+        "mandelbrot_write_image",
+        "mandelbrot_mapped_image",
+        "mandelbrot_stream_image",
+        "math_operations_in_tight_for_loop_vector",
+        "reduce_bandwidth",
+        "cycle_timer",
+        "launch_latency",
+        "mandelbrot_tiled",
+        "mandelbrot_tiled_async",
     };
  
     // Parse commandline options
@@ -126,10 +267,19 @@ int main(int argc, char** argv)
     static struct option long_options[] = {
         {"num_threads",           1, 0,  'n'},
         {"num_timing_iterations", 1, 0,  'i'},
+        {"stats",                 0, 0,  's'},
+        {"trace",                 1, 0,  't'},
+        {"graph_report",          0, 0,  'g'},
+        {"warmup",                1, 0,  'w'},
+        {"impls",                 1, 0,  'm'},
+        {"reuse",                 0, 0,  'r'},
+        {"distribution",          0, 0,  'd'},
+        {"json",                  1, 0,  'j'},
         {"help",                  0, 0,  '?'},
+        {0, 0, 0, 0},
     };
 
-    while ((opt = getopt_long(argc, argv, "n:i:?", long_options, NULL)) != EOF) {
+    while ((opt = getopt_long(argc, argv, "n:i:st:gw:m:rdj:?", long_options, NULL)) != EOF) {
 
         switch (opt) {
         case 'n':
@@ -138,6 +288,41 @@ int main(int argc, char** argv)
         case 'i':
             num_timing_iterations = atoi(optarg);
             break;
+        case 's':
+            print_stats = true;
+            break;
+        case 't':
+            trace_file = optarg;
+            break;
+        case 'g':
+            graph_report = true;
+            break;
+        case 'w':
+            num_warmup_iterations = atoi(optarg);
+            break;
+        case 'm': {
+            std::fill(selected_impls, selected_impls + N_TASKSYS_IMPLS, false);
+            std::string list(optarg);
+            size_t start = 0;
+            while (start < list.size()) {
+                size_t end = std::min(list.find(',', start), list.size());
+                int impl = atoi(list.substr(start, end - start).c_str());
+                if (impl >= 0 && impl < N_TASKSYS_IMPLS) {
+                    selected_impls[impl] = true;
+                }
+                start = end + 1;
+            }
+            break;
+        }
+        case 'r':
+            reuse = true;
+            break;
+        case 'd':
+            print_distribution = true;
+            break;
+        case 'j':
+            json_file = optarg;
+            break;
         case '?':
         default:
             usage(argv[0], test_names, n_tests);
@@ -145,6 +330,11 @@ int main(int argc, char** argv)
         }
     }
 
+    if (num_timing_iterations < 1) {
+        fprintf(stderr, "Error: need at least one timing iteration!\n");
+        return 1;
+    }
+
     if (optind + 1 > argc) {
         fprintf(stderr, "Error: missing test_name!\n");
         usage(argv[0], test_names, n_tests);
@@ -153,6 +343,9 @@ int main(int argc, char** argv)
 
     std::string test_name = argv[optind];
 
+    // Calibrate the tick source now, rather than inside the first timed run.
+    CycleTimer::secondsPerTick();
+
     bool found = false;
     for (int test_id = 0; test_id < n_tests; test_id++) {
         if (test_names[test_id].compare(test_name) != 0) {
@@ -166,15 +359,47 @@ int main(int argc, char** argv)
         printf("============================================================="
                "======================\n");
 
+        FILE* json = NULL;
+        if (json_file) {
+            json = fopen(json_file, "w");
+            if (!json) {
+                fprintf(stderr, "Error: cannot open %s\n", json_file);
+                return 1;
+            }
+            fprintf(json, "{\"test\":\"%s\",\"num_threads\":%d,\"iterations\":%d,"
+                          "\"warmup\":%d,\"reuse\":%s,\"results\":[",
+                    test_names[test_id].c_str(), num_threads, num_timing_iterations,
+                    num_warmup_iterations, reuse ? "true" : "false");
+        }
+        bool first_json_result = true;
+
         for (int i = 0; i < N_TASKSYS_IMPLS; i++) {
-            double minT = 1e30;
-            for (int j = 0; j < num_timing_iterations; j++) {
+            if (!selected_impls[i]) {
+                continue;
+            }
 
-                // Create a new task system
-                ITaskSystem *t = selectTaskSystemRefImpl(num_threads, (TaskSystemType) i);
+            // Wall time as reported by the test, CPU time of the whole
+            // process (all task system threads) around the test.
+            std::vector<double> wall_ms;
+            std::vector<double> cpu_ms;
+            ITaskSystem *reused = reuse ? selectTaskSystemRefImpl(num_threads, (TaskSystemType) i) : NULL;
+            std::string impl_name = "";
+
+            // Negative iterations are warmup and are not timed.
+            for (int j = -num_warmup_iterations; j < num_timing_iterations; j++) {
+
+                // Create a new task system, unless reusing one
+                ITaskSystem *t = reuse ? reused : selectTaskSystemRefImpl(num_threads, (TaskSystemType) i);
+                impl_name = t->name();
+                bool last = j + 1 == num_timing_iterations;
+                if (graph_report && last) {
+                    t->setGraphReport(stdout);
+                }
 
                 // Run test
+                double cpu_start = cpuTimeMs();
                 TestResults result = test[test_id](t);
+                double cpu_time = cpuTimeMs() - cpu_start;
 
                 // Check that the test result was correct
                 if (!result.passed) {
@@ -183,20 +408,54 @@ int main(int argc, char** argv)
                     exit(1);
                 }
 
-                minT = std::min(minT, result.time);
+                if (j >= 0) {
+                    wall_ms.push_back(result.time * 1000);
+                    cpu_ms.push_back(cpu_time);
+                }
 
-                // TODO: do this better
-                if( j+1 == num_timing_iterations) {
-                    printf("[%s]:\t\t[%.3f] ms\n", t->name(), minT * 1000);
+                if (last) {
+                    double minT = *std::min_element(wall_ms.begin(), wall_ms.end());
+                    printf("[%s]:\t\t[%.3f] ms\n", t->name(), minT);
+                    if (print_distribution) {
+                        printDistribution("wall", summarize(wall_ms));
+                        printDistribution("cpu", summarize(cpu_ms));
+                    }
+                    if (print_stats) {
+                        printStats(t);
+                    }
+                    if (trace_file && t->writeTrace(trace_file)) {
+                        printf("  trace written to %s\n", trace_file);
+                        trace_written = true;
+                    }
                 }
 
                 // Shutdown task system so each timing run is from a clean start
-                delete t;
+                if (!reuse) {
+                    delete t;
+                }
             }
+            delete reused;
+
+            if (json) {
+                fprintf(json, "%s\n{\"impl\":\"%s\",", first_json_result ? "" : ",",
+                        impl_name.c_str());
+                writeJsonDistribution(json, "wall_ms", wall_ms);
+                fprintf(json, ",");
+                writeJsonDistribution(json, "cpu_ms", cpu_ms);
+                fprintf(json, "}");
+                first_json_result = false;
+            }
+        }
+        if (json) {
+            fprintf(json, "\n]}\n");
+            fclose(json);
         }
         printf("============================================================="
                "======================\n");
     }
+    if (found && trace_file && !trace_written) {
+        fprintf(stderr, "Warning: no task system recorded a trace, rebuild with TRACE=1\n");
+    }
     if (!found) {
         fprintf(stderr, "Error: invalid test_name!\n");
         usage(argv[0], test_names, n_tests);
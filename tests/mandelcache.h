@@ -0,0 +1,287 @@
+#ifndef _MANDELCACHE_H
+#define _MANDELCACHE_H
+
+/*
+ * Tile cache for rendering sequences of overlapping Mandelbrot views,
+ * such as zooms and pans.
+ *
+ * The complex plane is cut into square tiles of MANDEL_TILE_SIDE pixels
+ * on a grid whose pixel spacing is a power of two.  A frame is drawn
+ * from the tiles of the finest grid that is at least as fine as the
+ * frame's own pixels: each frame pixel takes the count of the grid pixel
+ * it falls in (nearest-neighbour resampling).  Frames that pan by any
+ * amount, or zoom by less than a factor of two, therefore reuse most of
+ * the previous frame's tiles, and only the missing tiles are computed,
+ * in one bulk launch on the task system.
+ *
+ * Tiles are keyed on grid level, tile position and max_iterations, and
+ * kept in LRU order within a memory budget.  Tiles needed by the frame
+ * being drawn are held by it, so they survive being evicted while it is
+ * drawn.  The cache is not synchronized: renderFrame() must not be
+ * called concurrently.
+ */
+
+#include <math.h>
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "itasksys.h"
+#include "mandelsimd.h"
+
+#define MANDEL_TILE_SIDE 64
+#define MANDEL_DEFAULT_CACHE_BYTES (64 << 20)
+
+struct MandelCacheStats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    size_t bytes;
+    size_t num_tiles;
+
+    double hitRate() const {
+        return hits + misses ? (double) hits / (hits + misses) : 0.0;
+    }
+};
+
+class MandelTileCache {
+    public:
+        struct Key {
+            int level;
+            long long tx;
+            long long ty;
+            int max_iterations;
+
+            bool operator==(const Key& other) const {
+                return level == other.level && tx == other.tx && ty == other.ty &&
+                       max_iterations == other.max_iterations;
+            }
+        };
+
+        struct Tile {
+            Key key;
+            int counts[MANDEL_TILE_SIDE * MANDEL_TILE_SIDE];
+        };
+
+        /*
+          Complex coordinate of pixel `offset` of tile `tile`, along one
+          axis of the grid with the given pixel spacing. Tiles and the
+          checks against them must use this same expression to get the
+          same floats.
+         */
+        static inline float gridPoint(long long tile, int offset, float spacing) {
+            float origin = (float) ((double) tile * MANDEL_TILE_SIDE * spacing);
+            return origin + offset * spacing;
+        }
+
+        // Pixel spacing of grid level `level`.
+        static inline float levelSpacing(int level) {
+            return ldexpf(1.f, -level);
+        }
+
+        static inline long long floorDiv(long long a, long long b) {
+            return a >= 0 ? a / b : -((-a + b - 1) / b);
+        }
+
+        /*
+          The tile, and the offset within it, of the grid pixel of level
+          `level` that contains complex coordinate `coord`.
+         */
+        static inline void gridCell(float coord, int level, long long& tile, int& offset) {
+            long long g = (long long) floor(coord / (double) levelSpacing(level));
+            tile = floorDiv(g, MANDEL_TILE_SIDE);
+            offset = (int) (g - tile * MANDEL_TILE_SIDE);
+        }
+
+    private:
+        struct KeyHash {
+            size_t operator()(const Key& key) const {
+                unsigned long long h = (unsigned long long) key.tx * 0x9e3779b97f4a7c15ull;
+                h ^= (unsigned long long) key.ty + 0xbf58476d1ce4e5b9ull + (h << 6) + (h >> 2);
+                h ^= (unsigned long long) key.level * 0x94d049bb133111ebull + (h << 6) + (h >> 2);
+                h ^= (unsigned long long) key.max_iterations + (h << 6) + (h >> 2);
+                return (size_t) h;
+            }
+        };
+
+        typedef std::list<std::shared_ptr<Tile> > LruList;
+
+        // Computes the tiles of a frame that were not in the cache, one
+        // per task.
+        class TileTask: public IRunnable {
+            public:
+                std::vector<std::shared_ptr<Tile> >* tiles_;
+                SimdIsa isa_;
+
+                TileTask(std::vector<std::shared_ptr<Tile> >* tiles, SimdIsa isa)
+                  : tiles_(tiles), isa_(isa) {}
+                ~TileTask() {}
+
+                void runTask(int task_id, int num_total_tasks) {
+                    Tile& tile = *(*tiles_)[task_id];
+                    float spacing = levelSpacing(tile.key.level);
+                    float x0 = gridPoint(tile.key.tx, 0, spacing);
+                    for (int j = 0; j < MANDEL_TILE_SIDE; j++) {
+                        float y = gridPoint(tile.key.ty, j, spacing);
+                        mandelRow(isa_, x0, spacing, y, 0, MANDEL_TILE_SIDE, tile.key.max_iterations,
+                                  tile.counts + j * MANDEL_TILE_SIDE);
+                    }
+                }
+        };
+
+        // Resamples the tiles of a frame into its output, a block of
+        // rows per task.
+        class ResampleTask: public IRunnable {
+            public:
+                float x0_, dx_, y0_, dy_;
+                int width_, height_;
+                int level_;
+                long long tx0_, ty0_;
+                int ntx_;
+                const std::vector<std::shared_ptr<Tile> >* tiles_;
+                int* output_;
+
+                ~ResampleTask() {}
+
+                void runTask(int task_id, int num_total_tasks) {
+                    int startRow = (long long) height_ * task_id / num_total_tasks;
+                    int endRow = (long long) height_ * (task_id + 1) / num_total_tasks;
+                    for (int j = startRow; j < endRow; j++) {
+                        long long ty;
+                        int row;
+                        gridCell(y0_ + j * dy_, level_, ty, row);
+                        for (int i = 0; i < width_; i++) {
+                            long long tx;
+                            int col;
+                            gridCell(x0_ + i * dx_, level_, tx, col);
+                            const Tile& tile = *(*tiles_)[(ty - ty0_) * ntx_ + (tx - tx0_)];
+                            output_[j * width_ + i] = tile.counts[row * MANDEL_TILE_SIDE + col];
+                        }
+                    }
+                }
+        };
+
+        size_t budget_bytes_;
+        SimdIsa isa_;
+        LruList lru_;
+        std::unordered_map<Key, LruList::iterator, KeyHash> index_;
+        MandelCacheStats stats_;
+
+        void evict() {
+            while (lru_.size() * sizeof(Tile) > budget_bytes_ && !lru_.empty()) {
+                index_.erase(lru_.back()->key);
+                lru_.pop_back();
+                stats_.evictions++;
+            }
+        }
+
+    public:
+        MandelTileCache(size_t budget_bytes = MANDEL_DEFAULT_CACHE_BYTES,
+                        SimdIsa isa = simdBestIsa())
+          : budget_bytes_(budget_bytes), isa_(isa) {
+            resetStats();
+        }
+        ~MandelTileCache() {}
+
+        /*
+          Finest grid level whose pixels are no larger than a frame pixel
+          of size dx by dy.
+         */
+        static int levelFor(float dx, float dy) {
+            float pixel = fminf(fabsf(dx), fabsf(dy));
+            return (int) ceil(-log2(pixel));
+        }
+
+        /*
+          Renders the view [x0, x1) x [y0, y1) at width x height pixels
+          into output, computing missing tiles with t.
+         */
+        void renderFrame(ITaskSystem* t, float x0, float x1, float y0, float y1,
+                         int width, int height, int max_iterations, int* output) {
+            float dx = (x1 - x0) / width;
+            float dy = (y1 - y0) / height;
+            int level = levelFor(dx, dy);
+
+            // Tiles of the first and last pixel of each axis.
+            long long tx0, tx1, ty0, ty1;
+            int offset;
+            gridCell(x0, level, tx0, offset);
+            gridCell(x0 + (width - 1) * dx, level, tx1, offset);
+            gridCell(y0, level, ty0, offset);
+            gridCell(y0 + (height - 1) * dy, level, ty1, offset);
+            if (tx0 > tx1) {
+                std::swap(tx0, tx1);
+            }
+            if (ty0 > ty1) {
+                std::swap(ty0, ty1);
+            }
+            int ntx = (int) (tx1 - tx0 + 1);
+            int nty = (int) (ty1 - ty0 + 1);
+
+            std::vector<std::shared_ptr<Tile> > frame_tiles(ntx * nty);
+            std::vector<std::shared_ptr<Tile> > missing;
+            for (int j = 0; j < nty; j++) {
+                for (int i = 0; i < ntx; i++) {
+                    Key key = { level, tx0 + i, ty0 + j, max_iterations };
+                    auto found = index_.find(key);
+                    if (found != index_.end()) {
+                        lru_.splice(lru_.begin(), lru_, found->second);
+                        frame_tiles[j * ntx + i] = *found->second;
+                        stats_.hits++;
+                    } else {
+                        std::shared_ptr<Tile> tile(new Tile);
+                        tile->key = key;
+                        frame_tiles[j * ntx + i] = tile;
+                        missing.push_back(tile);
+                        stats_.misses++;
+                    }
+                }
+            }
+
+            if (!missing.empty()) {
+                TileTask tile_task(&missing, isa_);
+                t->run(&tile_task, (int) missing.size());
+                for (size_t i = 0; i < missing.size(); i++) {
+                    lru_.push_front(missing[i]);
+                    index_[missing[i]->key] = lru_.begin();
+                }
+                evict();
+            }
+
+            ResampleTask resample;
+            resample.x0_ = x0;
+            resample.dx_ = dx;
+            resample.y0_ = y0;
+            resample.dy_ = dy;
+            resample.width_ = width;
+            resample.height_ = height;
+            resample.level_ = level;
+            resample.tx0_ = tx0;
+            resample.ty0_ = ty0;
+            resample.ntx_ = ntx;
+            resample.tiles_ = &frame_tiles;
+            resample.output_ = output;
+            t->run(&resample, std::min(height, 64));
+        }
+
+        MandelCacheStats stats() const {
+            MandelCacheStats stats = stats_;
+            stats.num_tiles = lru_.size();
+            stats.bytes = lru_.size() * sizeof(Tile);
+            return stats;
+        }
+
+        void resetStats() {
+            stats_.hits = 0;
+            stats_.misses = 0;
+            stats_.evictions = 0;
+        }
+
+    private:
+        MandelTileCache(const MandelTileCache&);
+        MandelTileCache& operator=(const MandelTileCache&);
+};
+
+#endif
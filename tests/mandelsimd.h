@@ -0,0 +1,382 @@
+#ifndef _MANDELSIMD_H
+#define _MANDELSIMD_H
+
+/*
+ * Vectorized escape-time kernel for MandelbrotTask.  mandelRow() computes
+ * one run of pixels of a row, 8 at a time with AVX2, 16 with AVX-512 or
+ * 4 with NEON; lanes that escape are masked off while the others keep
+ * iterating, and the row is finished once every lane has escaped or run
+ * out of iterations.  A run whose length is not a multiple of the vector
+ * width ends with a vector that overlaps the one before it, since
+ * recomputing a few pixels costs far less than a scalar tail; runs
+ * shorter than one vector use the scalar loop.
+ *
+ * Every lane performs exactly the float operations of the scalar loop,
+ * in the same order, so the output is bit-identical to it.  That needs
+ * floating-point contraction off in these kernels: GCC fuses a multiply and
+ * an add into an FMA by default in C++, and would do so in the AVX-512
+ * kernel (-mavx512f implies -mfma) or on aarch64 but not in the x86
+ * scalar loop.  The kernel is picked at runtime with simdisa.h.
+ *
+ * mandelRectEarlyOut() is the alternative, algorithmic way to save work:
+ * see the comment above it.
+ */
+
+#include <algorithm>
+
+#include "simdisa.h"
+
+// GCC takes the option for the whole file, between push_options and the
+// pop_options at its end.  Clang's pragma applies to the compound
+// statement it opens, so every function doing float math starts with
+// MANDEL_NO_CONTRACT instead, which leaves the files including this one
+// alone.
+#if defined(__clang__)
+#define MANDEL_NO_CONTRACT _Pragma("clang fp contract(off)")
+#else
+#define MANDEL_NO_CONTRACT
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+static inline int mandelScalar(float c_re, float c_im, int count) {
+    MANDEL_NO_CONTRACT
+    float z_re = c_re, z_im = c_im;
+    int i;
+    for (i = 0; i < count; ++i) {
+
+        if (z_re * z_re + z_im * z_im > 4.f)
+            break;
+
+        float new_re = z_re*z_re - z_im*z_im;
+        float new_im = 2.f * z_re * z_im;
+        z_re = c_re + new_re;
+        z_im = c_im + new_im;
+    }
+
+    return i;
+}
+
+static inline void mandelRowScalar(float x0, float dx, float y, int startCol, int endCol,
+                                   int max_iterations, int* out) {
+    MANDEL_NO_CONTRACT
+    for (int i = startCol; i < endCol; ++i) {
+        float x = x0 + i * dx;
+        out[i] = mandelScalar(x, y, max_iterations);
+    }
+}
+
+#ifdef SIMD_HAVE_X86
+__attribute__((target("avx2")))
+static void mandelRowAvx2(float x0, float dx, float y, int startCol, int endCol,
+                          int max_iterations, int* out) {
+    MANDEL_NO_CONTRACT
+    const __m256 four = _mm256_set1_ps(4.f);
+    const __m256 two = _mm256_set1_ps(2.f);
+    const __m256 c_im = _mm256_set1_ps(y);
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    int i = startCol;
+    for (; endCol - startCol >= 8 && i < endCol; i += 8) {
+        if (i + 8 > endCol) {
+            i = endCol - 8;
+        }
+        __m256 index = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(i), lane));
+        __m256 c_re = _mm256_add_ps(_mm256_set1_ps(x0), _mm256_mul_ps(index, _mm256_set1_ps(dx)));
+        __m256 z_re = c_re, z_im = c_im;
+        __m256i counts = _mm256_setzero_si256();
+        // All ones in the lanes that have not escaped yet.
+        __m256 active = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int iter = 0; iter < max_iterations; ++iter) {
+            __m256 re2 = _mm256_mul_ps(z_re, z_re);
+            __m256 im2 = _mm256_mul_ps(z_im, z_im);
+            __m256 escaped = _mm256_cmp_ps(_mm256_add_ps(re2, im2), four, _CMP_GT_OQ);
+            active = _mm256_andnot_ps(escaped, active);
+            if (_mm256_movemask_ps(active) == 0) {
+                break;
+            }
+            // Active lanes are -1, so subtracting counts them.
+            counts = _mm256_sub_epi32(counts, _mm256_castps_si256(active));
+            __m256 new_re = _mm256_sub_ps(re2, im2);
+            __m256 new_im = _mm256_mul_ps(_mm256_mul_ps(two, z_re), z_im);
+            z_re = _mm256_add_ps(c_re, new_re);
+            z_im = _mm256_add_ps(c_im, new_im);
+        }
+        _mm256_storeu_si256((__m256i*) (out + i), counts);
+    }
+    mandelRowScalar(x0, dx, y, i, endCol, max_iterations, out);
+}
+
+__attribute__((target("avx512f")))
+static void mandelRowAvx512(float x0, float dx, float y, int startCol, int endCol,
+                            int max_iterations, int* out) {
+    MANDEL_NO_CONTRACT
+    const __m512 four = _mm512_set1_ps(4.f);
+    const __m512 two = _mm512_set1_ps(2.f);
+    const __m512 c_im = _mm512_set1_ps(y);
+    const __m512i lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                                           8, 9, 10, 11, 12, 13, 14, 15);
+    const __m512i one = _mm512_set1_epi32(1);
+    int i = startCol;
+    for (; endCol - startCol >= 16 && i < endCol; i += 16) {
+        if (i + 16 > endCol) {
+            i = endCol - 16;
+        }
+        // The maskz form, as GCC 12 warns about the unmasked one.
+        __m512 index = _mm512_maskz_cvtepi32_ps(0xffff, _mm512_add_epi32(_mm512_set1_epi32(i), lane));
+        __m512 c_re = _mm512_add_ps(_mm512_set1_ps(x0), _mm512_mul_ps(index, _mm512_set1_ps(dx)));
+        __m512 z_re = c_re, z_im = c_im;
+        __m512i counts = _mm512_setzero_si512();
+        __mmask16 active = 0xffff;
+        for (int iter = 0; iter < max_iterations; ++iter) {
+            __m512 re2 = _mm512_mul_ps(z_re, z_re);
+            __m512 im2 = _mm512_mul_ps(z_im, z_im);
+            active &= ~_mm512_cmp_ps_mask(_mm512_add_ps(re2, im2), four, _CMP_GT_OQ);
+            if (active == 0) {
+                break;
+            }
+            counts = _mm512_mask_add_epi32(counts, active, counts, one);
+            __m512 new_re = _mm512_sub_ps(re2, im2);
+            __m512 new_im = _mm512_mul_ps(_mm512_mul_ps(two, z_re), z_im);
+            z_re = _mm512_add_ps(c_re, new_re);
+            z_im = _mm512_add_ps(c_im, new_im);
+        }
+        _mm512_storeu_si512((void*) (out + i), counts);
+    }
+    mandelRowScalar(x0, dx, y, i, endCol, max_iterations, out);
+}
+#endif
+
+#ifdef SIMD_HAVE_NEON
+static void mandelRowNeon(float x0, float dx, float y, int startCol, int endCol,
+                          int max_iterations, int* out) {
+    MANDEL_NO_CONTRACT
+    const float32x4_t four = vdupq_n_f32(4.f);
+    const float32x4_t two = vdupq_n_f32(2.f);
+    const float32x4_t c_im = vdupq_n_f32(y);
+    const int32_t lanes[4] = { 0, 1, 2, 3 };
+    const int32x4_t lane = vld1q_s32(lanes);
+    int i = startCol;
+    for (; endCol - startCol >= 4 && i < endCol; i += 4) {
+        if (i + 4 > endCol) {
+            i = endCol - 4;
+        }
+        float32x4_t index = vcvtq_f32_s32(vaddq_s32(vdupq_n_s32(i), lane));
+        float32x4_t c_re = vaddq_f32(vdupq_n_f32(x0), vmulq_f32(index, vdupq_n_f32(dx)));
+        float32x4_t z_re = c_re, z_im = c_im;
+        int32x4_t counts = vdupq_n_s32(0);
+        uint32x4_t active = vdupq_n_u32(0xffffffffu);
+        for (int iter = 0; iter < max_iterations; ++iter) {
+            float32x4_t re2 = vmulq_f32(z_re, z_re);
+            float32x4_t im2 = vmulq_f32(z_im, z_im);
+            uint32x4_t escaped = vcgtq_f32(vaddq_f32(re2, im2), four);
+            active = vbicq_u32(active, escaped);
+            if (vmaxvq_u32(active) == 0) {
+                break;
+            }
+            counts = vsubq_s32(counts, vreinterpretq_s32_u32(active));
+            float32x4_t new_re = vsubq_f32(re2, im2);
+            float32x4_t new_im = vmulq_f32(vmulq_f32(two, z_re), z_im);
+            z_re = vaddq_f32(c_re, new_re);
+            z_im = vaddq_f32(c_im, new_im);
+        }
+        vst1q_s32(out + i, counts);
+    }
+    mandelRowScalar(x0, dx, y, i, endCol, max_iterations, out);
+}
+#endif
+
+/*
+ * Writes the iteration counts of pixels [startCol, endCol) of the row at
+ * imaginary coordinate y to out[startCol..endCol), where pixel i is at
+ * real coordinate x0 + i * dx.  isa must be supported by this CPU.
+ */
+static inline void mandelRow(SimdIsa isa, float x0, float dx, float y, int startCol,
+                             int endCol, int max_iterations, int* out) {
+    switch (isa) {
+#ifdef SIMD_HAVE_X86
+    case SIMD_AVX2:
+        mandelRowAvx2(x0, dx, y, startCol, endCol, max_iterations, out);
+        return;
+    case SIMD_AVX512:
+        mandelRowAvx512(x0, dx, y, startCol, endCol, max_iterations, out);
+        return;
+#endif
+#ifdef SIMD_HAVE_NEON
+    case SIMD_NEON:
+        mandelRowNeon(x0, dx, y, startCol, endCol, max_iterations, out);
+        return;
+#endif
+    default:
+        mandelRowScalar(x0, dx, y, startCol, endCol, max_iterations, out);
+        return;
+    }
+}
+
+/*
+ * Early-out kernel.  Three shortcuts skip the iterations of points that
+ * never escape, which are most of the cost of an image of the whole set:
+ *
+ *  - points in the main cardioid or the period-2 bulb are in the set,
+ *    which a closed-form test decides before iterating;
+ *  - an orbit that returns to a value it had before is periodic in float
+ *    arithmetic as well, so it never escapes.  The orbit is compared
+ *    with a copy saved at every power of two iterations (Brent), which
+ *    finds a cycle of any period once the interval has grown past it;
+ *  - mandelRectEarlyOut() computes only the border of a rectangle, and
+ *    fills the inside with the border's count if it is the same all
+ *    around.  Otherwise it splits the rectangle in four and recurses.
+ *
+ * With a vector ISA, row segments of the border and of the leaves skip
+ * only the cardioid and bulb, when all of their pixels are in them, and
+ * otherwise go to mandelRow(): escaping pixels are most of the work left
+ * after border tracing, and they are several times faster there.
+ *
+ * Cycle detection returns exactly what mandelScalar() would.  The other
+ * two use properties of the exact set: the cardioid test ignores float
+ * rounding along the boundary of the cardioid, and a uniform border can
+ * enclose a thin filament with a different count, so a few pixels may
+ * differ from the plain kernels.
+ */
+
+// Rectangles with a side shorter than this are not traced but computed
+// row by row. Small rectangles rarely have a uniform border, and tracing
+// them costs more than it saves, especially against the vector kernel.
+#define MANDEL_MIN_RECT_SIDE 64
+// Shorter row segments are computed pixel by pixel even with a vector ISA.
+#define MANDEL_MIN_VECTOR_RUN 32
+
+static inline bool mandelInCardioidOrBulb(float c_re, float c_im) {
+    MANDEL_NO_CONTRACT
+    double x = c_re, y = c_im;
+    double xq = x - 0.25;
+    double q = xq * xq + y * y;
+    if (q * (q + xq) <= 0.25 * y * y) {
+        return true;
+    }
+    return (x + 1.0) * (x + 1.0) + y * y <= 0.0625;
+}
+
+static inline int mandelEarlyOut(float c_re, float c_im, int count) {
+    MANDEL_NO_CONTRACT
+    if (mandelInCardioidOrBulb(c_re, c_im)) {
+        return count;
+    }
+
+    float z_re = c_re, z_im = c_im;
+    float saved_re = z_re, saved_im = z_im;
+    int next_save = 1;
+    int i;
+    for (i = 0; i < count; ++i) {
+
+        if (z_re * z_re + z_im * z_im > 4.f)
+            break;
+
+        float new_re = z_re*z_re - z_im*z_im;
+        float new_im = 2.f * z_re * z_im;
+        z_re = c_re + new_re;
+        z_im = c_im + new_im;
+
+        if (z_re == saved_re && z_im == saved_im) {
+            return count;
+        }
+        if (i + 1 == next_save) {
+            saved_re = z_re;
+            saved_im = z_im;
+            next_save *= 2;
+        }
+    }
+
+    return i;
+}
+
+static inline void mandelRowEarlyOut(SimdIsa isa, float x0, float dx, float y, int startCol,
+                                     int endCol, int max_iterations, int* out) {
+    MANDEL_NO_CONTRACT
+    // Short segments gain little from the vector kernel, so iterate them
+    // one pixel at a time with cycle detection instead.
+    if (isa == SIMD_SCALAR || endCol - startCol < MANDEL_MIN_VECTOR_RUN) {
+        for (int i = startCol; i < endCol; i++) {
+            out[i] = mandelEarlyOut(x0 + i * dx, y, max_iterations);
+        }
+        return;
+    }
+    for (int i = startCol; i < endCol; i++) {
+        if (!mandelInCardioidOrBulb(x0 + i * dx, y)) {
+            mandelRow(isa, x0, dx, y, startCol, endCol, max_iterations, out);
+            return;
+        }
+    }
+    std::fill(out + startCol, out + endCol, max_iterations);
+}
+
+/*
+ * Writes the iteration counts of rows [startRow, endRow) and columns
+ * [startCol, endCol) of an image whose pixel (i, j) is at
+ * (x0 + i * dx, y0 + j * dy), to output[j * width + i].
+ */
+static void mandelRectEarlyOut(SimdIsa isa, float x0, float dx, float y0, float dy, int width,
+                               int startRow, int endRow, int startCol, int endCol,
+                               int max_iterations, int* output) {
+    MANDEL_NO_CONTRACT
+    int rows = endRow - startRow;
+    int cols = endCol - startCol;
+    if (rows <= 0 || cols <= 0) {
+        return;
+    }
+
+    if (rows < MANDEL_MIN_RECT_SIDE || cols < MANDEL_MIN_RECT_SIDE) {
+        for (int j = startRow; j < endRow; j++) {
+            mandelRowEarlyOut(isa, x0, dx, y0 + j * dy, startCol, endCol, max_iterations,
+                              output + j * width);
+        }
+        return;
+    }
+
+    // The border, clockwise from the top left corner.
+    int last_row = endRow - 1;
+    int last_col = endCol - 1;
+    mandelRowEarlyOut(isa, x0, dx, y0 + startRow * dy, startCol, endCol, max_iterations,
+                      output + startRow * width);
+    mandelRowEarlyOut(isa, x0, dx, y0 + last_row * dy, startCol, endCol, max_iterations,
+                      output + last_row * width);
+    int first = output[startRow * width + startCol];
+    bool uniform = true;
+    for (int i = startCol; i < endCol; i++) {
+        uniform = uniform && output[startRow * width + i] == first &&
+                  output[last_row * width + i] == first;
+    }
+    for (int j = startRow + 1; j < last_row; j++) {
+        int left = mandelEarlyOut(x0 + startCol * dx, y0 + j * dy, max_iterations);
+        int right = mandelEarlyOut(x0 + last_col * dx, y0 + j * dy, max_iterations);
+        output[j * width + startCol] = left;
+        output[j * width + last_col] = right;
+        uniform = uniform && left == first && right == first;
+    }
+
+    if (uniform) {
+        for (int j = startRow + 1; j < last_row; j++) {
+            std::fill(output + j * width + startCol + 1, output + j * width + last_col, first);
+        }
+        return;
+    }
+
+    int midRow = (startRow + 1 + last_row) / 2;
+    int midCol = (startCol + 1 + last_col) / 2;
+    mandelRectEarlyOut(isa, x0, dx, y0, dy, width, startRow + 1, midRow, startCol + 1, midCol,
+                       max_iterations, output);
+    mandelRectEarlyOut(isa, x0, dx, y0, dy, width, startRow + 1, midRow, midCol, last_col,
+                       max_iterations, output);
+    mandelRectEarlyOut(isa, x0, dx, y0, dy, width, midRow, last_row, startCol + 1, midCol,
+                       max_iterations, output);
+    mandelRectEarlyOut(isa, x0, dx, y0, dy, width, midRow, last_row, midCol, last_col,
+                       max_iterations, output);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+#endif
@@ -0,0 +1,172 @@
+import argparse
+import csv
+import multiprocessing
+import re
+import subprocess
+import sys
+
+BINARY_NAME = "./runtasks"
+
+SERIAL = "Serial"
+SERIAL_IMPL = 0
+PARALLEL_IMPLS = "1,2,3"
+
+# Below this parallel efficiency an implementation is flagged as no
+# longer scaling.
+DEFAULT_MIN_EFFICIENCY = 0.5
+# Doubling the threads must improve speedup by at least this fraction,
+# otherwise the previous thread count is reported as the knee.
+DEFAULT_MIN_GAIN = 0.1
+
+
+def default_thread_counts():
+    counts = []
+    n = 1
+    while n < multiprocessing.cpu_count():
+        counts.append(n)
+        n *= 2
+    counts.append(multiprocessing.cpu_count())
+    return counts
+
+
+def list_tests(binary):
+    # runtasks prints its test list in the usage message.
+    output = subprocess.run([binary, "-?"], stdout=subprocess.PIPE,
+                            stderr=subprocess.STDOUT).stdout.decode('utf-8')
+    m = re.search(r'Valid testnames are: (.*)', output)
+    if m is None:
+        sys.exit("Could not read the test list from %s" % binary)
+    return [x.strip() for x in m.group(1).split(',')]
+
+
+def run_test(binary, test_name, num_threads, impls, args):
+    cmd = [binary, "-n", str(num_threads), "-i", str(args.num_timing_iterations),
+           "-w", str(args.warmup), "-m", impls, test_name]
+    runtimes = {}
+    try:
+        output = subprocess.check_output(cmd).decode('utf-8')
+        for line in output.split('\n'):
+            m = re.match(r'\[(.*)\]:\s+\[(\d+\.\d+)\] ms', line)
+            if m is not None:
+                runtimes[m.group(1)] = float(m.group(2))
+    except Exception as e:
+        print(e)
+        print("%s failed with %d threads" % (test_name, num_threads))
+    return runtimes
+
+
+def knee(points, min_efficiency, min_gain):
+    """
+    Returns the thread count after which an implementation stops scaling,
+    or None if it scales across the whole sweep. `points` is a list of
+    (num_threads, speedup, efficiency) sorted by thread count.
+    """
+    for i in range(len(points)):
+        (n, speedup, efficiency) = points[i]
+        if efficiency < min_efficiency:
+            return points[i - 1][0] if i > 0 else n
+        if i + 1 < len(points):
+            (next_n, next_speedup, _) = points[i + 1]
+            # Scale the gain threshold to the step in threads.
+            needed = speedup * (1 + min_gain * (next_n - n) / float(n))
+            if next_speedup < needed:
+                return n
+    return None
+
+
+def print_table(test_name, serial_time, thread_counts, results, knees):
+    print("Results for: %s (Serial %.3f ms)" % (test_name, serial_time))
+    print("{:<36}{:>8}{:>12}{:>10}{:>8}".format("", "threads", "ms", "speedup", "eff"))
+    for impl in results:
+        for (n, time, speedup, efficiency) in results[impl]:
+            marker = "  <- knee" if knees[impl] == n else ""
+            print("{:<36}{:>8}{:>12.3f}{:>10.2f}{:>8.2f}{}".format(
+                impl, n, time, speedup, efficiency, marker))
+
+
+if __name__ == '__main__':
+
+    parser = argparse.ArgumentParser(
+        description='Run every test across a list of thread counts and report '
+                    'speedup and parallel efficiency against Serial. Run it from '
+                    'part_a or part_b.')
+    parser.add_argument('-n', '--thread_counts', type=int, nargs='+',
+                        default=default_thread_counts(),
+                        help='Thread counts to sweep (powers of two up to %d by default)'
+                        % multiprocessing.cpu_count())
+    parser.add_argument('-t', '--test_names', type=str, nargs='+',
+                        help='Tests to run (every runtasks test by default)')
+    parser.add_argument('-i', '--num_timing_iterations', type=int, default=3,
+                        help='Timing iterations per run, the minimum is reported (3 by default)')
+    parser.add_argument('-w', '--warmup', type=int, default=1,
+                        help='Untimed warmup iterations per run (1 by default)')
+    parser.add_argument('-o', '--csv', type=str, default="scaling.csv",
+                        help='CSV output file (scaling.csv by default)')
+    parser.add_argument('--min_efficiency', type=float, default=DEFAULT_MIN_EFFICIENCY,
+                        help='Efficiency below which scaling has stopped (%.2f by default)'
+                        % DEFAULT_MIN_EFFICIENCY)
+    parser.add_argument('--min_gain', type=float, default=DEFAULT_MIN_GAIN,
+                        help='Smallest speedup gain per doubling of threads that still '
+                        'counts as scaling (%.2f by default)' % DEFAULT_MIN_GAIN)
+
+    args = parser.parse_args()
+    thread_counts = sorted(set(args.thread_counts))
+    test_names = args.test_names if args.test_names else list_tests(BINARY_NAME)
+
+    print("==============================================================="
+          "=================")
+    print("Running thread scaling sweep... (%d tests, threads %s)"
+          % (len(test_names), ", ".join(str(n) for n in thread_counts)))
+    print("  - Detected CPU with %d execution contexts" % multiprocessing.cpu_count())
+    print("==============================================================="
+          "=================")
+
+    rows = []
+    summary = []
+    for test_name in test_names:
+        print("==============================================================="
+              "=================")
+        print("Executing test: %s..." % test_name)
+
+        # Serial does not use the thread count, so it runs once.
+        serial = run_test(BINARY_NAME, test_name, 1, str(SERIAL_IMPL), args)
+        if SERIAL not in serial or serial[SERIAL] <= 0.0:
+            print("Skipping %s: no usable Serial time" % test_name)
+            continue
+        serial_time = serial[SERIAL]
+
+        results = {}
+        for n in thread_counts:
+            runtimes = run_test(BINARY_NAME, test_name, n, PARALLEL_IMPLS, args)
+            for impl in runtimes:
+                time = runtimes[impl]
+                speedup = serial_time / time if time > 0.0 else float('inf')
+                efficiency = speedup / n
+                results.setdefault(impl, []).append((n, time, speedup, efficiency))
+
+        knees = {}
+        for impl in results:
+            points = [(n, speedup, efficiency) for (n, _, speedup, efficiency) in results[impl]]
+            knees[impl] = knee(points, args.min_efficiency, args.min_gain)
+            summary.append((test_name, impl, knees[impl]))
+            for (n, time, speedup, efficiency) in results[impl]:
+                rows.append([test_name, impl, n, "%.3f" % serial_time, "%.3f" % time,
+                             "%.3f" % speedup, "%.3f" % efficiency,
+                             1 if knees[impl] == n else 0])
+
+        print_table(test_name, serial_time, thread_counts, results, knees)
+
+    with open(args.csv, 'w') as f:
+        writer = csv.writer(f)
+        writer.writerow(["test", "impl", "threads", "serial_ms", "ms", "speedup",
+                         "efficiency", "knee"])
+        writer.writerows(rows)
+
+    print("==============================================================="
+          "=================")
+    print("Where each implementation stops scaling")
+    for (test_name, impl, n) in summary:
+        where = ("scales to %d threads" % thread_counts[-1]) if n is None \
+            else ("stops after %d threads" % n)
+        print("{:<50}{:<36}{}".format(test_name, impl, where))
+    print("CSV written to %s" % args.csv)
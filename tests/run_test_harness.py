@@ -1,7 +1,10 @@
 import argparse
+import json
+import math
 import platform
 import re
 import subprocess
+import sys
 import multiprocessing
 
 STUDENT_BINARY_NAME = "runtasks"
@@ -26,6 +29,14 @@ UNSPECIFIED_NUM_THREADS = -1
 PERF_THRESHOLD = 1.2
 NUM_TEST_RUNS = 5
 
+# Baseline comparisons: a slowdown is reported when the one-sided
+# Mann-Whitney p-value is below SIGNIFICANCE_LEVEL and the median time
+# grew by more than MIN_SLOWDOWN.
+SIGNIFICANCE_LEVEL = 0.05
+MIN_SLOWDOWN = 0.03
+# Up to this many samples in total, without ties, p-values are exact.
+MAX_EXACT_SAMPLES = 40
+
 LIST_OF_TESTS = [
     ("super_super_light", UNSPECIFIED_NUM_THREADS),
     ("super_light", UNSPECIFIED_NUM_THREADS),
@@ -80,6 +91,135 @@ def run_test(cmd, is_reference):
         print("%s solution failed correctness check!" % ("REFERENCE" if is_reference else "STUDENT"))
     return runtimes
 
+def run_samples(cmd):
+    """
+    Runs one runtasks command and returns {implementation: ms}, or an
+    empty dict if it failed.
+    """
+    runtimes = {}
+    try:
+        output = subprocess.check_output(cmd, shell=True).decode('utf-8')
+        for line in output.split('\n'):
+            m = re.match(r'\[(.*)\]:\s+\[(\d+\.\d+)\] ms', line)
+            if m is not None:
+                runtimes[m.group(1)] = float(m.group(2))
+    except Exception as e:
+        print(e)
+        print("%s failed correctness check!" % cmd)
+    return runtimes
+
+def mann_whitney_greater(xs, ys):
+    """
+    One-sided Mann-Whitney U test of whether values in xs tend to be
+    greater than values in ys. Returns the p-value. Small samples without
+    ties use the exact distribution of U, everything else the normal
+    approximation with tie and continuity correction.
+    """
+    n1, n2 = len(xs), len(ys)
+    if n1 == 0 or n2 == 0:
+        return 1.0
+
+    # Mid-ranks of the pooled samples.
+    pooled = sorted([(v, 0) for v in xs] + [(v, 1) for v in ys])
+    ranks = [0.0] * len(pooled)
+    tie_sizes = []
+    i = 0
+    while i < len(pooled):
+        j = i
+        while j + 1 < len(pooled) and pooled[j + 1][0] == pooled[i][0]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[k] = (i + j) / 2.0 + 1
+        tie_sizes.append(j - i + 1)
+        i = j + 1
+    rank_sum = sum(r for (r, (_, group)) in zip(ranks, pooled) if group == 0)
+    u = rank_sum - n1 * (n1 + 1) / 2.0
+
+    has_ties = any(t > 1 for t in tie_sizes)
+    if not has_ties and n1 + n2 <= MAX_EXACT_SAMPLES:
+        # counts[k] = number of arrangements with U == k, built up one
+        # sample at a time: f(n1, n2) = f(n1 - 1, n2) shifted by n2 + f(n1, n2 - 1).
+        table = {}
+        def counts(a, b):
+            if a == 0 or b == 0:
+                return [1]
+            if (a, b) not in table:
+                left = counts(a - 1, b)
+                right = counts(a, b - 1)
+                result = [0] * (a * b + 1)
+                for k in range(len(left)):
+                    result[k + b] += left[k]
+                for k in range(len(right)):
+                    result[k] += right[k]
+                table[(a, b)] = result
+            return table[(a, b)]
+        dist = counts(n1, n2)
+        return sum(dist[int(u):]) / float(sum(dist))
+
+    n = n1 + n2
+    mean = n1 * n2 / 2.0
+    tie_term = sum(t ** 3 - t for t in tie_sizes) / float(n * (n - 1))
+    variance = n1 * n2 / 12.0 * ((n + 1) - tie_term)
+    if variance <= 0:
+        return 1.0
+    z = (u - mean - 0.5) / math.sqrt(variance)
+    return 0.5 * math.erfc(z / math.sqrt(2))
+
+def median(values):
+    values = sorted(values)
+    mid = len(values) // 2
+    return values[mid] if len(values) % 2 else (values[mid - 1] + values[mid]) / 2.0
+
+def collect_baseline_samples(test_names_and_num_threads, cmd_prefix, runs, baseline_binary):
+    """
+    Runs ./runtasks, and baseline_binary if given, `runs` times on every
+    test. Runs of the two builds alternate, in swapped order each round,
+    so that drift in machine speed affects both alike. Returns
+    {test: {implementation: [ms]}} for the current and baseline builds.
+    """
+    current = {}
+    baseline = {}
+    for (test_name, num_threads) in test_names_and_num_threads:
+        print("Executing test: %s..." % test_name)
+        builds = [("./%s" % STUDENT_BINARY_NAME, current)]
+        if baseline_binary:
+            builds.append((baseline_binary, baseline))
+        for i in range(runs):
+            for (binary, samples) in (builds if i % 2 == 0 else builds[::-1]):
+                cmd = "%s%s -n %d %s" % (cmd_prefix, binary, num_threads, test_name)
+                runtimes = run_samples(cmd)
+                for impl in runtimes:
+                    samples.setdefault(test_name, {}).setdefault(impl, []).append(runtimes[impl])
+    return (current, baseline)
+
+def compare_to_baseline(current, baseline):
+    """
+    Prints every test and implementation present in both sample sets and
+    returns the number of significant slowdowns.
+    """
+    print("{:<50}{:<34}{:>10}{:>10}{:>9}{:>9}".format(
+        "test", "implementation", "base ms", "new ms", "change", "p"))
+    num_slowdowns = 0
+    for test_name in current:
+        if test_name not in baseline:
+            continue
+        for impl in current[test_name]:
+            if impl not in baseline[test_name]:
+                continue
+            new = current[test_name][impl]
+            base = baseline[test_name][impl]
+            base_median = median(base)
+            new_median = median(new)
+            change = new_median / base_median - 1 if base_median > 0 else 0.0
+            p = mann_whitney_greater(new, base)
+            slower = p < SIGNIFICANCE_LEVEL and change > MIN_SLOWDOWN
+            if slower:
+                num_slowdowns += 1
+            print("{:<50}{:<34}{:>10.3f}{:>10.3f}{:>+8.1f}%{:>9.3f}{}".format(
+                test_name, impl, base_median, new_median, change * 100, p,
+                "  SLOWER" if slower else ""))
+    return num_slowdowns
+
 def pretty_print(test_name, runtimes):
     print("Results for: %s" % test_name)
     for implementation in LIST_OF_IMPLEMENTATIONS_ORIG:
@@ -125,6 +265,20 @@ if __name__ == '__main__':
                             x[0] for x in LIST_OF_TESTS]))
     parser.add_argument('-a', '--run_async', action='store_true',
                         help='Run async tests')
+    parser.add_argument('--save_baseline', type=str, metavar='FILE',
+                        help='Save the timings of ./%s as a JSON baseline' % STUDENT_BINARY_NAME)
+    compare = parser.add_mutually_exclusive_group()
+    compare.add_argument('--compare_baseline', type=str, metavar='FILE',
+                        help='Compare ./%s against a JSON baseline; exit with status 1 '
+                        'on a significant slowdown' % STUDENT_BINARY_NAME)
+    compare.add_argument('--baseline_binary', type=str, metavar='BINARY',
+                        help='Compare ./%s against another runtasks build, with the runs '
+                        'of the two interleaved' % STUDENT_BINARY_NAME)
+    parser.add_argument('-r', '--runs', type=int, default=NUM_TEST_RUNS,
+                        help='Runs per test and build in baseline modes (%d by default)'
+                        % NUM_TEST_RUNS)
+    parser.add_argument('-c', '--cpus', type=str,
+                        help='Pin the benchmarks to these CPUs with taskset, e.g. 2-5')
 
     args = parser.parse_args()
 
@@ -144,6 +298,41 @@ if __name__ == '__main__':
         if args.run_async:
             test_names_and_num_threads.append( (x[0] + "_async", num_threads) )
 
+    cmd_prefix = ("taskset -c %s " % args.cpus) if args.cpus else ""
+
+    if args.save_baseline or args.compare_baseline or args.baseline_binary:
+        print("==============================================================="
+              "=================")
+        print("Running task system baseline harness... (%d tests, %d runs each)"
+              % (len(test_names_and_num_threads), args.runs))
+        if args.cpus:
+            print("  - Pinned to CPUs %s" % args.cpus)
+        print("==============================================================="
+              "=================")
+        (current, baseline) = collect_baseline_samples(
+            test_names_and_num_threads, cmd_prefix, args.runs, args.baseline_binary)
+
+        if args.save_baseline:
+            with open(args.save_baseline, 'w') as f:
+                json.dump({"num_threads": args.num_threads, "cpus": args.cpus,
+                           "runs": args.runs, "samples": current}, f, indent=1)
+            print("Baseline saved to %s" % args.save_baseline)
+
+        if args.compare_baseline:
+            with open(args.compare_baseline) as f:
+                baseline = json.load(f)["samples"]
+        if args.compare_baseline or args.baseline_binary:
+            print("==============================================================="
+                  "=================")
+            num_slowdowns = compare_to_baseline(current, baseline)
+            print("==============================================================="
+                  "=================")
+            if num_slowdowns > 0:
+                print("%d significant slowdown(s) against the baseline" % num_slowdowns)
+                sys.exit(1)
+            print("No significant slowdowns against the baseline")
+        sys.exit(0)
+
     print("==============================================================="
           "=================")
     print("Running task system grading harness... (%d total tests)" % len(test_names_and_num_threads))
@@ -178,7 +367,8 @@ if __name__ == '__main__':
             else:
                 print("Reference binary: ./runtasks_ref_linux")
                 ref_cmd = "./%s_linux -n %d" % (REFERENCE_BINARY_NAME, num_threads);
-        student_cmd = "./%s -n %d" % (STUDENT_BINARY_NAME, num_threads);
+        ref_cmd = cmd_prefix + ref_cmd
+        student_cmd = "%s./%s -n %d" % (cmd_prefix, STUDENT_BINARY_NAME, num_threads);
 
         cmds = [ref_cmd, student_cmd]
         is_references = [True, False]
@@ -0,0 +1,61 @@
+#ifndef _SIMDISA_H
+#define _SIMDISA_H
+
+/*
+ * Runtime choice of vector instruction set for the kernels of
+ * mandelsimd.h, vecmath.h and reducesimd.h.  The x86 kernels are
+ * compiled with target attributes, so the binary still runs on CPUs
+ * without them, and simdBestIsa() picks the widest one this CPU has with
+ * __builtin_cpu_supports(); NEON is always present on aarch64.
+ *
+ * SIMD_AVX2 stands for AVX2 with FMA, which every AVX2 CPU has, so that
+ * kernels using either can share it.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_HAVE_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SIMD_HAVE_NEON 1
+#endif
+
+enum SimdIsa {
+    SIMD_SCALAR,
+    SIMD_AVX2,
+    SIMD_AVX512,
+    SIMD_NEON,
+    NUM_SIMD_ISAS,
+};
+
+static const char* simd_isa_names[] = { "scalar", "avx2", "avx512", "neon" };
+
+static inline bool simdIsaSupported(SimdIsa isa) {
+    switch (isa) {
+    case SIMD_SCALAR:
+        return true;
+#ifdef SIMD_HAVE_X86
+    case SIMD_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case SIMD_AVX512:
+        return __builtin_cpu_supports("avx512f");
+#endif
+#ifdef SIMD_HAVE_NEON
+    case SIMD_NEON:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+// The widest instruction set this CPU runs, looked up once.
+static inline SimdIsa simdBestIsa() {
+    static const SimdIsa best = simdIsaSupported(SIMD_AVX512) ? SIMD_AVX512 :
+                                simdIsaSupported(SIMD_AVX2) ? SIMD_AVX2 :
+                                simdIsaSupported(SIMD_NEON) ? SIMD_NEON :
+                                SIMD_SCALAR;
+    return best;
+}
+
+#endif
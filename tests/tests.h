@@ -1,14 +1,22 @@
+#include <cassert>
 #include <chrono>
 #include <cmath>
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <thread>
+#include <unistd.h>
 #include <atomic>
 #include <set>
 
 #include "CycleTimer.h"
 #include "itasksys.h"
+#include "ppm.h"
+#include "mandelsimd.h"
+#include "mandelcache.h"
+#include "vecmath.h"
+#include "reducesimd.h"
 
 /*
 Sync tests
@@ -21,8 +29,23 @@ TestResults recursiveFibonacciTest(ITaskSystem* t);
 TestResults mathOperationsInTightForLoopTest(ITaskSystem* t);
 TestResults mathOperationsInTightForLoopFanInTest(ITaskSystem* t);
 TestResults mathOperationsInTightForLoopReductionTreeTest(ITaskSystem* t);
+TestResults mathOperationsInTightForLoopParallelReduceTest(ITaskSystem* t);
+TestResults mathOperationsInTightForLoopVectorTest(ITaskSystem* t);
+TestResults reduceBandwidthTest(ITaskSystem* t);
+TestResults cycleTimerTest(ITaskSystem* t);
+TestResults parallelScanTest(ITaskSystem* t);
+TestResults recursiveFibonacciSpawnTest(ITaskSystem* t);
+TestResults workerStatsTest(ITaskSystem* t);
+TestResults launchLatencyTest(ITaskSystem* t);
 TestResults spinBetweenRunCallsTest(ITaskSystem *t);
 TestResults mandelbrotChunkedTest(ITaskSystem* t);
+TestResults mandelbrotTiledTest(ITaskSystem* t);
+TestResults mandelbrotInterleavedSimdTest(ITaskSystem* t);
+TestResults mandelbrotChunkedEarlyOutTest(ITaskSystem* t);
+TestResults mandelbrotZoomCacheTest(ITaskSystem* t);
+TestResults mandelbrotWriteImageTest(ITaskSystem* t);
+TestResults mandelbrotMappedImageTest(ITaskSystem* t);
+TestResults mandelbrotStreamImageTest(ITaskSystem* t);
 
 Async with dependencies tests
 =============================
@@ -36,7 +59,9 @@ TestResults mathOperationsInTightForLoopFanInAsyncTest(ITaskSystem* t);
 TestResults mathOperationsInTightForLoopReductionTreeAsyncTest(ITaskSystem* t);
 TestResults spinBetweenRunCallsAsyncTest(ITaskSystem *t);
 TestResults mandelbrotChunkedAsyncTest(ITaskSystem* t);
+TestResults mandelbrotTiledAsyncTest(ITaskSystem* t);
 TestResults simpleRunDepsTest(ITaskSystem *t);
+TestResults recursiveFibonacciSpawnAsyncTest(ITaskSystem* t);
 */
 
 /*
@@ -242,6 +267,38 @@ class RecursiveFibonacciTask: public IRunnable {
         }
 };
 
+/*
+ * Each task computes the idx-th fibonacci number as a tree of spawned
+ * tasks: nodes above `cutoff` spawn their two subproblems as new tasks
+ * with ITaskSystem::spawn(), and leaves add slowFn(idx) into a shared sum.
+ * nodes_[n] is the runnable for subproblem n, so no per-node allocation
+ * is needed.
+ */
+class SpawnFibonacciTask: public IRunnable {
+    public:
+        ITaskSystem* t_;
+        int idx_;
+        int cutoff_;
+        SpawnFibonacciTask* nodes_;
+        std::atomic<long long>* sum_;
+        SpawnFibonacciTask() {}
+        ~SpawnFibonacciTask() {}
+
+        static int slowFn(int n) {
+            if (n < 2) return 1;
+            return slowFn(n-1) + slowFn(n-2);
+        }
+
+        void runTask(int task_id, int num_total_tasks) {
+            if (idx_ <= cutoff_) {
+                sum_->fetch_add(slowFn(idx_));
+                return;
+            }
+            t_->spawn(&nodes_[idx_ - 1], 1);
+            t_->spawn(&nodes_[idx_ - 2], 1);
+        }
+};
+
 /*
  * Each task copies its task id into the output.
  */
@@ -256,6 +313,16 @@ class LightTask: public IRunnable {
         }
 };
 
+/*
+ * How MathOperationsInTightForLoopTask evaluates exp and log: with a
+ * libm call per value, or 150 values at a time with the vectorized
+ * approximations of vecmath.h.
+ */
+enum MathMode {
+    MATH_LIBM,
+    MATH_VECTOR,
+};
+
 /*
  * Each task performs a sequence of exp, log, and multiplication
  * operations in a tight for loop.
@@ -264,12 +331,40 @@ class MathOperationsInTightForLoopTask: public IRunnable {
     public:
         float* output_;
         int array_size_;
-        MathOperationsInTightForLoopTask(int array_size, float* output) {
+        MathMode mode_;
+        MathOperationsInTightForLoopTask(int array_size, float* output,
+                                         MathMode mode = MATH_LIBM) {
             array_size_ = array_size;
             output_ = output; 
+            mode_ = mode;
         }
         ~MathOperationsInTightForLoopTask() {}
 
+        void runTaskVector(int start, int end) {
+            float exp_args[150], log_args[150], vals[150];
+            for (int j = 1; j < 151; j++) {
+                exp_args[j - 1] = j / 100.f;
+                log_args[j - 1] = j * 2.f;
+            }
+
+            for (int i = start; i < end; i++) {
+                if (i % 3 == 0) {
+                    vecExp(exp_args, vals, 150);
+                } else if (i % 3 == 1) {
+                    vecLog(log_args, vals, 150);
+                } else {
+                    for (int j = 1; j < 151; j++) {
+                        vals[j - 1] = j * 6;
+                    }
+                }
+                float sum = 0.0;
+                for (int j = 0; j < 150; j++) {
+                    sum += vals[j];
+                }
+                output_[i] = sum;
+            }
+        }
+
         void runTask(int task_id, int num_total_tasks) {
             int elements_per_task = array_size_ / num_total_tasks;
             int start = task_id * elements_per_task;
@@ -278,6 +373,11 @@ class MathOperationsInTightForLoopTask: public IRunnable {
                 end = array_size_;
             }
 
+            if (mode_ == MATH_VECTOR) {
+                runTaskVector(start, end);
+                return;
+            }
+
             for (int i = start; i < end; i++) {
                 output_[i] = 0.0;
             }
@@ -299,7 +399,10 @@ class MathOperationsInTightForLoopTask: public IRunnable {
 };
 
 /*
- * Each task computes the sum of `num_to_reduce_` input arrays.
+ * Computes the sum of `num_to_reduce_` input arrays with the
+ * cache-blocked kernel of reducesimd.h.  A launch of several tasks
+ * splits the output into runs of whole REDUCE_BLOCK blocks, one per
+ * task; up to numOutputBlocks() tasks have work.
  */
 class ReduceTask: public IRunnable {
     public:
@@ -315,12 +418,40 @@ class ReduceTask: public IRunnable {
             output_ = output;
         }
 
+        int numOutputBlocks() const {
+            return (array_size_ + REDUCE_BLOCK - 1) / REDUCE_BLOCK;
+        }
+
         void runTask(int task_id, int num_total_tasks) {
-            for (int i = 0; i < array_size_; i++) {
-                output_[i] = 0.0;
-                for (int j = 0; j < num_to_reduce_; j++) {
-                    output_[i] += input_[(j*array_size_) + i];
-                }
+            long long num_blocks = numOutputBlocks();
+            int begin = std::min<long long>(array_size_,
+                num_blocks * task_id / num_total_tasks * REDUCE_BLOCK);
+            int end = std::min<long long>(array_size_,
+                num_blocks * (task_id + 1) / num_total_tasks * REDUCE_BLOCK);
+            reduceSum(input_, array_size_, num_to_reduce_, output_, begin, end,
+                      reduceShouldStream(array_size_));
+            reduceFence();
+        }
+};
+
+/*
+ * STREAM's Add kernel, a[i] = b[i] + c[i], split evenly over the tasks.
+ * Measures the memory bandwidth that ReduceTask is compared against.
+ */
+class StreamAddTask: public IRunnable {
+    public:
+        float* a_;
+        const float* b_;
+        const float* c_;
+        size_t n_;
+        StreamAddTask(float* a, const float* b, const float* c, size_t n)
+          : a_(a), b_(b), c_(c), n_(n) {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            size_t begin = n_ * task_id / num_total_tasks;
+            size_t end = n_ * (task_id + 1) / num_total_tasks;
+            for (size_t i = begin; i < end; i++) {
+                a_[i] = b_[i] + c_[i];
             }
         }
 };
@@ -329,8 +460,16 @@ class ReduceTask: public IRunnable {
  * Each task computes a number of rows of the output Mandelbrot image.  
  * These rows either form a contiguous chunk of the image (if
  * interleave is false) or are interleaved throughout the image.
+ * When launched as a 2D tile launch, each tile computes a rectangular
+ * block of the image instead.  Rows are computed with the vectorized
+ * kernel of mandelsimd.h for the given ISA, which by default is the
+ * widest one the CPU supports, or, with early_out, with the early-out
+ * kernel, which fills contiguous blocks of rows and tiles by border
+ * tracing and uses the vectorized kernel where it does not pay off.
+ * Interleaved rows are single-row blocks, too thin to trace, so
+ * early_out requires interleave to be false.
  */
-class MandelbrotTask: public IRunnable {
+class MandelbrotTask: public IRunnable, public ITileRunnable {
     public:
         typedef struct {
             float x0, x1;
@@ -343,27 +482,19 @@ class MandelbrotTask: public IRunnable {
 
         MandelArgs *args_;
 		int interleave_;
+        SimdIsa isa_;
+        bool early_out_;
 
-        MandelbrotTask(MandelArgs *args, int interleave) 
-          : args_(args), interleave_(interleave) {}
+        MandelbrotTask(MandelArgs *args, int interleave, SimdIsa isa = simdBestIsa(),
+                       bool early_out = false)
+          : args_(args), interleave_(interleave), isa_(isa), early_out_(early_out) {
+            assert(!(interleave && early_out));
+        }
         ~MandelbrotTask() {}
 
         // helper function used by Mandelbrot computations
         inline int mandel(float c_re, float c_im, int count) {
-            float z_re = c_re, z_im = c_im;
-            int i;
-            for (i = 0; i < count; ++i) {
-
-                if (z_re * z_re + z_im * z_im > 4.f)
-                    break;
-
-                float new_re = z_re*z_re - z_im*z_im;
-                float new_im = 2.f * z_re * z_im;
-                z_re = c_re + new_re;
-                z_im = c_im + new_im;
-            }
-
-            return i;
+            return mandelScalar(c_re, c_im, count);
         }
 
         void mandelbrotSerial(
@@ -378,14 +509,36 @@ class MandelbrotTask: public IRunnable {
 
             int endRow = startRow + totalRows;
 
+            if (early_out_) {
+                mandelRectEarlyOut(isa_, x0, dx, y0, dy, width, startRow, endRow, 0, width,
+                                   max_iterations, output);
+                return;
+            }
             for (int j = startRow; j < endRow; j++) {
-                for (int i = 0; i < width; ++i) {
-                    float x = x0 + i * dx;
-                    float y = y0 + j * dy;
+                float y = y0 + j * dy;
+                mandelRow(isa_, x0, dx, y, 0, width, max_iterations, output + j * width);
+            }
+        }
 
-                    int index = (j * width + i);
-                    output[index] = mandel(x, y, max_iterations);
-                }
+        void mandelbrotTile(
+            float x0, float y0, float x1, float y1,
+            int width, int height,
+            int startRow, int endRow,
+            int startCol, int endCol,
+            int max_iterations,
+            int output[])
+        {
+            float dx = (x1 - x0) / width;
+            float dy = (y1 - y0) / height;
+
+            if (early_out_) {
+                mandelRectEarlyOut(isa_, x0, dx, y0, dy, width, startRow, endRow, startCol, endCol,
+                                   max_iterations, output);
+                return;
+            }
+            for (int j = startRow; j < endRow; j++) {
+                float y = y0 + j * dy;
+                mandelRow(isa_, x0, dx, y, startCol, endCol, max_iterations, output + j * width);
             }
         }
 
@@ -402,18 +555,16 @@ class MandelbrotTask: public IRunnable {
             int endRow = startRow + totalRows;
 
             for (int j = startRow; j < endRow; j += interleaving) {
-                for (int i = 0; i < width; ++i) {
-                    float x = x0 + i * dx;
-                    float y = y0 + j * dy;
-
-                    int index = (j * width + i);
-                    output[index] = mandel(x, y, max_iterations);
-                }
+                float y = y0 + j * dy;
+                mandelRow(isa_, x0, dx, y, 0, width, max_iterations, output + j * width);
             }
         }
     
         void runTask(int task_id, int num_total_tasks) {
-            int rowsPerTask = args_->height / num_total_tasks;
+            // Spread the remainder rows over the tasks so that no rows are
+            // dropped when height is not a multiple of num_total_tasks.
+            int startRow = (long long) args_->height * task_id / num_total_tasks;
+            int endRow = (long long) args_->height * (task_id + 1) / num_total_tasks;
 
             if (interleave_ == 1) {
                 mandelbrotSerial_interleaved(args_->x0, args_->y0, args_->x1, args_->y1,
@@ -424,10 +575,110 @@ class MandelbrotTask: public IRunnable {
             } else {
                 mandelbrotSerial(args_->x0, args_->y0, args_->x1, args_->y1,
                                  args_->width, args_->height,
-                                 task_id * rowsPerTask, rowsPerTask,
+                                 startRow, endRow - startRow,
                                  args_->max_iterations, args_->output);
             }
         }
+
+        void runTile(int tx, int ty, int ntx, int nty) {
+            int startCol = (long long) args_->width * tx / ntx;
+            int endCol = (long long) args_->width * (tx + 1) / ntx;
+            int startRow = (long long) args_->height * ty / nty;
+            int endRow = (long long) args_->height * (ty + 1) / nty;
+
+            mandelbrotTile(args_->x0, args_->y0, args_->x1, args_->y1,
+                           args_->width, args_->height,
+                           startRow, endRow, startCol, endCol,
+                           args_->max_iterations, args_->output);
+        }
+};
+
+/*
+ * Each task computes a contiguous block of rows of a Mandelbrot image
+ * with the widest vectorized kernel, and writes the brightness of each
+ * pixel straight into the rows of a MappedImage, mapping counts through
+ * brightness (of max_iterations + 1 entries, see ppmBrightnessTable()).
+ * With flush_rows, each task starts writing its rows back to the file as
+ * soon as they are done, so that the I/O overlaps the compute of later
+ * rows.
+ */
+class MandelbrotImageTask: public IRunnable {
+    public:
+        MandelbrotTask::MandelArgs *args_;
+        MappedImage* image_;
+        const unsigned char* brightness_;
+        bool flush_rows_;
+        SimdIsa isa_;
+
+        MandelbrotImageTask(MandelbrotTask::MandelArgs *args, MappedImage* image,
+                            const unsigned char* brightness, bool flush_rows)
+          : args_(args), image_(image), brightness_(brightness), flush_rows_(flush_rows),
+            isa_(simdBestIsa()) {}
+        ~MandelbrotImageTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            int width = args_->width;
+            int max_iterations = args_->max_iterations;
+            float dx = (args_->x1 - args_->x0) / width;
+            float dy = (args_->y1 - args_->y0) / args_->height;
+            int startRow = (long long) args_->height * task_id / num_total_tasks;
+            int endRow = (long long) args_->height * (task_id + 1) / num_total_tasks;
+
+            // One row of counts at a time, mapped into the image while it
+            // is still in cache.
+            std::vector<int> counts(width);
+            for (int j = startRow; j < endRow; j++) {
+                float y = args_->y0 + j * dy;
+                mandelRow(isa_, args_->x0, dx, y, 0, width, max_iterations, &counts[0]);
+                unsigned char* out = image_->row(j);
+                if (image_->channels() == 3) {
+                    for (int i = 0; i < width; i++, out += 3) {
+                        unsigned char b = brightness_[std::min(std::max(counts[i], 0), max_iterations)];
+                        out[0] = b;
+                        out[1] = b;
+                        out[2] = b;
+                    }
+                } else {
+                    for (int i = 0; i < width; i++) {
+                        out[i] = brightness_[std::min(std::max(counts[i], 0), max_iterations)];
+                    }
+                }
+            }
+            if (flush_rows_) {
+                image_->flushRows(startRow, endRow, true);
+            }
+        }
+};
+
+/*
+ * Task i computes row band i of a StreamingImageWriter with the widest
+ * vectorized kernel and submits it; launch stream->numBands() tasks.
+ */
+class MandelbrotStreamTask: public IRunnable {
+    public:
+        MandelbrotTask::MandelArgs *args_;
+        StreamingImageWriter* stream_;
+        SimdIsa isa_;
+
+        MandelbrotStreamTask(MandelbrotTask::MandelArgs *args, StreamingImageWriter* stream)
+          : args_(args), stream_(stream), isa_(simdBestIsa()) {}
+        ~MandelbrotStreamTask() {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            int width = args_->width;
+            float dx = (args_->x1 - args_->x0) / width;
+            float dy = (args_->y1 - args_->y0) / args_->height;
+            int startRow = stream_->bandStart(task_id);
+            int endRow = stream_->bandEnd(task_id);
+
+            std::vector<int> counts((size_t) (endRow - startRow) * width);
+            for (int j = startRow; j < endRow; j++) {
+                float y = args_->y0 + j * dy;
+                mandelRow(isa_, args_->x0, dx, y, 0, width, args_->max_iterations,
+                          &counts[(size_t) (j - startRow) * width]);
+            }
+            stream_->submitBand(task_id, &counts[0]);
+        }
 };
 
 /*
@@ -791,14 +1042,70 @@ TestResults recursiveFibonacciAsyncTest(ITaskSystem* t) {
     return recursiveFibonacciTestBase(t, true);
 }
 
+/*
+ * Computation: The same fibonacci computation expressed as a tree of
+ * dynamically spawned tasks. Each of the tasks in a single bulk task launch
+ * spawns the recursion tree of fib(fib_index) down to a cutoff, so the
+ * launch only completes once all spawned descendants have run. The tree is
+ * irregular, so idle workers have to steal spawned tasks to keep busy.
+ */
+TestResults recursiveFibonacciSpawnTestBase(ITaskSystem* t, bool do_async) {
+
+    int num_tasks = 16;
+    int fib_index = 32;
+    int cutoff = 18;
+
+    std::atomic<long long> sum(0);
+    std::vector<SpawnFibonacciTask> nodes(fib_index + 1);
+    for (int i = 0; i <= fib_index; i++) {
+        nodes[i].t_ = t;
+        nodes[i].idx_ = i;
+        nodes[i].cutoff_ = cutoff;
+        nodes[i].nodes_ = nodes.data();
+        nodes[i].sum_ = &sum;
+    }
+
+    double start_time = CycleTimer::currentSeconds();
+    if (do_async) {
+        std::vector<TaskID> deps; // Call runAsyncWithDeps without dependencies
+        t->runAsyncWithDeps(&nodes[fib_index], num_tasks, deps);
+        t->sync();
+    } else {
+        t->run(&nodes[fib_index], num_tasks);
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    // Validate correctness
+    TestResults result;
+    result.passed = true;
+    long long expected = (long long) num_tasks * SpawnFibonacciTask::slowFn(fib_index);
+    if (sum.load() != expected) {
+        printf("sum: %lld expected=%lld\n", sum.load(), expected);
+        result.passed = false;
+    }
+    result.time = end_time - start_time;
+
+    return result;
+}
+
+TestResults recursiveFibonacciSpawnTest(ITaskSystem* t) {
+    return recursiveFibonacciSpawnTestBase(t, false);
+}
+
+TestResults recursiveFibonacciSpawnAsyncTest(ITaskSystem* t) {
+    return recursiveFibonacciSpawnTestBase(t, true);
+}
+
 /*
  * Computation: The following tests perform exps, logs, and multiplications
  * in a tight for loop. Tasks are sufficiently compute-intensive and lightweight:
  * the threadpool implementation should perform better than the one that spawns
- * new threads with every bulk task launch.
+ * new threads with every bulk task launch. Every output must also be
+ * within a relative 1e-5 of its sum computed in double precision.
  */
 TestResults mathOperationsInTightForLoopTestBase(ITaskSystem* t, int num_tasks,
-                                                 bool run_with_dependencies, bool do_async) {
+                                                 bool run_with_dependencies, bool do_async,
+                                                 MathMode mode = MATH_LIBM) {
 
     int num_bulk_task_launches = 2000;
 
@@ -812,7 +1119,7 @@ TestResults mathOperationsInTightForLoopTestBase(ITaskSystem* t, int num_tasks,
     std::vector<MathOperationsInTightForLoopTask> medium_tasks;
     for (int i = 0; i < num_bulk_task_launches; i++) {
         medium_tasks.push_back(MathOperationsInTightForLoopTask(
-            array_size, &task_output[i*array_size]));
+            array_size, &task_output[i*array_size], mode));
     }
 
     double start_time = CycleTimer::currentSeconds();
@@ -860,6 +1167,20 @@ TestResults mathOperationsInTightForLoopTestBase(ITaskSystem* t, int num_tasks,
             }
         }
     }
+
+    double expected[3] = {0.0, 0.0, 0.0};
+    for (int j = 1; j < 151; j++) {
+        expected[0] += exp(j / 100.);
+        expected[1] += log(j * 2.);
+        expected[2] += j * 6;
+    }
+    for (int i = 0; i < num_bulk_task_launches * array_size && result.passed; i++) {
+        double want = expected[(i % array_size) % 3];
+        if (std::fabs(task_output[i] - want) > 1e-5 * want) {
+            printf("%d: %f expected=%f within 1e-5\n", i, task_output[i], want);
+            result.passed = false;
+        }
+    }
     result.time = end_time - start_time;
 
     delete [] task_output;
@@ -876,6 +1197,114 @@ TestResults mathOperationsInTightForLoopAsyncTest(ITaskSystem* t) {
     return mathOperationsInTightForLoopTestBase(t, 16, true, true);
 }
 
+/*
+ * The same launches with exp and log from vecmath.h instead of libm.
+ * Runs the libm version first and prints the exp/log throughput of both;
+ * the reported time is that of the vector version.
+ */
+TestResults mathOperationsInTightForLoopVectorTest(ITaskSystem* t) {
+    // 2000 launches of 512 elements, two thirds of them 150 exps or logs
+    double calls = 2000.0 * 512 * 2 / 3 * 150;
+    TestResults libm = mathOperationsInTightForLoopTestBase(t, 16, true, false, MATH_LIBM);
+    TestResults vector = mathOperationsInTightForLoopTestBase(t, 16, true, false, MATH_VECTOR);
+    printf("exp/log throughput: libm %.1f M/s, vector %.1f M/s\n",
+           calls / libm.time * 1e-6, calls / vector.time * 1e-6);
+    vector.passed = vector.passed && libm.passed;
+    return vector;
+}
+
+/*
+ * Computation: Sums 32 input arrays of 2M floats (256 MB, more than the
+ * last-level cache) with the plain strided loop, with one ReduceTask,
+ * and with a ReduceTask launch split across output blocks. Prints the
+ * bandwidth of each, in GB/s of inputs read and output written, next to
+ * the best of STREAM's Add kernel over 64M-float arrays on the same task
+ * system. Both ReduceTask results must match the plain loop exactly.
+ * The reported time is that of the parallel launch.
+ */
+TestResults reduceBandwidthTest(ITaskSystem* t) {
+    const int num_inputs = 32;
+    const int array_size = 2 << 20;
+    const int num_runs = 3;
+    const int num_tasks = 64;
+
+    float* input = new float[(size_t) num_inputs * array_size];
+    float* golden = new float[array_size];
+    float* output = new float[array_size];
+    for (int j = 0; j < num_inputs; j++) {
+        for (int i = 0; i < array_size; i++) {
+            input[(size_t) j * array_size + i] = (float) ((i + j) % 7);
+        }
+    }
+
+    double bytes = (num_inputs + 1.0) * array_size * sizeof(float);
+    double plain_time = 1e30;
+    for (int run = 0; run < num_runs; run++) {
+        double start_time = CycleTimer::currentSeconds();
+        for (int i = 0; i < array_size; i++) {
+            golden[i] = 0.0;
+            for (int j = 0; j < num_inputs; j++) {
+                golden[i] += input[((size_t) j * array_size) + i];
+            }
+        }
+        plain_time = std::min(plain_time, CycleTimer::currentSeconds() - start_time);
+    }
+
+    TestResults result;
+    result.passed = true;
+    ReduceTask reduce_task(array_size, num_inputs, input, output);
+    double times[2] = {1e30, 1e30};
+    int launch_tasks[2] = {1, std::min(num_tasks, reduce_task.numOutputBlocks())};
+    for (int k = 0; k < 2; k++) {
+        for (int run = 0; run < num_runs; run++) {
+            memset(output, 0, array_size * sizeof(float));
+            double start_time = CycleTimer::currentSeconds();
+            t->run(&reduce_task, launch_tasks[k]);
+            times[k] = std::min(times[k], CycleTimer::currentSeconds() - start_time);
+        }
+        if (memcmp(output, golden, array_size * sizeof(float)) != 0) {
+            printf("ERROR: reduce with %d tasks differs from the plain loop\n", launch_tasks[k]);
+            result.passed = false;
+        }
+    }
+    delete [] input;
+    delete [] golden;
+    delete [] output;
+
+    const size_t stream_size = 64 << 20;
+    float* a = new float[stream_size];
+    float* b = new float[stream_size];
+    float* c = new float[stream_size];
+    for (size_t i = 0; i < stream_size; i++) {
+        a[i] = 0.f;
+        b[i] = 1.f;
+        c[i] = 2.f;
+    }
+    StreamAddTask stream_task(a, b, c, stream_size);
+    double stream_time = 1e30;
+    for (int run = 0; run < num_runs; run++) {
+        double start_time = CycleTimer::currentSeconds();
+        t->run(&stream_task, num_tasks);
+        stream_time = std::min(stream_time, CycleTimer::currentSeconds() - start_time);
+    }
+    double stream_gbs = 3.0 * stream_size * sizeof(float) / stream_time * 1e-9;
+    delete [] a;
+    delete [] b;
+    delete [] c;
+
+    printf("STREAM Add:              %6.2f GB/s\n", stream_gbs);
+    printf("plain loop:              %6.2f GB/s (%3.0f%% of STREAM)\n",
+           bytes / plain_time * 1e-9, 100.0 * bytes / plain_time * 1e-9 / stream_gbs);
+    for (int k = 0; k < 2; k++) {
+        printf("blocked, %2d task%s:       %6.2f GB/s (%3.0f%% of STREAM)\n",
+               launch_tasks[k], launch_tasks[k] == 1 ? " " : "s",
+               bytes / times[k] * 1e-9, 100.0 * bytes / times[k] * 1e-9 / stream_gbs);
+    }
+
+    result.time = times[1];
+    return result;
+}
+
 TestResults mathOperationsInTightForLoopFewerTasksTest(ITaskSystem* t) {
     return mathOperationsInTightForLoopTestBase(t, 9, false, false);
 }
@@ -1111,6 +1540,355 @@ TestResults mathOperationsInTightForLoopReductionTreeAsyncTest(ITaskSystem* t) {
     return mathOperationsInTightForLoopReductionTreeTestBase(t, true);
 }
 
+/*
+ * 2x2 matrix of unsigned ints, used to check that parallelReduce keeps
+ * the order of a non-commutative (but associative) combiner.
+ */
+typedef struct {
+    unsigned int a, b, c, d;
+} Mat2;
+
+static inline Mat2 mat2Mul(const Mat2& x, const Mat2& y) {
+    Mat2 r;
+    r.a = x.a * y.a + x.b * y.c;
+    r.b = x.a * y.b + x.b * y.d;
+    r.c = x.c * y.a + x.d * y.c;
+    r.d = x.c * y.b + x.d * y.d;
+    return r;
+}
+
+static inline Mat2 mat2ForIndex(int i) {
+    Mat2 m = {1u, (unsigned int) i, (unsigned int) (i % 7), 1u};
+    return m;
+}
+
+/*
+ * Computation: The same workload as mathOperationsInTightForLoopReductionTree,
+ * but the outputs of the 32 bulk task launches are summed with a single
+ * parallelReduce instead of an explicit binary tree of ReduceTask launches.
+ * Each worker sums its share of the launch outputs into a private vector,
+ * and the per-worker vectors are combined at the end. A product of 2x2
+ * matrices is also reduced to check that the combiner order is preserved.
+ */
+TestResults mathOperationsInTightForLoopParallelReduceTest(ITaskSystem* t) {
+
+    int num_tasks = 64;
+    int num_bulk_task_launches = 32;
+
+    int array_size = 16384;
+    float* buffer = new float[num_bulk_task_launches*array_size];
+
+    std::vector<MathOperationsInTightForLoopTask> medium_tasks;
+    for (int i = 0; i < num_bulk_task_launches; i++) {
+        medium_tasks.push_back(MathOperationsInTightForLoopTask(
+            array_size, &buffer[i*array_size]));
+    }
+
+    double start_time = CycleTimer::currentSeconds();
+    for (int i = 0; i < num_bulk_task_launches; i++) {
+        t->run(&medium_tasks[i], num_tasks);
+    }
+    std::vector<float> sum = t->parallelReduce(
+        num_bulk_task_launches, std::vector<float>(array_size, 0.f),
+        [&](int begin, int end, std::vector<float>& acc) {
+            for (int j = begin; j < end; j++) {
+                const float* input = &buffer[j*array_size];
+                for (int i = 0; i < array_size; i++) {
+                    acc[i] += input[i];
+                }
+            }
+        },
+        [](const std::vector<float>& left, const std::vector<float>& right) {
+            std::vector<float> out(left);
+            for (size_t i = 0; i < out.size(); i++) {
+                out[i] += right[i];
+            }
+            return out;
+        });
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = true;
+    for (int i = 0; i < array_size; i++) {
+        if (i % 3 == 0) {
+            if (std::floor(sum[i]) != 11197) {
+                printf("%d: %f expected=%d\n", i, std::floor(sum[i]), 11197);
+                result.passed = false;
+            }
+        } else if (i % 3 == 1) {
+            if (std::floor(sum[i]) != 22687) {
+                printf("%d: %f expected=%d\n", i, std::floor(sum[i]), 22687);
+                result.passed = false;
+            }
+        } else {
+            if (std::floor(sum[i]) != (67950 * num_bulk_task_launches)) {
+                printf("%d: %f expected=%d\n", i, std::floor(sum[i]),
+                       67950 * num_bulk_task_launches);
+                result.passed = false;
+            }
+        }
+    }
+    result.time = end_time - start_time;
+
+    int num_matrices = 100000;
+    Mat2 identity = {1u, 0u, 0u, 1u};
+    Mat2 product = t->parallelReduce(num_matrices, identity,
+        [](int begin, int end, Mat2& acc) {
+            for (int i = begin; i < end; i++) {
+                acc = mat2Mul(acc, mat2ForIndex(i));
+            }
+        },
+        mat2Mul);
+    Mat2 expected = identity;
+    for (int i = 0; i < num_matrices; i++) {
+        expected = mat2Mul(expected, mat2ForIndex(i));
+    }
+    if (product.a != expected.a || product.b != expected.b ||
+        product.c != expected.c || product.d != expected.d) {
+        printf("matrix product: (%u %u %u %u) expected=(%u %u %u %u)\n",
+               product.a, product.b, product.c, product.d,
+               expected.a, expected.b, expected.c, expected.d);
+        result.passed = false;
+    }
+
+    delete [] buffer;
+
+    return result;
+}
+
+/*
+ * Computation: Prefix scans of large arrays with parallelScan, as used for
+ * stream compaction and histogram-to-offset conversion. An inclusive sum
+ * scan of an int array and an exclusive sum scan of a float array are each
+ * run once, and both are checked against a serial scan. The input values
+ * are small integers, so the float sums are exact.
+ */
+TestResults parallelScanTest(ITaskSystem* t) {
+
+    int num_elements = 8 * 1024 * 1024;
+
+    int* int_input = new int[num_elements];
+    int* int_output = new int[num_elements];
+    float* float_input = new float[num_elements];
+    float* float_output = new float[num_elements];
+    for (int i = 0; i < num_elements; i++) {
+        int_input[i] = i % 3;
+        int_output[i] = 0;
+        float_input[i] = static_cast<float>((i * 7) % 3);
+        float_output[i] = 0.f;
+    }
+
+    double start_time = CycleTimer::currentSeconds();
+    t->parallelScan(int_input, int_output, num_elements, 0,
+                    [](int a, int b) { return a + b; }, INCLUSIVE_SCAN);
+    t->parallelScan(float_input, float_output, num_elements, 0.f,
+                    [](float a, float b) { return a + b; }, EXCLUSIVE_SCAN);
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = true;
+    int int_sum = 0;
+    float float_sum = 0.f;
+    for (int i = 0; i < num_elements; i++) {
+        int_sum += int_input[i];
+        if (int_output[i] != int_sum) {
+            printf("inclusive %d: %d expected=%d\n", i, int_output[i], int_sum);
+            result.passed = false;
+            break;
+        }
+        if (float_output[i] != float_sum) {
+            printf("exclusive %d: %f expected=%f\n", i, float_output[i], float_sum);
+            result.passed = false;
+            break;
+        }
+        float_sum += float_input[i];
+    }
+    result.time = end_time - start_time;
+
+    delete [] int_input;
+    delete [] int_output;
+    delete [] float_input;
+    delete [] float_output;
+
+    return result;
+}
+
+/*
+ * Each task times `iterations_` empty regions into its own TimerSlots
+ * slot, timing the whole loop into its slot of loops_, and checks that
+ * the ordered tick reads never go backwards.
+ */
+class TimerSlotsTask: public IRunnable {
+    public:
+        TimerSlots& slots_;
+        TimerSlots& loops_;
+        int iterations_;
+        std::atomic<int>& backwards_;
+
+        TimerSlotsTask(TimerSlots& slots, TimerSlots& loops, int iterations,
+                       std::atomic<int>& backwards)
+          : slots_(slots), loops_(loops), iterations_(iterations), backwards_(backwards) {}
+
+        void runTask(int task_id, int num_total_tasks) {
+            {
+                TimerSlots::Scope loop(loops_, task_id);
+                for (int i = 0; i < iterations_; i++) {
+                    TimerSlots::Scope scope(slots_, task_id);
+                }
+            }
+            CycleTimer::SysClock last = CycleTimer::startTicks();
+            for (int i = 0; i < iterations_; i++) {
+                CycleTimer::SysClock now = CycleTimer::stopTicks();
+                if (now < last) {
+                    backwards_++;
+                }
+                last = now;
+            }
+        }
+};
+
+/*
+ * Computation: Checks CycleTimer's tick rate against steady_clock over
+ * 50 ms, to within 0.1%, then has 64 tasks time 20k empty regions each
+ * into per-task TimerSlots. Every region must be counted, and no task
+ * may see the ticks go backwards. Prints the cost of a timed region and
+ * the ticks measured inside an empty one; the time is that of the launch.
+ */
+TestResults cycleTimerTest(ITaskSystem* t) {
+    const int num_tasks = 64;
+    const int iterations = 20000;
+
+    TestResults result;
+    result.passed = true;
+
+    auto steady_start = std::chrono::steady_clock::now();
+    CycleTimer::SysClock tick_start = CycleTimer::startTicks();
+    while (std::chrono::steady_clock::now() - steady_start < std::chrono::milliseconds(50)) {
+    }
+    CycleTimer::SysClock tick_end = CycleTimer::stopTicks();
+    double steady = std::chrono::duration<double>(std::chrono::steady_clock::now() - steady_start).count();
+    double ticked = (tick_end - tick_start) * CycleTimer::secondsPerTick();
+    if (std::fabs(ticked - steady) > 1e-3 * steady) {
+        printf("ERROR: %.6f s in ticks, %.6f s by steady_clock\n", ticked, steady);
+        result.passed = false;
+    }
+
+    TimerSlots slots(num_tasks);
+    TimerSlots loops(num_tasks);
+    std::atomic<int> backwards(0);
+    TimerSlotsTask task(slots, loops, iterations, backwards);
+    double start_time = CycleTimer::currentSeconds();
+    t->run(&task, num_tasks);
+    double end_time = CycleTimer::currentSeconds();
+
+    for (int i = 0; i < num_tasks; i++) {
+        if (slots.count(i) != (CycleTimer::SysClock) iterations) {
+            printf("ERROR: slot %d counted %llu regions, expected %d\n", i, slots.count(i), iterations);
+            result.passed = false;
+        }
+    }
+    if (backwards > 0) {
+        printf("ERROR: ticks went backwards %d times\n", backwards.load());
+        result.passed = false;
+    }
+    printf("%.3f GHz ticks (%s), %.1f ns per timed region, %.1f ns inside it\n",
+           1e-9 / CycleTimer::secondsPerTick(), CycleTimer::tickUnits(),
+           loops.totalSeconds() * 1e9 / slots.totalCount(),
+           slots.totalSeconds() * 1e9 / slots.totalCount());
+
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Computation: Many back-to-back launches of trivial tasks, after which
+ * the task system's per-worker counters are checked: every task must be
+ * counted exactly once, and every launch by at least one and at most
+ * every worker. The time mostly measures the cost of keeping the counters.
+ */
+TestResults workerStatsTest(ITaskSystem* t) {
+
+    int num_launches = 400;
+    int num_tasks = 64;
+
+    int* output = new int[num_tasks];
+    LightTask light_task(output);
+
+    double start_time = CycleTimer::currentSeconds();
+    for (int i = 0; i < num_launches; i++) {
+        t->run(&light_task, num_tasks);
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    std::vector<WorkerStats> stats = t->getStats();
+    unsigned long long tasks_executed = 0;
+    unsigned long long launches_touched = 0;
+    bool steals_ok = true;
+    for (size_t i = 0; i < stats.size(); i++) {
+        tasks_executed += stats[i].tasks_executed;
+        launches_touched += stats[i].launches_touched;
+        steals_ok = steals_ok && stats[i].steal_successes <= stats[i].steal_attempts;
+    }
+
+    TestResults result;
+    result.passed = true;
+    if (stats.empty() || !steals_ok ||
+        tasks_executed != (unsigned long long) num_launches * num_tasks ||
+        launches_touched < (unsigned long long) num_launches ||
+        launches_touched > (unsigned long long) num_launches * stats.size()) {
+        printf("workers=%d tasks=%llu expected=%d launches=%llu\n", (int) stats.size(),
+               tasks_executed, num_launches * num_tasks, launches_touched);
+        result.passed = false;
+    }
+    result.time = end_time - start_time;
+
+    delete [] output;
+    return result;
+}
+
+/*
+ * Computation: Many back-to-back launches of one to three trivial tasks,
+ * which finish about as soon as they start, after which the launch
+ * latencies of task systems that record them are checked: every launch
+ * must have been recorded, and no execution or total latency may be 0,
+ * as it is when a launch is recorded before its last task is stamped.
+ */
+TestResults launchLatencyTest(ITaskSystem* t) {
+
+    int num_launches = 2000;
+    int output[3];
+    LightTask light_task(output);
+
+    LatencySummary before;
+    bool recorded = t->getLaunchLatency(LAUNCH_TOTAL, before);
+
+    double start_time = CycleTimer::currentSeconds();
+    for (int i = 0; i < num_launches; i++) {
+        t->run(&light_task, 1 + i % 3);
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    TestResults result;
+    result.passed = true;
+    result.time = end_time - start_time;
+    if (!recorded) {
+        return result;
+    }
+
+    const LaunchPhase phases[2] = { LAUNCH_EXECUTION, LAUNCH_TOTAL };
+    const char* phase_names[2] = { "execution", "total" };
+    for (int i = 0; i < 2; i++) {
+        LatencySummary latency;
+        t->getLaunchLatency(phases[i], latency);
+        if (latency.count < before.count + num_launches || latency.min_us <= 0.0) {
+            printf("ERROR: %s latency has %llu samples, expected %llu, and a minimum of %.3f us\n",
+                   phase_names[i], latency.count, before.count + num_launches, latency.min_us);
+            result.passed = false;
+        }
+    }
+    return result;
+}
+
 /*
  * Computation: In between two calls to a light weight task, these tests spawn
  * a medium weight bulk task launch that only has enough enough tasks to
@@ -1187,14 +1965,28 @@ TestResults spinBetweenRunCallsAsyncTest(ITaskSystem *t) {
 
 /*
  * Computation: This test computes a Mandelbrot fractal image by
- * decomposing the problem into tasks that produce contiguous chunks of
- * output image rows. Note that only one bulk task launch is performed,
- * which means thread pool and spawning threads each run() should have
- * similar performance.
+ * decomposing the problem into 128 tasks of interleaved output image
+ * rows. Note that only one bulk task launch is performed, which means
+ * thread pool and spawning threads each run() should have similar
+ * performance.
+ *
+ * With tiled the image is instead decomposed into a 16x8 grid of 2D
+ * tiles, launched as a tiled bulk task launch that hands tiles out in
+ * Morton order.
+ *
+ * With early_out, which needs tiled, the tiles are computed with the
+ * early-out kernel, whose border tracing may get a few pixels wrong; up
+ * to MANDEL_EARLY_OUT_MAX_MISMATCH of them may differ from the plain
+ * kernel.
  */
-TestResults mandelbrotChunkedTestBase(ITaskSystem* t, bool do_async) {
+#define MANDEL_EARLY_OUT_MAX_MISMATCH 0.0001
+
+TestResults mandelbrotChunkedTestBase(ITaskSystem* t, bool do_async, bool tiled,
+                                      bool early_out = false) {
 
     int num_tasks = 128;
+    int num_tiles_x = 16;
+    int num_tiles_y = 8;
     
     MandelbrotTask::MandelArgs ma;
     ma.x0 = -2;
@@ -1209,35 +2001,50 @@ TestResults mandelbrotChunkedTestBase(ITaskSystem* t, bool do_async) {
         ma.output[i] = 0;
     }
 
-    MandelbrotTask mandel_task(&ma, true);  // No interleaving
+    MandelbrotTask mandel_task(&ma, !tiled, simdBestIsa(), early_out);
+    TiledRunnable tiled_task(&mandel_task, num_tiles_x, num_tiles_y);
+    IRunnable* runnable = &mandel_task;
+    if (tiled) {
+        runnable = &tiled_task;
+        num_tasks = tiled_task.numTiles();
+    }
 
     // time task-based implementation
     double start_time = CycleTimer::currentSeconds();
     if (do_async) {
         std::vector<TaskID> deps; // Call runAsyncWithDeps without dependencies.
-        t->runAsyncWithDeps(&mandel_task, num_tasks, deps);
+        t->runAsyncWithDeps(runnable, num_tasks, deps);
         t->sync();
+    } else if (tiled) {
+        t->runTiled(&mandel_task, num_tiles_x, num_tiles_y);
     } else {
-        t->run(&mandel_task, num_tasks);
+        t->run(runnable, num_tasks);
     }
     double end_time = CycleTimer::currentSeconds();
 
     // Validate correctness of the task-based implementation
-    // against sequential implementation
+    // against sequential scalar implementation
     int *golden = new int[ma.width * ma.height];
-    mandel_task.mandelbrotSerial(ma.x0, ma.y0, ma.x1, ma.y1,
+    MandelbrotTask scalar_task(&ma, false, SIMD_SCALAR);
+    scalar_task.mandelbrotSerial(ma.x0, ma.y0, ma.x1, ma.y1,
                                  ma.width, ma.height,
                                  0, ma.height,
                                  ma.max_iterations,
                                  golden);
 
     TestResults result;
-    result.passed = true;
-    for (int i = 0; i < ma.width * ma.height; i++) {
+    int num_pixels = ma.width * ma.height;
+    int mismatches = 0;
+    for (int i = 0; i < num_pixels; i++) {
         if (golden[i] != ma.output[i]) {
-            result.passed = false;
+            mismatches++;
         }
     }
+    result.passed = early_out ? mismatches <= num_pixels * MANDEL_EARLY_OUT_MAX_MISMATCH
+                              : mismatches == 0;
+    if (early_out && mismatches > 0) {
+        printf("%d of %d pixels differ from the plain kernel\n", mismatches, num_pixels);
+    }
     
     result.time = end_time - start_time;
 
@@ -1248,11 +2055,406 @@ TestResults mandelbrotChunkedTestBase(ITaskSystem* t, bool do_async) {
 }
 
 TestResults mandelbrotChunkedTest(ITaskSystem* t) {
-    return mandelbrotChunkedTestBase(t, false);
+    return mandelbrotChunkedTestBase(t, false, false);
 }
 
 TestResults mandelbrotChunkedAsyncTest(ITaskSystem* t) {
-    return mandelbrotChunkedTestBase(t, true);
+    return mandelbrotChunkedTestBase(t, true, false);
+}
+
+TestResults mandelbrotTiledTest(ITaskSystem* t) {
+    return mandelbrotChunkedTestBase(t, false, true);
+}
+
+TestResults mandelbrotTiledAsyncTest(ITaskSystem* t) {
+    return mandelbrotChunkedTestBase(t, true, true);
+}
+
+TestResults mandelbrotChunkedEarlyOutTest(ITaskSystem* t) {
+    return mandelbrotChunkedTestBase(t, false, true, true);
+}
+
+/*
+ * Computation: Renders a 40-frame zoom into the boundary of the
+ * Mandelbrot set through a MandelTileCache, each frame 7% smaller than
+ * the last and panning towards the zoom target. Only the tiles a frame
+ * does not share with earlier ones are computed. Checks every 13th
+ * pixel of each frame against the grid point it was resampled from, and
+ * that more than half of the tile lookups hit the cache.
+ */
+TestResults mandelbrotZoomCacheTest(ITaskSystem* t) {
+    const int num_frames = 40;
+    const int width = 800;
+    const int height = 600;
+    const int max_iterations = 256;
+    const float target_x = -0.7453f;
+    const float target_y = 0.1127f;
+
+    MandelTileCache cache(16 << 20);
+    int* output = new int[width * height];
+    float center_x = -0.75f;
+    float center_y = 0.f;
+    float extent_x = 3.f;
+
+    TestResults result;
+    result.passed = true;
+    result.time = 0.0;
+    for (int frame = 0; frame < num_frames; frame++) {
+        float x0 = center_x - extent_x / 2;
+        float x1 = center_x + extent_x / 2;
+        float extent_y = extent_x * height / width;
+        float y0 = center_y - extent_y / 2;
+        float y1 = center_y + extent_y / 2;
+
+        double start_time = CycleTimer::currentSeconds();
+        cache.renderFrame(t, x0, x1, y0, y1, width, height, max_iterations, output);
+        result.time += CycleTimer::currentSeconds() - start_time;
+
+        float dx = (x1 - x0) / width;
+        float dy = (y1 - y0) / height;
+        int level = MandelTileCache::levelFor(dx, dy);
+        float spacing = MandelTileCache::levelSpacing(level);
+        for (int i = 0; i < width * height && result.passed; i += 13) {
+            long long tx, ty;
+            int col, row;
+            MandelTileCache::gridCell(x0 + (i % width) * dx, level, tx, col);
+            MandelTileCache::gridCell(y0 + (i / width) * dy, level, ty, row);
+            int expected = mandelScalar(MandelTileCache::gridPoint(tx, col, spacing),
+                                        MandelTileCache::gridPoint(ty, row, spacing),
+                                        max_iterations);
+            if (output[i] != expected) {
+                printf("ERROR: frame %d pixel %d is %d, expected %d\n", frame, i, output[i], expected);
+                result.passed = false;
+            }
+        }
+
+        center_x += (target_x - center_x) * 0.15f;
+        center_y += (target_y - center_y) * 0.15f;
+        extent_x *= 0.93f;
+    }
+
+    if (cache.stats().hitRate() <= 0.5) {
+        printf("ERROR: tile cache hit rate %.2f\n", cache.stats().hitRate());
+        result.passed = false;
+    }
+
+    delete [] output;
+    return result;
+}
+
+/*
+ * Reads back a binary PPM (P6) or PGM (P5) image written by
+ * writePPMImage() or writePGMImage(), checking its header. Returns the
+ * pixel bytes, or an empty vector if the file is not as expected.
+ */
+std::vector<unsigned char> readBinaryImage(const char* filename, const char* magic,
+                                           int width, int height, int channels) {
+    std::vector<unsigned char> pixels;
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        return pixels;
+    }
+    char file_magic[3] = {0};
+    int file_width, file_height, file_max;
+    if (fscanf(fp, "%2s %d %d %d", file_magic, &file_width, &file_height, &file_max) == 4 &&
+        strcmp(file_magic, magic) == 0 && file_width == width && file_height == height &&
+        file_max == 255 && fgetc(fp) == '\n') {
+        pixels.resize((size_t) width * height * channels);
+        if (fread(&pixels[0], 1, pixels.size(), fp) != pixels.size() || fgetc(fp) != EOF) {
+            pixels.clear();
+        }
+    }
+    fclose(fp);
+    return pixels;
+}
+
+/*
+ * Creates an empty file for a test image from the mkstemp() template
+ * name, which is updated to the file's name. Returns false, with an
+ * error message, if the file could not be created.
+ */
+bool createTempImage(char* name) {
+    int fd = mkstemp(name);
+    if (fd < 0) {
+        printf("ERROR: could not create temporary image file\n");
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+/*
+ * Checks that the PPM (P6) file name holds the image of ma: every pixel
+ * must be the scalar kernel's count mapped to brightness by
+ * ppmBrightnessTable(). Prints the first mismatch.
+ */
+bool checkImageFile(MandelbrotTask::MandelArgs* ma, const char* name) {
+    std::vector<unsigned char> ppm = readBinaryImage(name, "P6", ma->width, ma->height, 3);
+    if (ppm.empty()) {
+        printf("ERROR: image file does not match its header\n");
+        return false;
+    }
+
+    std::vector<int> golden((size_t) ma->width * ma->height);
+    MandelbrotTask scalar_task(ma, false, SIMD_SCALAR);
+    scalar_task.mandelbrotSerial(ma->x0, ma->y0, ma->x1, ma->y1,
+                                 ma->width, ma->height,
+                                 0, ma->height,
+                                 ma->max_iterations,
+                                 &golden[0]);
+    std::vector<unsigned char> brightness = ppmBrightnessTable(ma->max_iterations);
+    for (size_t i = 0; i < golden.size(); i++) {
+        unsigned char expected = brightness[std::min(golden[i], ma->max_iterations)];
+        if (ppm[3 * i] != expected || ppm[3 * i + 1] != expected || ppm[3 * i + 2] != expected) {
+            printf("ERROR: pixel %zu is encoded as (%d, %d, %d), expected %d\n",
+                   i, ppm[3 * i], ppm[3 * i + 1], ppm[3 * i + 2], expected);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Computation: Renders the 1600x1200 image of MandelbrotTiled with the
+ * same 16x8 tile launch, then encodes it as a PPM (P6) and a PGM (P5)
+ * file in /tmp. Times the render and both encodes. Reads both files back
+ * and checks every pixel against the brightness mapping of the original
+ * per-pixel encoder.
+ */
+TestResults mandelbrotWriteImageTest(ITaskSystem* t) {
+    MandelbrotTask::MandelArgs ma;
+    ma.x0 = -2;
+    ma.x1 = 1;
+    ma.y0 = -1;
+    ma.y1 = 1;
+    ma.width = 1600;
+    ma.height = 1200;
+    ma.max_iterations = 256;
+    ma.output = new int[ma.width * ma.height];
+
+    char ppm_name[] = "/tmp/runtasks_ppm_XXXXXX";
+    char pgm_name[] = "/tmp/runtasks_pgm_XXXXXX";
+    int ppm_fd = mkstemp(ppm_name);
+    int pgm_fd = mkstemp(pgm_name);
+
+    TestResults result;
+    result.passed = ppm_fd >= 0 && pgm_fd >= 0;
+    if (!result.passed) {
+        printf("ERROR: could not create temporary image files\n");
+    }
+
+    MandelbrotTask mandel_task(&ma, false);
+    double start_time = CycleTimer::currentSeconds();
+    t->runTiled(&mandel_task, 16, 8);
+    if (result.passed) {
+        result.passed = writePPMImage(ma.output, ma.width, ma.height, ppm_name, ma.max_iterations) &&
+                        writePGMImage(ma.output, ma.width, ma.height, pgm_name, ma.max_iterations);
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    if (result.passed) {
+        std::vector<unsigned char> ppm = readBinaryImage(ppm_name, "P6", ma.width, ma.height, 3);
+        std::vector<unsigned char> pgm = readBinaryImage(pgm_name, "P5", ma.width, ma.height, 1);
+        result.passed = !ppm.empty() && !pgm.empty();
+        for (int i = 0; i < ma.width * ma.height && result.passed; i++) {
+            float mapped = pow(std::min(static_cast<float>(ma.max_iterations),
+                                        static_cast<float>(ma.output[i])) / 256.f, .5f);
+            unsigned char expected = static_cast<unsigned char>(255.f * mapped);
+            if (ppm[3 * i] != expected || ppm[3 * i + 1] != expected ||
+                ppm[3 * i + 2] != expected || pgm[i] != expected) {
+                printf("ERROR: pixel %d is encoded as (%d, %d, %d) and %d, expected %d\n",
+                       i, ppm[3 * i], ppm[3 * i + 1], ppm[3 * i + 2], pgm[i], expected);
+                result.passed = false;
+            }
+        }
+        if (ppm.empty() || pgm.empty()) {
+            printf("ERROR: image files do not match their headers\n");
+        }
+    }
+
+    if (ppm_fd >= 0) {
+        close(ppm_fd);
+        unlink(ppm_name);
+    }
+    if (pgm_fd >= 0) {
+        close(pgm_fd);
+        unlink(pgm_name);
+    }
+    result.time = end_time - start_time;
+    delete [] ma.output;
+    return result;
+}
+
+/*
+ * Computation: Renders the 1600x1200 image of MandelbrotChunked straight
+ * into a memory-mapped PPM file in /tmp, with 64 tasks of contiguous
+ * rows that each start writing their rows back to the file when done.
+ * Times creating the file, the render and the final unmap. Reads the file
+ * back and checks every pixel against the scalar kernel's counts mapped
+ * to brightness.
+ */
+TestResults mandelbrotMappedImageTest(ITaskSystem* t) {
+    MandelbrotTask::MandelArgs ma;
+    ma.x0 = -2;
+    ma.x1 = 1;
+    ma.y0 = -1;
+    ma.y1 = 1;
+    ma.width = 1600;
+    ma.height = 1200;
+    ma.max_iterations = 256;
+    ma.output = NULL;
+
+    char ppm_name[] = "/tmp/runtasks_ppm_XXXXXX";
+    bool created = createTempImage(ppm_name);
+    TestResults result;
+    result.passed = created;
+
+    std::vector<unsigned char> brightness = ppmBrightnessTable(ma.max_iterations);
+    MappedImage image;
+    MandelbrotImageTask mandel_task(&ma, &image, &brightness[0], true);
+
+    double start_time = CycleTimer::currentSeconds();
+    if (result.passed) {
+        result.passed = image.create(ppm_name, ma.width, ma.height, true);
+    }
+    if (result.passed) {
+        t->run(&mandel_task, 64);
+        result.passed = image.close();
+    }
+    double end_time = CycleTimer::currentSeconds();
+
+    if (result.passed) {
+        result.passed = checkImageFile(&ma, ppm_name);
+    }
+
+    if (created) {
+        unlink(ppm_name);
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Computation: Renders a tall 1024x4096 Mandelbrot image in bands of 16
+ * rows, one task per band, and streams it to a PPM file in /tmp with a
+ * StreamingImageWriter, which writes each band once it and all bands
+ * above it are done. Times the whole render and write, and prints the
+ * time until the first band reached the file. Reads the file back and
+ * checks every pixel against the scalar kernel's counts mapped to
+ * brightness.
+ */
+TestResults mandelbrotStreamImageTest(ITaskSystem* t) {
+    MandelbrotTask::MandelArgs ma;
+    ma.x0 = -2;
+    ma.x1 = 1;
+    ma.y0 = -2;
+    ma.y1 = 2;
+    ma.width = 1024;
+    ma.height = 4096;
+    ma.max_iterations = 256;
+    ma.output = NULL;
+
+    char ppm_name[] = "/tmp/runtasks_ppm_XXXXXX";
+    bool created = createTempImage(ppm_name);
+    TestResults result;
+    result.passed = created;
+
+    StreamingImageWriter stream;
+    MandelbrotStreamTask mandel_task(&ma, &stream);
+
+    double start_time = CycleTimer::currentSeconds();
+    if (result.passed) {
+        result.passed = stream.open(ppm_name, ma.width, ma.height, true, ma.max_iterations, 16, 64);
+    }
+    if (result.passed) {
+        t->run(&mandel_task, stream.numBands());
+        result.passed = stream.finish();
+    }
+    double end_time = CycleTimer::currentSeconds();
+    if (result.passed) {
+        printf("First band written after %.3f ms\n", (stream.firstBandSeconds() - start_time) * 1000);
+        result.passed = checkImageFile(&ma, ppm_name);
+    }
+
+    if (created) {
+        unlink(ppm_name);
+    }
+    result.time = end_time - start_time;
+    return result;
+}
+
+/*
+ * Computation: Renders Mandelbrot images with interleaved rows, once
+ * with every vectorized kernel the CPU supports, and checks each against
+ * the scalar kernel pixel for pixel. The views include a deep zoom into
+ * the boundary, where lanes escape at very different iterations, and
+ * widths that are not a multiple of any vector width. The time reported
+ * is that of the widest kernel.
+ */
+TestResults mandelbrotInterleavedSimdTest(ITaskSystem* t) {
+    const int num_views = 3;
+    const float views[num_views][4] = {
+        { -2.f, 1.f, -1.f, 1.f },
+        { -0.7454f, -0.7452f, 0.1130f, 0.1132f },
+        { -1.25f, -1.2f, 0.02f, 0.07f },
+    };
+    const int widths[num_views] = { 1600, 1001, 333 };
+    const int heights[num_views] = { 1200, 777, 250 };
+    const int max_iterations[num_views] = { 256, 1024, 500 };
+    int num_tasks = 64;
+
+    TestResults result;
+    result.passed = true;
+    result.time = 0.0;
+    for (int v = 0; v < num_views; v++) {
+        MandelbrotTask::MandelArgs ma;
+        ma.x0 = views[v][0];
+        ma.x1 = views[v][1];
+        ma.y0 = views[v][2];
+        ma.y1 = views[v][3];
+        ma.width = widths[v];
+        ma.height = heights[v];
+        ma.max_iterations = max_iterations[v];
+        ma.output = new int[ma.width * ma.height];
+
+        int *golden = new int[ma.width * ma.height];
+        MandelbrotTask scalar_task(&ma, false, SIMD_SCALAR);
+        scalar_task.mandelbrotSerial(ma.x0, ma.y0, ma.x1, ma.y1,
+                                     ma.width, ma.height,
+                                     0, ma.height,
+                                     ma.max_iterations,
+                                     golden);
+
+        for (int isa = SIMD_SCALAR + 1; isa < NUM_SIMD_ISAS; isa++) {
+            if (!simdIsaSupported((SimdIsa) isa)) {
+                continue;
+            }
+            for (int i = 0; i < ma.width * ma.height; i++) {
+                ma.output[i] = -1;
+            }
+            MandelbrotTask mandel_task(&ma, true, (SimdIsa) isa);
+            double start_time = CycleTimer::currentSeconds();
+            t->run(&mandel_task, num_tasks);
+            double end_time = CycleTimer::currentSeconds();
+            if (isa == simdBestIsa()) {
+                result.time += end_time - start_time;
+            }
+
+            for (int i = 0; i < ma.width * ma.height; i++) {
+                if (golden[i] != ma.output[i]) {
+                    printf("ERROR: %s kernel differs from scalar in view %d at pixel %d: %d vs %d\n",
+                           simd_isa_names[isa], v, i, ma.output[i], golden[i]);
+                    result.passed = false;
+                    break;
+                }
+            }
+        }
+
+        delete [] golden;
+        delete [] ma.output;
+    }
+
+    return result;
 }
 
 /*
@@ -0,0 +1,393 @@
+#ifndef _VECMATH_H
+#define _VECMATH_H
+
+/*
+ * Vectorized single-precision exp and log for numeric task bodies that
+ * would otherwise call libm once per element.  vecExp() and vecLog()
+ * map an array, 16 floats at a time with AVX-512, 8 with AVX2 + FMA or
+ * 4 with NEON, and finish leftovers with the scalar versions of the same
+ * polynomials.  The kernels are picked at runtime with simdisa.h.
+ *
+ * Both use the Cephes range reductions and polynomials:
+ *
+ *   exp: x = n ln2 + r with |r| <= ln2/2 (ln2 split in two for an exact
+ *        n ln2), exp(r) by a degree-7 polynomial, scaled by 2^n through
+ *        the exponent bits.
+ *   log: x = 2^e m with m in [sqrt(1/2), sqrt(2)), log(m) by a degree-10
+ *        polynomial in m - 1, plus e ln2.
+ *
+ * Error bounds, measured against double-precision libm on every float
+ * in the domain, for both the vector and scalar versions:
+ *
+ *   vecExp: relative error below 1.5e-7 (1.3 FLT_EPSILON) for x in
+ *           [-86.99, 88.72).  Larger x gives +inf, as exp(x) rounds
+ *           past FLT_MAX there; smaller x gives 0, flushing results
+ *           below 2.0e-38 to zero.  NaN gives NaN.
+ *   vecLog: absolute error below 5e-8 for x in [0.5, 2], where log(x)
+ *           crosses zero, and relative error below 1e-7 for all other
+ *           normal x > 0.  Zero and denormal x give -inf, +inf gives
+ *           +inf, and negative x and NaN give NaN.
+ *
+ * libm's expf/logf are correctly rounded or nearly so; use them where
+ * the last ulp matters.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "simdisa.h"
+
+#define VECMATH_EXP_HI 88.7228391f
+// Keeps n >= -125, so that 2^(n - 1) below is a normal float.
+#define VECMATH_EXP_LO -86.9894f
+#define VECMATH_FLT_MIN 1.17549435e-38f
+#define VECMATH_LOG2E 1.44269504088896341f
+#define VECMATH_LN2_HI 0.693359375f
+#define VECMATH_LN2_LO -2.12194440e-4f
+#define VECMATH_SQRTHF 0.707106781186547524f
+
+static inline float vecExpScalar(float x) {
+    if (x > VECMATH_EXP_HI) {
+        return INFINITY;
+    }
+    if (!(x >= VECMATH_EXP_LO)) {
+        return x != x ? x : 0.f;
+    }
+    float n = floorf(x * VECMATH_LOG2E + 0.5f);
+    float r = x - n * VECMATH_LN2_HI;
+    r = r - n * VECMATH_LN2_LO;
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.f;
+    // 2^n as 2^(n - 1) * 2, n in [-125, 128], so that n = 128 works.
+    int32_t bits = ((int32_t) n + 126) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale * 2.f;
+}
+
+static inline float vecLogScalar(float x) {
+    if (!(x >= 0.f)) {
+        return NAN;
+    }
+    if (x < VECMATH_FLT_MIN) {
+        return -INFINITY;
+    }
+    if (x == INFINITY) {
+        return x;
+    }
+    int32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    // m in [0.5, 1)
+    float e = (float) ((bits >> 23) - 126);
+    bits = (bits & 0x007fffff) | 0x3f000000;
+    float m;
+    memcpy(&m, &bits, sizeof(m));
+    if (m < VECMATH_SQRTHF) {
+        e -= 1.f;
+        m = m + m - 1.f;
+    } else {
+        m = m - 1.f;
+    }
+    float z = m * m;
+    float y = 7.0376836292e-2f;
+    y = y * m - 1.1514610310e-1f;
+    y = y * m + 1.1676998740e-1f;
+    y = y * m - 1.2420140846e-1f;
+    y = y * m + 1.4249322787e-1f;
+    y = y * m - 1.6668057665e-1f;
+    y = y * m + 2.0000714765e-1f;
+    y = y * m - 2.4999993993e-1f;
+    y = y * m + 3.3333331174e-1f;
+    y = y * m * z;
+    y += e * VECMATH_LN2_LO;
+    y += -0.5f * z;
+    return m + y + e * VECMATH_LN2_HI;
+}
+
+#ifdef SIMD_HAVE_X86
+__attribute__((target("avx2,fma")))
+static void vecExpAvx2(const float* in, float* out, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps(in + i);
+        __m256 overflow = _mm256_cmp_ps(x, _mm256_set1_ps(VECMATH_EXP_HI), _CMP_GT_OQ);
+        // Also true for NaN, which is passed through below.
+        __m256 underflow = _mm256_cmp_ps(x, _mm256_set1_ps(VECMATH_EXP_LO), _CMP_NGE_UQ);
+        __m256 nan = _mm256_cmp_ps(x, x, _CMP_UNORD_Q);
+        __m256 xc = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(VECMATH_EXP_LO)),
+                                  _mm256_set1_ps(VECMATH_EXP_HI));
+        __m256 k = _mm256_floor_ps(_mm256_fmadd_ps(xc, _mm256_set1_ps(VECMATH_LOG2E),
+                                                   _mm256_set1_ps(0.5f)));
+        __m256 r = _mm256_fnmadd_ps(k, _mm256_set1_ps(VECMATH_LN2_HI), xc);
+        r = _mm256_fnmadd_ps(k, _mm256_set1_ps(VECMATH_LN2_LO), r);
+        __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+        p = _mm256_fmadd_ps(_mm256_mul_ps(p, r), r, _mm256_add_ps(r, _mm256_set1_ps(1.f)));
+        __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(k),
+                                                          _mm256_set1_epi32(126)), 23);
+        __m256 y = _mm256_mul_ps(_mm256_mul_ps(p, _mm256_castsi256_ps(bits)), _mm256_set1_ps(2.f));
+        y = _mm256_blendv_ps(y, _mm256_setzero_ps(), underflow);
+        y = _mm256_blendv_ps(y, _mm256_set1_ps(INFINITY), overflow);
+        y = _mm256_blendv_ps(y, x, nan);
+        _mm256_storeu_ps(out + i, y);
+    }
+    for (; i < n; i++) {
+        out[i] = vecExpScalar(in[i]);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void vecLogAvx2(const float* in, float* out, int n) {
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps(in + i);
+        // Negative or NaN.
+        __m256 invalid = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_NGE_UQ);
+        // Zero or denormal.
+        __m256 zero = _mm256_andnot_ps(invalid, _mm256_cmp_ps(x, _mm256_set1_ps(VECMATH_FLT_MIN),
+                                                              _CMP_LT_OQ));
+        __m256 inf = _mm256_cmp_ps(x, _mm256_set1_ps(INFINITY), _CMP_EQ_OQ);
+        __m256i bits = _mm256_castps_si256(x);
+        __m256 e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(bits, 23),
+                                                       _mm256_set1_epi32(126)));
+        bits = _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0x007fffff)),
+                               _mm256_set1_epi32(0x3f000000));
+        __m256 m = _mm256_castsi256_ps(bits);
+        __m256 small = _mm256_cmp_ps(m, _mm256_set1_ps(VECMATH_SQRTHF), _CMP_LT_OQ);
+        e = _mm256_sub_ps(e, _mm256_and_ps(small, _mm256_set1_ps(1.f)));
+        m = _mm256_sub_ps(_mm256_add_ps(m, _mm256_and_ps(small, m)), _mm256_set1_ps(1.f));
+        __m256 z = _mm256_mul_ps(m, m);
+        __m256 y = _mm256_set1_ps(7.0376836292e-2f);
+        y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(-1.1514610310e-1f));
+        y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(1.1676998740e-1f));
+        y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(-1.2420140846e-1f));
+        y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(1.4249322787e-1f));
+        y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(-1.6668057665e-1f));
+        y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(2.0000714765e-1f));
+        y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(-2.4999993993e-1f));
+        y = _mm256_fmadd_ps(y, m, _mm256_set1_ps(3.3333331174e-1f));
+        y = _mm256_mul_ps(_mm256_mul_ps(y, m), z);
+        y = _mm256_fmadd_ps(e, _mm256_set1_ps(VECMATH_LN2_LO), y);
+        y = _mm256_fmadd_ps(z, _mm256_set1_ps(-0.5f), y);
+        y = _mm256_fmadd_ps(e, _mm256_set1_ps(VECMATH_LN2_HI), _mm256_add_ps(m, y));
+        y = _mm256_blendv_ps(y, _mm256_set1_ps(NAN), invalid);
+        y = _mm256_blendv_ps(y, _mm256_set1_ps(-INFINITY), zero);
+        y = _mm256_blendv_ps(y, x, inf);
+        _mm256_storeu_ps(out + i, y);
+    }
+    for (; i < n; i++) {
+        out[i] = vecLogScalar(in[i]);
+    }
+}
+
+// The maskz forms throughout, as GCC 12 warns about the unmasked ones.
+__attribute__((target("avx512f")))
+static void vecExpAvx512(const float* in, float* out, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 x = _mm512_loadu_ps(in + i);
+        __mmask16 overflow = _mm512_cmp_ps_mask(x, _mm512_set1_ps(VECMATH_EXP_HI), _CMP_GT_OQ);
+        __mmask16 underflow = _mm512_cmp_ps_mask(x, _mm512_set1_ps(VECMATH_EXP_LO), _CMP_NGE_UQ);
+        __mmask16 nan = _mm512_cmp_ps_mask(x, x, _CMP_UNORD_Q);
+        __m512 xc = _mm512_maskz_max_ps(0xffff, x, _mm512_set1_ps(VECMATH_EXP_LO));
+        xc = _mm512_maskz_min_ps(0xffff, xc, _mm512_set1_ps(VECMATH_EXP_HI));
+        __m512 k = _mm512_fmadd_ps(xc, _mm512_set1_ps(VECMATH_LOG2E), _mm512_set1_ps(0.5f));
+        k = _mm512_maskz_roundscale_ps(0xffff, k, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        __m512 r = _mm512_fnmadd_ps(k, _mm512_set1_ps(VECMATH_LN2_HI), xc);
+        r = _mm512_fnmadd_ps(k, _mm512_set1_ps(VECMATH_LN2_LO), r);
+        __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.3981999507e-3f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+        p = _mm512_fmadd_ps(_mm512_mul_ps(p, r), r, _mm512_add_ps(r, _mm512_set1_ps(1.f)));
+        __m512i bits = _mm512_add_epi32(_mm512_maskz_cvtps_epi32(0xffff, k), _mm512_set1_epi32(126));
+        bits = _mm512_maskz_slli_epi32(0xffff, bits, 23);
+        __m512 y = _mm512_mul_ps(_mm512_mul_ps(p, _mm512_castsi512_ps(bits)), _mm512_set1_ps(2.f));
+        y = _mm512_mask_mov_ps(y, underflow, _mm512_setzero_ps());
+        y = _mm512_mask_mov_ps(y, overflow, _mm512_set1_ps(INFINITY));
+        y = _mm512_mask_mov_ps(y, nan, x);
+        _mm512_storeu_ps(out + i, y);
+    }
+    for (; i < n; i++) {
+        out[i] = vecExpScalar(in[i]);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void vecLogAvx512(const float* in, float* out, int n) {
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 x = _mm512_loadu_ps(in + i);
+        __mmask16 invalid = _mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_NGE_UQ);
+        __mmask16 zero = ~invalid & _mm512_cmp_ps_mask(x, _mm512_set1_ps(VECMATH_FLT_MIN),
+                                                       _CMP_LT_OQ);
+        __mmask16 inf = _mm512_cmp_ps_mask(x, _mm512_set1_ps(INFINITY), _CMP_EQ_OQ);
+        __m512i bits = _mm512_castps_si512(x);
+        __m512i exponent = _mm512_sub_epi32(_mm512_maskz_srli_epi32(0xffff, bits, 23),
+                                            _mm512_set1_epi32(126));
+        __m512 e = _mm512_maskz_cvtepi32_ps(0xffff, exponent);
+        bits = _mm512_or_si512(_mm512_and_si512(bits, _mm512_set1_epi32(0x007fffff)),
+                               _mm512_set1_epi32(0x3f000000));
+        __m512 m = _mm512_castsi512_ps(bits);
+        __mmask16 small = _mm512_cmp_ps_mask(m, _mm512_set1_ps(VECMATH_SQRTHF), _CMP_LT_OQ);
+        e = _mm512_mask_sub_ps(e, small, e, _mm512_set1_ps(1.f));
+        m = _mm512_sub_ps(_mm512_mask_add_ps(m, small, m, m), _mm512_set1_ps(1.f));
+        __m512 z = _mm512_mul_ps(m, m);
+        __m512 y = _mm512_set1_ps(7.0376836292e-2f);
+        y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(-1.1514610310e-1f));
+        y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(1.1676998740e-1f));
+        y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(-1.2420140846e-1f));
+        y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(1.4249322787e-1f));
+        y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(-1.6668057665e-1f));
+        y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(2.0000714765e-1f));
+        y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(-2.4999993993e-1f));
+        y = _mm512_fmadd_ps(y, m, _mm512_set1_ps(3.3333331174e-1f));
+        y = _mm512_mul_ps(_mm512_mul_ps(y, m), z);
+        y = _mm512_fmadd_ps(e, _mm512_set1_ps(VECMATH_LN2_LO), y);
+        y = _mm512_fmadd_ps(z, _mm512_set1_ps(-0.5f), y);
+        y = _mm512_fmadd_ps(e, _mm512_set1_ps(VECMATH_LN2_HI), _mm512_add_ps(m, y));
+        y = _mm512_mask_mov_ps(y, invalid, _mm512_set1_ps(NAN));
+        y = _mm512_mask_mov_ps(y, zero, _mm512_set1_ps(-INFINITY));
+        y = _mm512_mask_mov_ps(y, inf, x);
+        _mm512_storeu_ps(out + i, y);
+    }
+    for (; i < n; i++) {
+        out[i] = vecLogScalar(in[i]);
+    }
+}
+#endif
+
+#ifdef SIMD_HAVE_NEON
+static void vecExpNeon(const float* in, float* out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t x = vld1q_f32(in + i);
+        uint32x4_t overflow = vcgtq_f32(x, vdupq_n_f32(VECMATH_EXP_HI));
+        uint32x4_t underflow = vmvnq_u32(vcgeq_f32(x, vdupq_n_f32(VECMATH_EXP_LO)));
+        uint32x4_t nan = vmvnq_u32(vceqq_f32(x, x));
+        float32x4_t xc = vminq_f32(vmaxq_f32(x, vdupq_n_f32(VECMATH_EXP_LO)),
+                                   vdupq_n_f32(VECMATH_EXP_HI));
+        float32x4_t k = vrndmq_f32(vfmaq_f32(vdupq_n_f32(0.5f), xc, vdupq_n_f32(VECMATH_LOG2E)));
+        float32x4_t r = vfmsq_f32(xc, k, vdupq_n_f32(VECMATH_LN2_HI));
+        r = vfmsq_f32(r, k, vdupq_n_f32(VECMATH_LN2_LO));
+        float32x4_t p = vdupq_n_f32(1.9875691500e-4f);
+        p = vfmaq_f32(vdupq_n_f32(1.3981999507e-3f), p, r);
+        p = vfmaq_f32(vdupq_n_f32(8.3334519073e-3f), p, r);
+        p = vfmaq_f32(vdupq_n_f32(4.1665795894e-2f), p, r);
+        p = vfmaq_f32(vdupq_n_f32(1.6666665459e-1f), p, r);
+        p = vfmaq_f32(vdupq_n_f32(5.0000001201e-1f), p, r);
+        p = vfmaq_f32(vaddq_f32(r, vdupq_n_f32(1.f)), vmulq_f32(p, r), r);
+        int32x4_t bits = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(k), vdupq_n_s32(126)), 23);
+        float32x4_t y = vmulq_f32(vmulq_f32(p, vreinterpretq_f32_s32(bits)), vdupq_n_f32(2.f));
+        y = vbslq_f32(underflow, vdupq_n_f32(0.f), y);
+        y = vbslq_f32(overflow, vdupq_n_f32(INFINITY), y);
+        y = vbslq_f32(nan, x, y);
+        vst1q_f32(out + i, y);
+    }
+    for (; i < n; i++) {
+        out[i] = vecExpScalar(in[i]);
+    }
+}
+
+static void vecLogNeon(const float* in, float* out, int n) {
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t x = vld1q_f32(in + i);
+        uint32x4_t invalid = vmvnq_u32(vcgeq_f32(x, vdupq_n_f32(0.f)));
+        uint32x4_t zero = vcltq_f32(x, vdupq_n_f32(VECMATH_FLT_MIN));
+        uint32x4_t inf = vceqq_f32(x, vdupq_n_f32(INFINITY));
+        int32x4_t bits = vreinterpretq_s32_f32(x);
+        float32x4_t e = vcvtq_f32_s32(vsubq_s32(vreinterpretq_s32_u32(
+                                          vshrq_n_u32(vreinterpretq_u32_s32(bits), 23)),
+                                      vdupq_n_s32(126)));
+        bits = vorrq_s32(vandq_s32(bits, vdupq_n_s32(0x007fffff)), vdupq_n_s32(0x3f000000));
+        float32x4_t m = vreinterpretq_f32_s32(bits);
+        uint32x4_t small = vcltq_f32(m, vdupq_n_f32(VECMATH_SQRTHF));
+        e = vsubq_f32(e, vbslq_f32(small, vdupq_n_f32(1.f), vdupq_n_f32(0.f)));
+        m = vsubq_f32(vaddq_f32(m, vbslq_f32(small, m, vdupq_n_f32(0.f))), vdupq_n_f32(1.f));
+        float32x4_t z = vmulq_f32(m, m);
+        float32x4_t y = vdupq_n_f32(7.0376836292e-2f);
+        y = vfmaq_f32(vdupq_n_f32(-1.1514610310e-1f), y, m);
+        y = vfmaq_f32(vdupq_n_f32(1.1676998740e-1f), y, m);
+        y = vfmaq_f32(vdupq_n_f32(-1.2420140846e-1f), y, m);
+        y = vfmaq_f32(vdupq_n_f32(1.4249322787e-1f), y, m);
+        y = vfmaq_f32(vdupq_n_f32(-1.6668057665e-1f), y, m);
+        y = vfmaq_f32(vdupq_n_f32(2.0000714765e-1f), y, m);
+        y = vfmaq_f32(vdupq_n_f32(-2.4999993993e-1f), y, m);
+        y = vfmaq_f32(vdupq_n_f32(3.3333331174e-1f), y, m);
+        y = vmulq_f32(vmulq_f32(y, m), z);
+        y = vfmaq_f32(y, e, vdupq_n_f32(VECMATH_LN2_LO));
+        y = vfmaq_f32(y, z, vdupq_n_f32(-0.5f));
+        y = vfmaq_f32(vaddq_f32(m, y), e, vdupq_n_f32(VECMATH_LN2_HI));
+        y = vbslq_f32(invalid, vdupq_n_f32(NAN), y);
+        y = vbslq_f32(zero, vdupq_n_f32(-INFINITY), y);
+        y = vbslq_f32(inf, x, y);
+        vst1q_f32(out + i, y);
+    }
+    for (; i < n; i++) {
+        out[i] = vecLogScalar(in[i]);
+    }
+}
+#endif
+
+// out[i] = exp(in[i]) for i in [0, n); in and out may be the same array.
+static inline void vecExp(const float* in, float* out, int n) {
+    switch (simdBestIsa()) {
+#ifdef SIMD_HAVE_X86
+    case SIMD_AVX512:
+        vecExpAvx512(in, out, n);
+        return;
+    case SIMD_AVX2:
+        vecExpAvx2(in, out, n);
+        return;
+#endif
+#ifdef SIMD_HAVE_NEON
+    case SIMD_NEON:
+        vecExpNeon(in, out, n);
+        return;
+#endif
+    default:
+        for (int i = 0; i < n; i++) {
+            out[i] = vecExpScalar(in[i]);
+        }
+        return;
+    }
+}
+
+// out[i] = log(in[i]) for i in [0, n); in and out may be the same array.
+static inline void vecLog(const float* in, float* out, int n) {
+    switch (simdBestIsa()) {
+#ifdef SIMD_HAVE_X86
+    case SIMD_AVX512:
+        vecLogAvx512(in, out, n);
+        return;
+    case SIMD_AVX2:
+        vecLogAvx2(in, out, n);
+        return;
+#endif
+#ifdef SIMD_HAVE_NEON
+    case SIMD_NEON:
+        vecLogNeon(in, out, n);
+        return;
+#endif
+    default:
+        for (int i = 0; i < n; i++) {
+            out[i] = vecLogScalar(in[i]);
+        }
+        return;
+    }
+}
+
+#endif